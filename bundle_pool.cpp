@@ -0,0 +1,141 @@
+#include "bundle_pool.h"
+#include "node_config.h"
+#include "esp_log.h"
+#include <stdlib.h>
+#include <string.h>
+#include <Arduino.h> // For FreeRTOS functions
+
+static const char *TAG = "bpool";
+
+// Buddy allocator over units of BUNDLE_POOL_MIN_BLOCK. A block of order o
+// spans 1 << o units and starts on a multiple of that; its buddy is the
+// block at unit ^ (1 << o). tag[] holds the order of every block start,
+// with TAG_FREE set while it sits on a free list, and TAG_NONE on every
+// other unit, so a free can only name a live block. Free blocks keep their
+// list links in their own first bytes.
+#define ORDERS   8
+#define TAG_FREE 0x80
+#define TAG_NONE 0xFF
+#define NIL      -1
+
+static constexpr int order_of(size_t n) { return n <= BUNDLE_POOL_MIN_BLOCK ? 0 : 1 + order_of((n + 1) / 2); }
+#define TOP order_of(BUNDLE_POOL_MAX_BLOCK)
+static_assert((BUNDLE_POOL_MIN_BLOCK & (BUNDLE_POOL_MIN_BLOCK - 1)) == 0 && (BUNDLE_POOL_MAX_BLOCK & (BUNDLE_POOL_MAX_BLOCK - 1)) == 0,
+              "pool block sizes must be powers of two");
+static_assert(TOP < ORDERS && BUNDLE_POOL_MIN_BLOCK >= 4, "pool size classes");
+
+typedef struct { int16_t prev, next; } link_t;
+static uint8_t *arena;
+static uint8_t *tag;
+static int units;
+static int16_t head[ORDERS];
+static bundle_pool_stats_t stats;
+static SemaphoreHandle_t pool_lock;
+
+static link_t *L(int u) { return (link_t*)(arena + (size_t)u * BUNDLE_POOL_MIN_BLOCK); }
+
+static void push(int u, int o) {
+    tag[u] = o | TAG_FREE;
+    L(u)->prev = NIL;
+    L(u)->next = head[o];
+    if (head[o] != NIL) L(head[o])->prev = u;
+    head[o] = u;
+}
+
+static void unlist(int u, int o) {
+    link_t *l = L(u);
+    if (l->prev == NIL) head[o] = l->next;
+    else L(l->prev)->next = l->next;
+    if (l->next != NIL) L(l->next)->prev = l->prev;
+    tag[u] = o;
+}
+
+bool bundle_pool_init(size_t bytes) {
+    units = (bytes / BUNDLE_POOL_MAX_BLOCK) << TOP;
+    if (units == 0 || units > INT16_MAX) return false;
+    arena = (uint8_t*)malloc((size_t)units * BUNDLE_POOL_MIN_BLOCK);
+    tag = (uint8_t*)malloc(units);
+    if (!arena || !tag) {
+        free(arena);
+        free(tag);
+        arena = tag = NULL;
+        return false;
+    }
+    pool_lock = xSemaphoreCreateMutex();
+    memset(tag, TAG_NONE, units);
+    for (int o = 0; o < ORDERS; o++) head[o] = NIL;
+    for (int u = units - (1 << TOP); u >= 0; u -= 1 << TOP) push(u, TOP);
+    stats.capacity = (uint32_t)units * BUNDLE_POOL_MIN_BLOCK;
+    ESP_LOGI(TAG, "%u bytes in %u-%u byte blocks", (unsigned)stats.capacity, BUNDLE_POOL_MIN_BLOCK, BUNDLE_POOL_MAX_BLOCK);
+    return true;
+}
+
+uint8_t *bundle_pool_alloc(size_t len) {
+    if (!arena || len == 0 || len > BUNDLE_POOL_MAX_BLOCK) return NULL;
+    int o = order_of(len);
+    xSemaphoreTake(pool_lock, portMAX_DELAY);
+    int k = o;
+    while (k <= TOP && head[k] == NIL) k++;
+    if (k > TOP) {
+        stats.failures++;
+        xSemaphoreGive(pool_lock);
+        return NULL;
+    }
+    int u = head[k];
+    unlist(u, k);
+    while (k > o) {  // split, keeping the low half
+        k--;
+        push(u + (1 << k), k);
+    }
+    tag[u] = o;
+    stats.used += BUNDLE_POOL_MIN_BLOCK << o;
+    stats.requested += len;
+    if (stats.used > stats.high_water) stats.high_water = stats.used;
+    stats.allocs++;
+    xSemaphoreGive(pool_lock);
+    return arena + (size_t)u * BUNDLE_POOL_MIN_BLOCK;
+}
+
+void bundle_pool_free(uint8_t *p, size_t len) {
+    if (!p) return;
+    ptrdiff_t off = arena ? p - arena : -1;
+    int o = len && len <= BUNDLE_POOL_MAX_BLOCK ? order_of(len) : TOP + 1;
+    bool in = off >= 0 && off < (ptrdiff_t)units * BUNDLE_POOL_MIN_BLOCK && off % BUNDLE_POOL_MIN_BLOCK == 0 && o <= TOP;
+    int u = in ? off / BUNDLE_POOL_MIN_BLOCK : 0;
+    xSemaphoreTake(pool_lock, portMAX_DELAY);
+    // Only the start of a live block of that order: a double free finds
+    // TAG_FREE, or TAG_NONE once the block merged into a bigger one.
+    if (!in || u & ((1 << o) - 1) || tag[u] != o) {
+        xSemaphoreGive(pool_lock);
+        ESP_LOGE(TAG, "Bad free of %u bytes at %p", (unsigned)len, p);
+        return;
+    }
+    stats.used -= BUNDLE_POOL_MIN_BLOCK << o;
+    stats.requested -= len;
+    stats.frees++;
+    while (o < TOP) {
+        int b = u ^ (1 << o);
+        if (tag[b] != (o | TAG_FREE)) break;
+        unlist(b, o);
+        tag[u > b ? u : b] = TAG_NONE;  // the upper half is no block start now
+        if (b < u) u = b;
+        o++;
+    }
+    push(u, o);
+    xSemaphoreGive(pool_lock);
+}
+
+void bundle_pool_stats(bundle_pool_stats_t *st) {
+    memset(st, 0, sizeof(*st));
+    if (!arena) return;
+    xSemaphoreTake(pool_lock, portMAX_DELAY);
+    *st = stats;
+    for (int o = TOP; o >= 0 && !st->largest_free; o--) {
+        if (head[o] != NIL) st->largest_free = BUNDLE_POOL_MIN_BLOCK << o;
+    }
+    uint32_t whole = 0;
+    for (int u = head[TOP]; u != NIL; u = L(u)->next) whole += BUNDLE_POOL_MAX_BLOCK;
+    xSemaphoreGive(pool_lock);
+    uint32_t free_bytes = st->capacity - st->used;
+    st->frag_pct = free_bytes ? (uint64_t)(free_bytes - whole) * 100 / free_bytes : 0;
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Fixed arena for DTN bundle payloads held in RAM (no flash store), so
+// days of queueing don't fragment the heap the rest of the node allocates
+// from. Blocks come in power-of-two size classes from BUNDLE_POOL_MIN_BLOCK
+// up to BUNDLE_POOL_MAX_BLOCK; a freed block merges with its buddy, so
+// free space recombines into large blocks. The arena is one heap
+// allocation made by init.
+bool bundle_pool_init(size_t bytes);
+// NULL when len is 0, above BUNDLE_POOL_MAX_BLOCK or no block is free.
+uint8_t *bundle_pool_alloc(size_t len);
+// len as passed to alloc.
+void bundle_pool_free(uint8_t *p, size_t len);
+
+typedef struct {
+    uint32_t capacity;       // arena bytes
+    uint32_t used;           // bytes in allocated blocks
+    uint32_t requested;      // bytes asked for; used - requested is lost to rounding
+    uint32_t largest_free;   // biggest block alloc can hand out now
+    uint32_t high_water;     // peak used
+    uint32_t allocs, frees;
+    uint32_t failures;       // allocs refused
+    uint8_t frag_pct;        // free bytes split below BUNDLE_POOL_MAX_BLOCK
+} bundle_pool_stats_t;
+void bundle_pool_stats(bundle_pool_stats_t *st);
@@ -0,0 +1,356 @@
+#include "bundle_store.h"
+#include "node_config.h"
+#include "esp_log.h"
+#include <string.h>
+#include <Arduino.h> // For FreeRTOS functions
+
+static const char *TAG = "bstore";
+
+// Sector: [sec_hdr_t][records...], records 4-byte aligned and never split
+// across sectors. Used sectors form one run tail..head around the ring, so
+// erases rotate over the whole partition, long-lived bundles included.
+#define SEC_SIZE    4096
+#define SEC_MAGIC   0x42535431  // "BST1"
+#define SEQ_NONE    0xFFFFFFFF  // erased, not in use yet
+#define NO_ADDR     0xFFFFFFFF
+// A record is written in WRITING state and flipped to VALID once complete;
+// delete clears it to DEAD. NOR flash only clears bits, so all three are
+// single writes.
+#define REC_WRITING 0xFF
+#define REC_VALID   0xFE
+#define REC_DEAD    0x00
+
+typedef struct { uint32_t magic, erases, seq, rsv; } sec_hdr_t;
+typedef struct {
+    uint8_t state;
+    uint8_t rsv;
+    uint16_t slot;
+    uint16_t len;
+    uint16_t rsv2;
+    uint32_t crc;  // slot, len, dest and data
+    char dest[32];
+} rec_hdr_t;
+#define REC_SIZE(len) ((sizeof(rec_hdr_t) + (len) + 3) & ~(size_t)3)
+
+#ifdef ESP_PLATFORM
+#include "esp_partition.h"
+
+static const esp_partition_t *part;
+
+static bool flash_open(uint32_t *size) {
+    part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t)BUNDLE_STORE_SUBTYPE, BUNDLE_STORE_LABEL);
+    if (!part) return false;
+    *size = part->size;
+    return true;
+}
+static bool flash_read(uint32_t addr, void *buf, size_t n) { return esp_partition_read(part, addr, buf, n) == ESP_OK; }
+static bool flash_write(uint32_t addr, const void *buf, size_t n) { return esp_partition_write(part, addr, buf, n) == ESP_OK; }
+static bool flash_erase(uint32_t addr) { return esp_partition_erase_range(part, addr, SEC_SIZE) == ESP_OK; }
+#else
+// Host builds keep the partition in a file and behave like NOR flash:
+// erase fills a sector with 0xFF and writes can only clear bits.
+#include <stdio.h>
+
+static FILE *part;
+
+static bool flash_erase(uint32_t addr) {
+    uint8_t ff[SEC_SIZE];
+    memset(ff, 0xFF, sizeof(ff));
+    return !fseek(part, addr, SEEK_SET) && fwrite(ff, 1, SEC_SIZE, part) == SEC_SIZE && !fflush(part);
+}
+
+static bool flash_open(uint32_t *size) {
+    part = fopen(BUNDLE_STORE_HOST_FILE, "r+b");
+    if (!part) {
+        part = fopen(BUNDLE_STORE_HOST_FILE, "w+b");
+        if (!part) return false;
+        for (uint32_t a = 0; a < BUNDLE_STORE_HOST_SIZE; a += SEC_SIZE) {
+            if (!flash_erase(a)) return false;
+        }
+    }
+    *size = BUNDLE_STORE_HOST_SIZE;
+    return true;
+}
+
+static bool flash_read(uint32_t addr, void *buf, size_t n) {
+    return !fseek(part, addr, SEEK_SET) && fread(buf, 1, n, part) == n;
+}
+
+static bool flash_write(uint32_t addr, const void *buf, size_t n) {
+    uint8_t cur[SEC_SIZE];
+    if (n > sizeof(cur) || !flash_read(addr, cur, n)) return false;
+    for (size_t i = 0; i < n; i++) cur[i] &= ((const uint8_t*)buf)[i];
+    return !fseek(part, addr, SEEK_SET) && fwrite(cur, 1, n, part) == n && !fflush(part);
+}
+#endif
+
+static uint32_t nsec;
+static uint16_t fill[BUNDLE_STORE_MAX_SECTORS];  // bytes used, header included
+static uint16_t live[BUNDLE_STORE_MAX_SECTORS];  // bytes of VALID records
+static uint32_t erases[BUNDLE_STORE_MAX_SECTORS];
+static uint32_t tail, head, used, next_seq;
+static uint32_t slot_addr[DTN_MAX_ITEMS];
+static uint8_t rec_buf[SEC_SIZE];  // boot scan and GC copies
+static SemaphoreHandle_t store_lock;
+static TaskHandle_t gc_handle;
+
+static uint32_t crc32(uint32_t crc, const void *p, size_t n) {
+    const uint8_t *b = (const uint8_t*)p;
+    crc = ~crc;
+    while (n--) {
+        crc ^= *b++;
+        for (int k = 0; k < 8; k++) crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+static uint32_t rec_crc(const rec_hdr_t *h, const uint8_t *data) {
+    uint32_t c = crc32(0, &h->slot, 4);  // slot and len
+    c = crc32(c, h->dest, sizeof(h->dest));
+    return crc32(c, data, h->len);
+}
+
+// Reads the record at off in sector s; false at the end of the sector's data.
+static bool rec_at(uint32_t s, uint32_t off, rec_hdr_t *h) {
+    if (off + sizeof(*h) > SEC_SIZE || !flash_read(s * SEC_SIZE + off, h, sizeof(*h))) return false;
+    return (h->state == REC_VALID || h->state == REC_DEAD) && off + REC_SIZE(h->len) <= SEC_SIZE;
+}
+
+static bool sec_erase(uint32_t s) {
+    sec_hdr_t h = { SEC_MAGIC, ++erases[s], SEQ_NONE, 0xFFFFFFFF };
+    fill[s] = live[s] = 0;
+    return flash_erase(s * SEC_SIZE) && flash_write(s * SEC_SIZE, &h, sizeof(h));
+}
+
+// Makes free sector s the new head. Blank or foreign flash is erased here,
+// the first time the ring reaches it, rather than all at once on first boot.
+static bool sec_open(uint32_t s) {
+    sec_hdr_t h;
+    if (!flash_read(s * SEC_SIZE, &h, sizeof(h))) return false;
+    if (h.magic != SEC_MAGIC || h.seq != SEQ_NONE) {
+        if (!sec_erase(s)) return false;
+        h.magic = SEC_MAGIC;
+        h.erases = erases[s];
+    }
+    h.seq = next_seq++;
+    if (!flash_write(s * SEC_SIZE, &h, sizeof(h))) return false;
+    fill[s] = sizeof(h);
+    live[s] = 0;
+    return true;
+}
+
+// Appends one record at the head, opening the next sector when it does not
+// fit and more than reserve free sectors are left (puts keep one for GC).
+static uint32_t rec_append(uint16_t slot, const char *dest, const uint8_t *data, size_t len, uint32_t reserve) {
+    size_t sz = REC_SIZE(len);
+    if (fill[head] + sz > SEC_SIZE) {
+        if (nsec - used <= reserve) return NO_ADDR;
+        uint32_t s = (head + 1) % nsec;
+        if (!sec_open(s)) {
+            ESP_LOGE(TAG, "Cannot open sector %u", (unsigned)s);
+            return NO_ADDR;
+        }
+        if (used == 0) tail = s;
+        head = s;
+        used++;
+    }
+    rec_hdr_t h;
+    memset(&h, 0, sizeof(h));
+    h.state = REC_WRITING;
+    h.slot = slot;
+    h.len = len;
+    strncpy(h.dest, dest, sizeof(h.dest) - 1);
+    h.crc = rec_crc(&h, data);
+    uint32_t addr = head * SEC_SIZE + fill[head];
+    fill[head] += sz;  // a failed write still uses the space
+    uint8_t st = REC_VALID;
+    if (!flash_write(addr, &h, sizeof(h)) || !flash_write(addr + sizeof(h), data, len) || !flash_write(addr, &st, 1)) {
+        fill[head] = SEC_SIZE;  // nothing after a torn record would be found on boot
+        return NO_ADDR;
+    }
+    live[head] += sz;
+    return addr;
+}
+
+static void rec_kill(uint32_t addr, size_t len) {
+    uint8_t st = REC_DEAD;
+    flash_write(addr, &st, 1);
+    live[addr / SEC_SIZE] -= REC_SIZE(len);
+}
+
+static uint32_t dead_bytes(void) {
+    uint32_t d = 0;
+    for (uint32_t i = 0; i < used; i++) {
+        uint32_t s = (tail + i) % nsec;
+        d += fill[s] - sizeof(sec_hdr_t) - live[s];
+    }
+    return d;
+}
+
+// Moves the tail sector's live records to the head and erases it.
+static bool gc_step(void) {
+    if (used < 2) return false;
+    uint32_t s = tail;
+    rec_hdr_t h;
+    for (uint32_t off = sizeof(sec_hdr_t); off < fill[s] && rec_at(s, off, &h); off += REC_SIZE(h.len)) {
+        uint32_t a = s * SEC_SIZE + off;
+        if (h.state != REC_VALID || h.slot >= DTN_MAX_ITEMS || slot_addr[h.slot] != a) continue;
+        if (!flash_read(a + sizeof(h), rec_buf, h.len)) return false;
+        uint32_t n = rec_append(h.slot, h.dest, rec_buf, h.len, 0);
+        if (n == NO_ADDR) return false;
+        slot_addr[h.slot] = n;
+        live[s] -= REC_SIZE(h.len);
+    }
+    if (!sec_erase(s)) return false;
+    tail = (tail + 1) % nsec;
+    used--;
+    return true;
+}
+
+static void gc_task(void *arg) {
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        // Without a sector's worth of dead records a step only rotates live
+        // data, so stop there; puts fail once the store is really full.
+        bool more = true;
+        while (more) {
+            xSemaphoreTake(store_lock, portMAX_DELAY);
+            more = nsec - used < BUNDLE_STORE_GC_FREE && dead_bytes() >= SEC_SIZE && gc_step();
+            xSemaphoreGive(store_lock);
+            vTaskDelay(1);  // let puts and gets in between sectors
+        }
+    }
+}
+
+bool bundle_store_init(bundle_store_found_t found) {
+    store_lock = xSemaphoreCreateMutex();
+    for (int i = 0; i < DTN_MAX_ITEMS; i++) slot_addr[i] = NO_ADDR;
+    uint32_t size;
+    if (!flash_open(&size)) {
+        ESP_LOGE(TAG, "No '%s' partition, bundles stay in RAM", BUNDLE_STORE_LABEL);
+        return false;
+    }
+    nsec = size / SEC_SIZE;
+    if (nsec > BUNDLE_STORE_MAX_SECTORS) nsec = BUNDLE_STORE_MAX_SECTORS;
+    if (nsec < 2) return false;
+
+    // Sector headers: the highest sequence number is the head, and the run of
+    // used sectors behind it ends at the tail.
+    // A reset between erase and header loses a sector's count; it inherits
+    // the highest one seen.
+    uint32_t top = 0, most = 0;
+    bool any = false;
+    for (uint32_t s = 0; s < nsec; s++) {
+        sec_hdr_t h;
+        if (!flash_read(s * SEC_SIZE, &h, sizeof(h))) return false;
+        bool ok = h.magic == SEC_MAGIC;
+        erases[s] = ok ? h.erases : SEQ_NONE;
+        if (ok && h.erases > most) most = h.erases;
+        if (ok && h.seq != SEQ_NONE && (!any || h.seq > top)) { top = h.seq; head = s; any = true; }
+    }
+    for (uint32_t s = 0; s < nsec; s++) if (erases[s] == SEQ_NONE) erases[s] = most;
+    next_seq = any ? top + 1 : 0;
+    used = 0;
+    tail = head;
+    if (any) {
+        for (uint32_t s = head; used < nsec; s = (s + nsec - 1) % nsec) {
+            sec_hdr_t h;
+            flash_read(s * SEC_SIZE, &h, sizeof(h));
+            if (h.magic != SEC_MAGIC || h.seq == SEQ_NONE || h.seq > top) break;
+            top = h.seq;
+            tail = s;
+            used++;
+        }
+    }
+
+    // Records, oldest first: a slot seen twice (GC cut short by a reset)
+    // keeps its newer copy.
+    rec_hdr_t h;
+    for (uint32_t i = 0; i < used; i++) {
+        uint32_t s = (tail + i) % nsec, off = sizeof(sec_hdr_t);
+        for (; rec_at(s, off, &h); off += REC_SIZE(h.len)) {
+            uint32_t a = s * SEC_SIZE + off;
+            if (h.state != REC_VALID || h.slot >= DTN_MAX_ITEMS) continue;
+            if (!flash_read(a + sizeof(h), rec_buf, h.len) || rec_crc(&h, rec_buf) != h.crc) continue;
+            if (slot_addr[h.slot] != NO_ADDR) {
+                rec_hdr_t old;
+                flash_read(slot_addr[h.slot], &old, sizeof(old));
+                rec_kill(slot_addr[h.slot], old.len);
+            }
+            slot_addr[h.slot] = a;
+            live[s] += REC_SIZE(h.len);
+        }
+        fill[s] = off;
+    }
+    // Never append behind whatever a reset may have cut short; on an empty
+    // store the first put opens sector 0.
+    if (!used) head = nsec - 1;
+    fill[head] = SEC_SIZE;
+
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < used; i++) {
+        uint32_t s = (tail + i) % nsec;
+        for (uint32_t off = sizeof(sec_hdr_t); off < fill[s] && rec_at(s, off, &h); off += REC_SIZE(h.len)) {
+            if (h.state != REC_VALID || h.slot >= DTN_MAX_ITEMS || slot_addr[h.slot] != s * SEC_SIZE + off) continue;
+            found(h.slot, h.dest, h.len);
+            n++;
+        }
+    }
+    ESP_LOGI(TAG, "%u bundles restored, %u of %u sectors in use", (unsigned)n, (unsigned)used, (unsigned)nsec);
+    xTaskCreate(gc_task, "bstore_gc", 4096, NULL, 1, &gc_handle);  // below every network task
+    if (nsec - used < BUNDLE_STORE_GC_FREE) xTaskNotifyGive(gc_handle);
+    return true;
+}
+
+bool bundle_store_put(uint16_t slot, const char *dest, const uint8_t *data, size_t len) {
+    if (slot >= DTN_MAX_ITEMS || REC_SIZE(len) > SEC_SIZE - sizeof(sec_hdr_t)) return false;
+    xSemaphoreTake(store_lock, portMAX_DELAY);
+    uint32_t a = nsec ? rec_append(slot, dest, data, len, 1) : NO_ADDR;
+    if (a != NO_ADDR) {
+        // A slot put again drops its old record, or a later delete would
+        // only kill the new one and the old one come back on boot.
+        rec_hdr_t h;
+        if (slot_addr[slot] != NO_ADDR && flash_read(slot_addr[slot], &h, sizeof(h))) rec_kill(slot_addr[slot], h.len);
+        slot_addr[slot] = a;
+    }
+    bool gc = nsec && nsec - used < BUNDLE_STORE_GC_FREE;
+    xSemaphoreGive(store_lock);
+    if (gc) xTaskNotifyGive(gc_handle);
+    return a != NO_ADDR;
+}
+
+bool bundle_store_get(uint16_t slot, uint8_t *data, size_t len) {
+    if (slot >= DTN_MAX_ITEMS) return false;
+    xSemaphoreTake(store_lock, portMAX_DELAY);
+    uint32_t a = slot_addr[slot];
+    rec_hdr_t h;
+    bool ok = a != NO_ADDR && flash_read(a, &h, sizeof(h)) && h.len == len &&
+              flash_read(a + sizeof(h), data, len) && rec_crc(&h, data) == h.crc;
+    xSemaphoreGive(store_lock);
+    if (!ok) ESP_LOGE(TAG, "Bundle in slot %u unreadable", slot);
+    return ok;
+}
+
+void bundle_store_del(uint16_t slot) {
+    if (slot >= DTN_MAX_ITEMS) return;
+    xSemaphoreTake(store_lock, portMAX_DELAY);
+    uint32_t a = slot_addr[slot];
+    rec_hdr_t h;
+    if (a != NO_ADDR && flash_read(a, &h, sizeof(h))) rec_kill(a, h.len);
+    slot_addr[slot] = NO_ADDR;
+    xSemaphoreGive(store_lock);
+}
+
+void bundle_store_stats(bundle_store_stats_t *st) {
+    memset(st, 0, sizeof(*st));
+    xSemaphoreTake(store_lock, portMAX_DELAY);
+    st->sectors = nsec;
+    st->free_sectors = nsec - used;
+    st->dead_bytes = dead_bytes();
+    for (uint32_t i = 0; i < nsec; i++) {
+        st->live_bytes += live[i];
+        if (i == 0 || erases[i] < st->min_erases) st->min_erases = erases[i];
+        if (erases[i] > st->max_erases) st->max_erases = erases[i];
+    }
+    xSemaphoreGive(store_lock);
+}
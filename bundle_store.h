@@ -0,0 +1,24 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Log-structured bundle store on the BUNDLE_STORE_LABEL flash partition (a
+// file on host builds). Records are appended with a CRC and only marked
+// dead on delete; a background task reclaims the oldest sector once free
+// sectors run low. Bundles live in caller-chosen slots below DTN_MAX_ITEMS.
+// On boot every live bundle is handed to found() in the order it was put.
+// init returns false when there is no partition.
+typedef void (*bundle_store_found_t)(uint16_t slot, const char *dest, size_t len);
+bool bundle_store_init(bundle_store_found_t found);
+bool bundle_store_put(uint16_t slot, const char *dest, const uint8_t *data, size_t len);
+// False if the record is missing or fails its CRC; the bundle is lost.
+bool bundle_store_get(uint16_t slot, uint8_t *data, size_t len);
+void bundle_store_del(uint16_t slot);
+
+typedef struct {
+    uint32_t sectors, free_sectors;
+    uint32_t live_bytes, dead_bytes;
+    uint32_t min_erases, max_erases;
+} bundle_store_stats_t;
+void bundle_store_stats(bundle_store_stats_t *st);
@@ -0,0 +1,189 @@
+#include "cgr.h"
+#include "storage.h"
+#include "node_config.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include <cJSON.h>
+#include <string.h>
+#include <stdlib.h>
+#include <Arduino.h> // For FreeRTOS functions
+
+static const char *TAG = "CGR";
+
+typedef struct {
+    char from[32], to[32];
+    uint64_t start, end;  // Unix ms
+    uint32_t rate;        // bytes per second
+    uint32_t left;        // volume not reserved yet
+} plan_t;
+static plan_t P[DTN_CGR_MAX_CONTACTS];
+static_assert(DTN_CGR_MAX_CONTACTS <= 64, "routes are bit masks of plan entries");
+static int PN;
+static uint16_t gen = 1;  // bumped with every new plan
+static int64_t epoch_ms;  // Unix ms minus esp_timer ms; 0 until the phone sets it
+static SemaphoreHandle_t cgr_lock;
+
+static uint64_t unix_ms(void) {
+    return epoch_ms ? esp_timer_get_time() / 1000 + epoch_ms : 0;
+}
+
+// Keeps the clock from storage out: esp_timer restarted with the node.
+static bool parse(const char *json, size_t len, bool from_phone) {
+    char *s = strndup(json, len);
+    cJSON *m = s ? cJSON_Parse(s) : NULL;
+    free(s);
+    if (!m) return false;
+    const cJSON *type = cJSON_GetObjectItem(m, "type"), *now = cJSON_GetObjectItem(m, "now");
+    const cJSON *list = cJSON_GetObjectItem(m, "contacts");
+    if (!type || !cJSON_IsString(type) || strcmp(type->valuestring, "CONTACT_PLAN")) {
+        cJSON_Delete(m);
+        return false;
+    }
+    if (from_phone && now && cJSON_IsNumber(now)) {
+        epoch_ms = (int64_t)(now->valuedouble * 1000) - esp_timer_get_time() / 1000;
+        ESP_LOGI(TAG, "Clock set from phone");
+    }
+    if (!list || !cJSON_IsArray(list)) {
+        cJSON_Delete(m);
+        return true;
+    }
+    static plan_t np[DTN_CGR_MAX_CONTACTS];  // phone task only
+    int n = 0;
+    const cJSON *c;
+    cJSON_ArrayForEach(c, list) {
+        const cJSON *f[5];
+        bool ok = cJSON_IsArray(c) && cJSON_GetArraySize(c) == 5 && n < DTN_CGR_MAX_CONTACTS;
+        for (int k = 0; ok && k < 5; k++) {
+            f[k] = cJSON_GetArrayItem(c, k);
+            ok = k < 2 ? cJSON_IsString(f[k]) && strlen(f[k]->valuestring) < 32 : cJSON_IsNumber(f[k]);
+        }
+        if (!ok || f[3]->valuedouble <= f[2]->valuedouble || f[4]->valuedouble < 1) {
+            ESP_LOGW(TAG, "Bad contact %d in plan", n);
+            cJSON_Delete(m);
+            return false;
+        }
+        plan_t *p = &np[n++];
+        strcpy(p->from, f[0]->valuestring);
+        strcpy(p->to, f[1]->valuestring);
+        p->start = (uint64_t)(f[2]->valuedouble * 1000);
+        p->end = (uint64_t)(f[3]->valuedouble * 1000);
+        p->rate = (uint32_t)f[4]->valuedouble;
+        double vol = (f[3]->valuedouble - f[2]->valuedouble) * p->rate;
+        p->left = vol > UINT32_MAX ? UINT32_MAX : (uint32_t)vol;
+    }
+    cJSON_Delete(m);
+    xSemaphoreTake(cgr_lock, portMAX_DELAY);
+    memcpy(P, np, n * sizeof(P[0]));
+    PN = n;
+    gen = gen == UINT16_MAX ? 1 : gen + 1;
+    xSemaphoreGive(cgr_lock);
+    ESP_LOGI(TAG, "Contact plan with %d contacts loaded", n);
+    return true;
+}
+
+void cgr_init(void) {
+    cgr_lock = xSemaphoreCreateMutex();
+    static char buf[DTN_CGR_PLAN_BYTES];
+    size_t len = sizeof(buf);
+    if (storage_get_blob("cgr_plan", buf, &len)) parse(buf, len, false);
+}
+
+bool cgr_load(const char *json, size_t len) {
+    if (!parse(json, len, true)) return false;
+    if (len <= DTN_CGR_PLAN_BYTES && !storage_set_blob("cgr_plan", json, len)) ESP_LOGW(TAG, "Contact plan not saved");
+    return true;
+}
+
+// Route search state, under cgr_lock. Node 0 is this node.
+#define CGR_NODES (2 * DTN_CGR_MAX_CONTACTS + 2)
+static const char *names[CGR_NODES];
+static uint64_t arrive[CGR_NODES];
+static int16_t via[CGR_NODES];  // contact that arrives first
+static bool done[CGR_NODES];
+static int nn;
+
+static int node_idx(const char *id) {
+    for (int i = 0; i < nn; i++) if (!strcmp(names[i], id)) return i;
+    names[nn] = id;
+    return nn++;
+}
+
+// Dijkstra on arrival times: contacts are FIFO, so the first arrival at a
+// node is the only one worth extending.
+static int earliest_route(const char *dest, uint32_t bytes, uint64_t now) {
+    nn = 0;
+    node_idx(NODE_ID);
+    for (int i = 0; i < PN; i++) {
+        node_idx(P[i].from);
+        node_idx(P[i].to);
+    }
+    int d = node_idx(dest);
+    for (int i = 0; i < nn; i++) {
+        arrive[i] = UINT64_MAX;
+        via[i] = -1;
+        done[i] = false;
+    }
+    arrive[0] = now;
+    while (1) {
+        int u = -1;
+        for (int i = 0; i < nn; i++) if (!done[i] && arrive[i] != UINT64_MAX && (u < 0 || arrive[i] < arrive[u])) u = i;
+        if (u < 0) return -1;
+        if (u == d) return d;
+        done[u] = true;
+        for (int i = 0; i < PN; i++) {
+            const plan_t *c = &P[i];
+            if (c->left < bytes || c->end <= arrive[u] || strcmp(c->from, names[u])) continue;
+            uint64_t t = (arrive[u] > c->start ? arrive[u] : c->start) + (uint64_t)bytes * 1000 / c->rate;
+            int v = node_idx(c->to);
+            if (t <= c->end && t < arrive[v]) {
+                arrive[v] = t;
+                via[v] = i;
+            }
+        }
+    }
+}
+
+bool cgr_route(const char *dest, uint32_t bytes, uint8_t *contact, uint16_t *g, uint64_t *route) {
+    const char *dot = strchr(dest, '.');
+    uint64_t now = unix_ms();
+    if (!now) return false;
+    xSemaphoreTake(cgr_lock, portMAX_DELAY);
+    int v = PN ? earliest_route(dot ? dot + 1 : dest, bytes, now) : -1;
+    bool ok = v > 0;
+    uint64_t at = ok ? arrive[v] : 0;
+    // Back from dest to here, reserving the volume on every contact.
+    *route = 0;
+    while (v > 0) {
+        int c = via[v];
+        P[c].left -= bytes;
+        *route |= 1ull << c;
+        *contact = c;
+        v = node_idx(P[c].from);
+    }
+    if (ok) {
+        *g = gen;
+        ESP_LOGI(TAG, "Route to %s via %s, arriving in %u s", dest, P[*contact].to, (unsigned)((at - now) / 1000));
+    }
+    xSemaphoreGive(cgr_lock);
+    return ok;
+}
+
+void cgr_release(uint64_t route, uint16_t g, uint32_t bytes) {
+    xSemaphoreTake(cgr_lock, portMAX_DELAY);
+    for (int c = 0; g == gen && c < PN; c++) {
+        if (route >> c & 1) P[c].left += bytes;
+    }
+    xSemaphoreGive(cgr_lock);
+}
+
+bool cgr_contact(uint8_t contact, uint16_t g, char to[32], uint64_t *open_us) {
+    uint64_t now = unix_ms();
+    xSemaphoreTake(cgr_lock, portMAX_DELAY);
+    bool ok = now && g == gen && contact < PN && P[contact].end > now;
+    if (ok) {
+        memcpy(to, P[contact].to, 32);
+        *open_us = esp_timer_get_time() + (P[contact].start > now ? (P[contact].start - now) * 1000 : 0);
+    }
+    xSemaphoreGive(cgr_lock);
+    return ok;
+}
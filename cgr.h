@@ -0,0 +1,25 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Contact graph routing over a plan of scheduled contacts, for DTN bundles
+// with no path through the mesh. The plan comes from the phone as one JSON
+// message and is kept in storage:
+//   {"type":"CONTACT_PLAN","now":<Unix s>,
+//    "contacts":[["from","to",<start Unix s>,<end Unix s>,<bytes/s>],...]}
+// "now" sets the node's clock, which the plan needs; without "contacts" the
+// message only does that.
+void cgr_init(void);
+bool cgr_load(const char *json, size_t len);
+// Earliest-arrival route to dest for a bundle of bytes leaving now. Its
+// volume is reserved on every contact of the route, returned in *route as
+// one bit per plan entry, and the first one is returned as (contact, plan
+// generation) for cgr_contact().
+bool cgr_route(const char *dest, uint32_t bytes, uint8_t *contact, uint16_t *gen, uint64_t *route);
+// Gives the volume of a route back, for a bundle that is gone or takes
+// another way; nothing once the plan changed.
+void cgr_release(uint64_t route, uint16_t gen, uint32_t bytes);
+// The neighbor a routed bundle goes to and when that contact opens
+// (esp_timer time); false once the contact is over or the plan changed.
+bool cgr_contact(uint8_t contact, uint16_t gen, char to[32], uint64_t *open_us);
@@ -1,7 +1,9 @@
 #include "crypto_abstraction.h"
 #include "storage.h"
-#include "mbedtls/md.h"
+#include "mbedtls/sha256.h"
 #include "esp_random.h"
+#include "node_config.h"
+#include <Arduino.h> // For FreeRTOS functions
 #include <string.h>
 #include <cstdio> // For sprintf, sscanf
 
@@ -47,18 +49,70 @@ bool crypto_verify(const uint8_t signature[64], const uint8_t pub_key[32], const
     return crypto_eddsa_check(signature, pub_key, msg, msg_len) == 0;  // Correct function from monocypher.h
 }
 
-void x25519_ephemeral(eph_kp_t *kp) { random_bytes(kp->priv, 32); crypto_x25519_public_key(kp->pub, kp->priv); }
+// Ephemeral keys come from a pool filled by a lowest-priority task, so the
+// send path normally pays only for the agreement. The secret is clamped up
+// front, which makes the fixed-base dirty_fast result the regular X25519
+// public key (it only differs in the low three bits we clear).
+static QueueHandle_t eph_pool;
+static volatile uint32_t eph_hits, eph_misses;
+
+static void eph_generate(eph_kp_t *kp) {
+    random_bytes(kp->priv, 32);
+    kp->priv[0] &= 248;
+    kp->priv[31] &= 127;
+    kp->priv[31] |= 64;
+    crypto_x25519_dirty_fast(kp->pub, kp->priv);
+}
+
+static void eph_pool_task(void *arg) {
+    eph_kp_t kp;
+    while (1) {
+        eph_generate(&kp);
+        xQueueSend(eph_pool, &kp, portMAX_DELAY);  // blocks while the pool is full
+    }
+}
+
+void x25519_pool_init(void) {
+    eph_pool = xQueueCreate(X25519_POOL_SIZE, sizeof(eph_kp_t));
+    xTaskCreate(eph_pool_task, "eph_pool", 4096, NULL, 1, NULL);  // below every radio task
+}
+
+void x25519_pool_stats(uint32_t *hits, uint32_t *misses) {
+    *hits = eph_hits;
+    *misses = eph_misses;
+}
+
+void x25519_ephemeral(eph_kp_t *kp) {
+    if (eph_pool && xQueueReceive(eph_pool, kp, 0) == pdTRUE) {
+        eph_hits++;
+        return;
+    }
+    eph_misses++;
+    eph_generate(kp);
+}
 void x25519_shared(const uint8_t my_priv[32], const uint8_t peer_pub[32], uint8_t out[32]) { crypto_x25519(out, my_priv, peer_pub); }
 
+// HMAC over the streaming SHA-256 API: unlike mbedtls_md_setup() it keeps
+// all state on the stack, so key derivation never touches the heap.
 static void hmac_sha256(const uint8_t *key, size_t key_len, const uint8_t *data, size_t data_len, uint8_t out[32]) {
-    mbedtls_md_context_t ctx;
-    const mbedtls_md_info_t *info = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
-    mbedtls_md_init(&ctx);
-    mbedtls_md_setup(&ctx, info, 1);
-    mbedtls_md_hmac_starts(&ctx, key, key_len);
-    mbedtls_md_hmac_update(&ctx, data, data_len);
-    mbedtls_md_hmac_finish(&ctx, out);
-    mbedtls_md_free(&ctx);
+    uint8_t k[64] = {0}, pad[64], inner[32];
+    if (key_len > 64) mbedtls_sha256(key, key_len, k, 0);
+    else memcpy(k, key, key_len);
+    mbedtls_sha256_context ctx;
+    mbedtls_sha256_init(&ctx);
+    for (int i = 0; i < 64; i++) pad[i] = k[i] ^ 0x36;
+    mbedtls_sha256_starts(&ctx, 0);
+    mbedtls_sha256_update(&ctx, pad, 64);
+    mbedtls_sha256_update(&ctx, data, data_len);
+    mbedtls_sha256_finish(&ctx, inner);
+    for (int i = 0; i < 64; i++) pad[i] = k[i] ^ 0x5c;
+    mbedtls_sha256_starts(&ctx, 0);
+    mbedtls_sha256_update(&ctx, pad, 64);
+    mbedtls_sha256_update(&ctx, inner, 32);
+    mbedtls_sha256_finish(&ctx, out);
+    mbedtls_sha256_free(&ctx);
+    crypto_wipe(k, sizeof(k));
+    crypto_wipe(pad, sizeof(pad));
 }
 
 void hkdf_sha256(const uint8_t *ikm, size_t ikm_len, const uint8_t *info, size_t info_len, uint8_t out32[32]) {
@@ -91,4 +145,12 @@ bool aead_decrypt_xc20p(const uint8_t key[32], const uint8_t nonce24[24], const
     if (rc != 0) return false;
     *pt_len = plen;
     return true;
+}
+
+void aead_lock_inplace_xc20p(const uint8_t key[32], const uint8_t nonce24[24], uint8_t *buf, size_t len, uint8_t mac[16]) {
+    crypto_aead_lock(buf, mac, key, nonce24, NULL, 0, buf, len);  // Monocypher allows exact overlap
+}
+
+bool aead_unlock_inplace_xc20p(const uint8_t key[32], const uint8_t nonce24[24], uint8_t *buf, size_t len, const uint8_t mac[16]) {
+    return crypto_aead_unlock(buf, mac, key, nonce24, NULL, 0, buf, len) == 0;
 }
\ No newline at end of file
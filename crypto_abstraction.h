@@ -20,12 +20,17 @@ void crypto_sign(uint8_t signature[64], const uint8_t *msg, size_t msg_len);
 bool crypto_verify(const uint8_t signature[64], const uint8_t pub_key[32], const uint8_t *msg, size_t msg_len);
 
 typedef struct { uint8_t priv[32]; uint8_t pub[32]; } eph_kp_t;
+// Served from a background pool when it has one ready (see x25519_pool_init).
 void x25519_ephemeral(eph_kp_t *kp);
+void x25519_pool_init(void);
+void x25519_pool_stats(uint32_t *hits, uint32_t *misses);
 void x25519_shared(const uint8_t my_priv[32], const uint8_t peer_pub[32], uint8_t out[32]);
 
 void hkdf_sha256(const uint8_t *ikm, size_t ikm_len, const uint8_t *info, size_t info_len, uint8_t out32[32]);
 
 bool aead_encrypt_xc20p(const uint8_t key[32], const uint8_t nonce24[24], const uint8_t *pt, size_t pt_len, uint8_t *ct, size_t *ct_len);
 bool aead_decrypt_xc20p(const uint8_t key[32], const uint8_t nonce24[24], const uint8_t *ct, size_t ct_len, uint8_t *pt, size_t *pt_len);
+void aead_lock_inplace_xc20p(const uint8_t key[32], const uint8_t nonce24[24], uint8_t *buf, size_t len, uint8_t mac[16]);
+bool aead_unlock_inplace_xc20p(const uint8_t key[32], const uint8_t nonce24[24], uint8_t *buf, size_t len, const uint8_t mac[16]);
 
 void random_bytes(uint8_t *out, size_t n);
\ No newline at end of file
@@ -3,51 +3,997 @@
 #include "radio.h"
 #include "mesh.h"
 #include "onion.h"
+#include "bundle_store.h"
+#include "bundle_pool.h"
+#include "prophet.h"
+#include "cgr.h"
+#include "crypto_abstraction.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
 #include <string.h>
 #include <stdlib.h>
+#include <atomic>
 #include <Arduino.h> // For FreeRTOS functions
 
 static const char* TAG = "DTN";
-typedef struct { char dest[32]; uint8_t *buf; size_t len; } item_t;
+// Bundles sit in fixed slots chained into one FIFO per destination, plus a
+// free list; heads come off in O(1) and a destination without a route only
+// holds up its own list. A hash index finds a slot by bundle id, which
+// keeps duplicates out and makes acks and summary vectors cheap to match.
+// Payloads live in the bundle store under the slot number behind a REC_HDR
+// header or, on nodes without the flash partition, in the RAM payload pool
+// (buf, bundle_pool.h).
+//
+// Every bundle carries a priority and a lifetime. Expiry times sit in a
+// min-heap; admission is held to a byte budget (the pool in RAM),
+// and when something does not fit, expired and then lower-priority bundles
+// make room, so urgent messages get through a backlog of bulk ones.
+//
+// Custody goes hop by hop: a bundle is handed to a direct neighbor, which
+// stores it and answers with a signed custody ack; only then is it dropped
+// here. Until then it is resent with exponential backoff, rotating through
+// the neighbors mesh_next_hops() offers. Without any, a contact plan may
+// still route it (cgr.h): it then waits for the first contact of the route
+// that arrives soonest. The origin seals the payload in a one-hop onion to
+// the destination, so custodians only see where it goes.
+//
+// Epidemic and spray bundles need no route: on every contact both sides
+// send a signed summary vector of the ids they hold or delivered, and each
+// pushes copies of what the other lacks. A spray bundle gives away half its
+// copies per push and, down to one, waits to meet its destination. A
+// PRoPHET bundle is only copied to neighbors more likely than this node to
+// meet its destination; the vectors carry each side's predictabilities.
+// Copies stay until the destination's own vector shows it has the bundle.
+#define NIL -1
+#define REC_HDR 19  // id, from_h, mode, copies, prio, lifetime left when stored
+typedef struct {
+    uint8_t *buf;
+    uint16_t len;       // payload bytes, 0 = free slot
+    int16_t next;
+    int16_t hpos;       // index into H
+    uint8_t d;          // index into D
+    uint8_t tries;
+    uint8_t mode;
+    uint8_t copies;     // spray copies left here
+    uint8_t prio;
+    uint8_t cgr_c;      // first contact of its planned route, see cgr.h
+    uint16_t cgr_gen;
+    uint32_t from_h;    // custodian it came from, not handed straight back
+    uint64_t cgr_route; // contacts holding its volume, 0 once released
+    uint64_t id;
+    uint64_t due;       // esp_timer time of the next attempt
+    uint64_t expires;   // esp_timer time
+} item_t;
+typedef struct { char dest[32]; int16_t head, tail; } dlist_t;
 static item_t Q[DTN_MAX_ITEMS];
+static dlist_t D[DTN_MAX_DESTS];
+static int16_t free_head;
 static int QN = 0;
+static int16_t H[DTN_MAX_ITEMS];  // min-heap of slots by expires
+#define IDX_SIZE (2 * DTN_MAX_ITEMS)
+static int16_t idx[IDX_SIZE];     // id -> slot, open addressing, at most half full
+// Slot tables, the store's record addresses included, sit in DRAM.
+static_assert(DTN_MAX_ITEMS * (sizeof(item_t) + 3 * sizeof(int16_t) + sizeof(uint32_t)) <= DTN_SLOT_RAM_MAX,
+              "bundle slots take more DRAM than DTN_SLOT_RAM_MAX");
+static int HN;
+static uint32_t bytes_held;
+static bool persistent;
+static uint64_t seen[DTN_SEEN_SIZE];  // bundles delivered here
+static int seen_idx;
+static dtn_stats_t stats;
+// Summary vectors from neighbors until dtn_task serves them: the ids it
+// delivered, sorted, and a Bloom filter of those it holds.
+typedef struct {
+    char peer[32];
+    uint16_t n, bn;
+    uint8_t pn;
+    uint64_t ids[DTN_SEEN_SIZE];
+    uint8_t bloom[DTN_SV_BLOOM_BITS / 8];
+    uint32_t ph[DTN_PROPHET_SIZE];  // predictabilities, prophet.h
+    uint8_t pp[DTN_PROPHET_SIZE];
+} sv_t;
+static sv_t sv_in[DTN_SV_SLOTS];
+static bool sv_full[DTN_SV_SLOTS];
+typedef struct { char peer[32]; uint8_t ask, force; } contact_t;
+static QueueHandle_t contacts;  // neighbors owed our summary vector
+static SemaphoreHandle_t dtn_lock;  // phone and radio tasks enqueue, acks remove
+static TaskHandle_t dtn_handle;
+// The radio rx task runs before dtn_init(); until it is done, frames for the
+// DTN are dropped (custody senders retry) and nothing touches the queue.
+static std::atomic<bool> dtn_ready(false);
 
 static void dtn_task(void *arg);
 
-void dtn_init(void) {
-    xTaskCreate(dtn_task, "dtn_task", 4096, NULL, 3, NULL);
+static void wr64(uint8_t *p, uint64_t v) { for (int i = 0; i < 8; i++) p[i] = v >> (56 - 8 * i); }
+static uint64_t rd64(const uint8_t *p) { uint64_t v = 0; for (int i = 0; i < 8; i++) v = (v << 8) | p[i]; return v; }
+static void wr32(uint8_t *p, uint32_t v) { for (int i = 0; i < 4; i++) p[i] = v >> (24 - 8 * i); }
+static uint32_t rd32(const uint8_t *p) { uint32_t v = 0; for (int i = 0; i < 4; i++) v = (v << 8) | p[i]; return v; }
+
+// Runs on the radio task: a neighbor coming or coming back is a contact,
+// anything else may open a route. Either way the scheduler takes it.
+static void dtn_on_mesh_event(mesh_event_t ev, const char *node_id, void *arg) {
+    if (node_id) {
+        contact_t c = { {0}, 1, 0 };
+        strncpy(c.peer, node_id, sizeof(c.peer) - 1);
+        xQueueSend(contacts, &c, 0);
+    }
+    xTaskNotifyGive(dtn_handle);
+}
+
+static void heap_swap(int a, int b) {
+    int16_t t = H[a];
+    H[a] = H[b];
+    H[b] = t;
+    Q[H[a]].hpos = a;
+    Q[H[b]].hpos = b;
+}
+
+static void heap_fix(int k) {
+    while (k > 0 && Q[H[k]].expires < Q[H[(k - 1) / 2]].expires) {
+        heap_swap(k, (k - 1) / 2);
+        k = (k - 1) / 2;
+    }
+    while (1) {
+        int c = 2 * k + 1;
+        if (c >= HN) break;
+        if (c + 1 < HN && Q[H[c + 1]].expires < Q[H[c]].expires) c++;
+        if (Q[H[c]].expires >= Q[H[k]].expires) break;
+        heap_swap(k, c);
+        k = c;
+    }
+}
+
+static void heap_push(int16_t i) {
+    H[HN] = i;
+    Q[i].hpos = HN++;
+    heap_fix(HN - 1);
+}
+
+static void heap_del(int16_t i) {
+    int k = Q[i].hpos;
+    if (k != --HN) {
+        heap_swap(k, HN);
+        heap_fix(k);
+    }
+}
+
+// Bundle ids are content hashes (content_id()), so their low bits place
+// them well enough. Call these with dtn_lock held.
+static int idx_home(uint64_t id) { return (uint32_t)id % IDX_SIZE; }
+
+static int16_t dtn_find(uint64_t id) {
+    for (int k = idx_home(id); idx[k] != NIL; k = (k + 1) % IDX_SIZE) {
+        if (Q[idx[k]].id == id) return idx[k];
+    }
+    return NIL;
+}
+
+static void idx_put(int16_t i) {
+    int k = idx_home(Q[i].id);
+    while (idx[k] != NIL) k = (k + 1) % IDX_SIZE;
+    idx[k] = i;
+}
+
+// Linear probing without tombstones: later entries of the run move back
+// into the hole unless that would put them before their home.
+static void idx_del(int16_t i) {
+    int k = idx_home(Q[i].id);
+    while (idx[k] != i) k = (k + 1) % IDX_SIZE;
+    for (int j = (k + 1) % IDX_SIZE; idx[j] != NIL; j = (j + 1) % IDX_SIZE) {
+        int h = idx_home(Q[idx[j]].id);
+        if (k < j ? (h <= k || h > j) : (h <= k && h > j)) {
+            idx[k] = idx[j];
+            k = j;
+        }
+    }
+    idx[k] = NIL;
 }
 
-bool dtn_enqueue(const char *dest, const uint8_t *payload, size_t len) {
-    if (QN >= DTN_MAX_ITEMS) return false;
-    Q[QN].buf = (uint8_t*)malloc(len);
-    memcpy(Q[QN].buf, payload, len);
-    Q[QN].len = len;
-    strncpy(Q[QN].dest, dest, 31);
+static dlist_t *dlist_get(const char *dest) {
+    dlist_t *empty = NULL;
+    for (int i = 0; i < DTN_MAX_DESTS; i++) {
+        if (D[i].head != NIL && !strncmp(D[i].dest, dest, sizeof(D[i].dest) - 1)) return &D[i];
+        if (D[i].head == NIL && !empty) empty = &D[i];
+    }
+    if (!empty) return NULL;
+    strncpy(empty->dest, dest, sizeof(empty->dest) - 1);
+    empty->dest[sizeof(empty->dest) - 1] = 0;
+    return empty;
+}
+
+// Behind the bundles of the same or higher priority, so urgent ones are
+// handed on first. Q[i].prio must be set.
+static void dlist_append(dlist_t *d, int16_t i) {
+    int16_t prev = NIL;
+    for (int16_t j = d->head; j != NIL && Q[j].prio >= Q[i].prio; j = Q[j].next) prev = j;
+    Q[i].d = d - D;
+    Q[i].next = prev == NIL ? d->head : Q[prev].next;
+    if (prev == NIL) d->head = i;
+    else Q[prev].next = i;
+    if (Q[i].next == NIL) d->tail = i;
     QN++;
-    return true;
 }
 
-static void dtn_task(void *arg) {
+// Bundles found in flash on boot, oldest first.
+static void dtn_restore(uint16_t slot, const char *dest, size_t len) {
+    static uint8_t rec[ONION_MAX_BYTES];
+    dlist_t *d = dlist_get(dest);
+    if (!d || len <= REC_HDR || len > sizeof(rec) || !bundle_store_get(slot, rec, len) || dtn_find(rd64(rec)) != NIL) {
+        ESP_LOGW(TAG, "Dropping stored bundle to %s", dest);
+        bundle_store_del(slot);
+        return;
+    }
+    memset(&Q[slot], 0, sizeof(Q[slot]));
+    Q[slot].len = len - REC_HDR;
+    Q[slot].id = rd64(rec);
+    Q[slot].from_h = rd32(rec + 8);
+    Q[slot].mode = rec[12];
+    Q[slot].copies = rec[13];  // as queued: copies given away since are not logged
+    Q[slot].prio = rec[14];
+    // Time spent powered off is not known; the lifetime restarts from
+    // what was left when the bundle was stored.
+    Q[slot].expires = esp_timer_get_time() + (uint64_t)rd32(rec + 15) * 1000000;
+    dlist_append(d, slot);
+    heap_push(slot);
+    idx_put(slot);
+    bytes_held += Q[slot].len;
+}
+
+void dtn_init(void) {
+    dtn_lock = xSemaphoreCreateMutex();
+    contacts = xQueueCreate(DTN_SV_SLOTS * 2, sizeof(contact_t));
+    for (int i = 0; i < DTN_MAX_DESTS; i++) D[i].head = D[i].tail = NIL;
+    for (int k = 0; k < IDX_SIZE; k++) idx[k] = NIL;
+    persistent = bundle_store_init(dtn_restore);
+    if (!persistent && !bundle_pool_init(DTN_RAM_BYTE_BUDGET)) ESP_LOGE(TAG, "No memory for the bundle pool; DTN queue disabled");
+    cgr_init();
+    free_head = NIL;
+    for (int i = DTN_MAX_ITEMS - 1; i >= 0; i--) {
+        if (Q[i].len) continue;
+        Q[i].next = free_head;
+        free_head = i;
+    }
+    if (QN) ESP_LOGI(TAG, "%d queued bundles restored", QN);
+    xTaskCreate(dtn_task, "dtn_task", DTN_TASK_STACK, NULL, 3, &dtn_handle);
+    size_t dram = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    ESP_LOGI(TAG, "%d bundle slots in %u bytes of RAM, %u bytes of DRAM left", DTN_MAX_ITEMS,
+             (unsigned)(sizeof(Q) + sizeof(H) + sizeof(idx) + (persistent ? DTN_MAX_ITEMS * sizeof(uint32_t) : 0)), (unsigned)dram);
+    if (dram < DTN_MIN_FREE_DRAM) ESP_LOGE(TAG, "Under %d bytes of DRAM left; lower DTN_MAX_ITEMS", DTN_MIN_FREE_DRAM);
+    dtn_ready = true;  // publishes everything above to the radio and phone tasks
+    mesh_subscribe(dtn_on_mesh_event, NULL);
+}
+
+// Wire size of a bundle handed to a neighbor, kind byte included; payloads
+// queued here at the origin still have to be sealed.
+static size_t bundle_size(const char *dest, size_t len, bool sealed) {
+    return 1 + 1 + strlen(NODE_ID) + 1 + strlen(dest) + 8 + 7 + (sealed ? 0 : 1 + ONION_HEADROOM(1)) + len;
+}
+
+// Call with dtn_lock held. What a bundle reserves on the contact plan.
+static uint32_t cgr_size(int16_t i) {
+    return bundle_size(D[Q[i].d].dest, Q[i].len, Q[i].from_h != 0) + ONION_HEADROOM(1);
+}
+
+// Call with dtn_lock held. Hands the volume of the planned route back.
+static void cgr_unreserve(int16_t i) {
+    if (!Q[i].cgr_route) return;
+    cgr_release(Q[i].cgr_route, Q[i].cgr_gen, cgr_size(i));
+    Q[i].cgr_route = 0;
+}
+
+// Call with dtn_lock held.
+static void dtn_remove(int16_t i) {
+    cgr_unreserve(i);
+    dlist_t *d = &D[Q[i].d];
+    int16_t prev = NIL;
+    for (int16_t j = d->head; j != i; j = Q[j].next) prev = j;
+    if (prev == NIL) d->head = Q[i].next;
+    else Q[prev].next = Q[i].next;
+    if (d->tail == i) d->tail = prev;
+    if (Q[i].buf) bundle_pool_free(Q[i].buf, Q[i].len);
+    else bundle_store_del(i);
+    heap_del(i);
+    idx_del(i);
+    bytes_held -= Q[i].len;
+    Q[i].buf = NULL;
+    Q[i].len = 0;
+    Q[i].next = free_head;
+    free_head = i;
+    QN--;
+    stats.queued = QN;
+}
+
+// Call with dtn_lock held.
+static void dtn_expire(uint64_t now) {
+    while (HN && Q[H[0]].expires <= now) {
+        ESP_LOGW(TAG, "Bundle %08x to %s expired", (unsigned)Q[H[0]].id, D[Q[H[0]].d].dest);
+        dtn_remove(H[0]);
+        stats.expired++;
+    }
+}
+
+static bool dest_known(const char *dest) {
+    for (int i = 0; i < DTN_MAX_DESTS; i++) {
+        if (D[i].head == NIL || !strncmp(D[i].dest, dest, sizeof(D[i].dest) - 1)) return true;
+    }
+    return false;
+}
+
+// Call with dtn_lock held. Makes room for len more bytes at prio: a free
+// slot and the byte budget or, in RAM, a pool block, returned in *buf.
+// Expired bundles go first, then lower-priority ones, those closest to
+// expiring first. A bundle this node answers for (its own, or one it takes
+// custody of) also pushes out copies of its priority, so a node full of
+// epidemic copies can still queue its own messages.
+static bool is_copy(const item_t *q) { return q->mode != DTN_MODE_CUSTODY && q->from_h; }
+
+static bool dtn_admit(const char *dest, size_t len, uint8_t prio, bool owned, uint8_t **buf) {
+    dtn_expire(esp_timer_get_time());
+    if (!dest_known(dest)) return false;
     while (1) {
-        if (QN > 0) {
-            const char *route[8];
-            size_t rl = 0;
-            if (mesh_choose_route(Q[0].dest, route, &rl)) {
-                ESP_LOGI(TAG, "Route found for queued message to %s.", Q[0].dest);
-                uint8_t outbuf[ONION_MAX_BYTES];
-                size_t outl = 0;
-                if (onion_build(route, rl, Q[0].buf, Q[0].len, outbuf, &outl)) {
-                    radio_send(route[0], outbuf, outl);
+        bool fits = free_head != NIL && (persistent ? bytes_held + len <= DTN_BYTE_BUDGET
+                                                    : QN < DTN_MAX_RAM_ITEMS && (*buf = bundle_pool_alloc(len)) != NULL);
+        if (fits) return true;
+        int16_t v = NIL;
+        for (int i = 0; i < DTN_MAX_ITEMS; i++) {
+            if (!Q[i].len || Q[i].prio > prio || (Q[i].prio == prio && !(owned && is_copy(&Q[i])))) continue;
+            if (v == NIL || Q[i].prio < Q[v].prio || (Q[i].prio == Q[v].prio && Q[i].expires < Q[v].expires)) v = i;
+        }
+        if (v == NIL) return false;
+        ESP_LOGW(TAG, "Evicting bundle %08x to %s for a priority %u one", (unsigned)Q[v].id, D[Q[v].d].dest, prio);
+        dtn_remove(v);
+        stats.evicted++;
+    }
+}
+
+// o->lifetime_s is what is left of the bundle's lifetime. A bundle already
+// held is not stored twice.
+static bool dtn_store(const char *dest, uint64_t id, uint32_t from_h, const dtn_opts_t *o, const uint8_t *payload, size_t len) {
+    if (len == 0 || o->lifetime_s == 0 || strlen(dest) >= sizeof(D[0].dest) ||
+        bundle_size(dest, len, from_h != 0) + ONION_HEADROOM(1) > ONION_MAX_BYTES) return false;
+    static uint8_t rec[ONION_MAX_BYTES];  // under dtn_lock
+    uint8_t *copy = NULL;
+    xSemaphoreTake(dtn_lock, portMAX_DELAY);
+    if (dtn_find(id) != NIL) {
+        xSemaphoreGive(dtn_lock);
+        return true;
+    }
+    bool ok = dtn_admit(dest, len, o->prio, !from_h || o->mode == DTN_MODE_CUSTODY, &copy);
+    int16_t i = free_head;
+    dlist_t *d = ok ? dlist_get(dest) : NULL;
+    if (ok && copy) {
+        memcpy(copy, payload, len);
+    } else if (ok) {
+        wr64(rec, id);
+        wr32(rec + 8, from_h);
+        rec[12] = o->mode;
+        rec[13] = o->copies;
+        rec[14] = o->prio;
+        wr32(rec + 15, o->lifetime_s);
+        memcpy(rec + REC_HDR, payload, len);
+        ok = bundle_store_put(i, dest, rec, len + REC_HDR);
+    }
+    if (ok) {
+        free_head = Q[i].next;
+        memset(&Q[i], 0, sizeof(Q[i]));
+        Q[i].buf = copy;
+        Q[i].len = len;
+        Q[i].id = id;
+        Q[i].from_h = from_h;
+        Q[i].mode = o->mode;
+        Q[i].copies = o->copies;
+        Q[i].prio = o->prio;
+        Q[i].expires = esp_timer_get_time() + (uint64_t)o->lifetime_s * 1000000;
+        dlist_append(d, i);
+        heap_push(i);
+        idx_put(i);
+        bytes_held += len;
+        stats.queued = QN;
+    }
+    xSemaphoreGive(dtn_lock);
+    if (ok) xTaskNotifyGive(dtn_handle);  // re-arm the retry deadline
+    return ok;
+}
+
+// BLAKE2b over origin, destination and payload: a phone's retry, or the
+// same message queued twice, is the same bundle everywhere it travels.
+static uint64_t content_id(const char *dest, const uint8_t *payload, size_t len) {
+    uint8_t h[8];
+    crypto_blake2b_ctx ctx;
+    crypto_blake2b_init(&ctx, sizeof(h));
+    crypto_blake2b_update(&ctx, (const uint8_t*)NODE_ID, strlen(NODE_ID) + 1);
+    crypto_blake2b_update(&ctx, (const uint8_t*)dest, strlen(dest) + 1);
+    crypto_blake2b_update(&ctx, payload, len);
+    crypto_blake2b_final(&ctx, h);
+    return rd64(h);
+}
+
+bool dtn_enqueue(const char *dest, const uint8_t *payload, size_t len, const dtn_opts_t *opts) {
+    if (!dtn_ready) return false;
+    dtn_opts_t o = { DTN_MODE_CUSTODY, 0, DTN_PRIO_NORMAL, 0 };
+    if (opts) o = *opts;
+    if (o.mode > DTN_MODE_PROPHET || o.prio > DTN_PRIO_URGENT) return false;
+    if (o.mode == DTN_MODE_SPRAY && o.copies == 0) o.copies = DTN_SPRAY_COPIES;
+    if (o.lifetime_s == 0) o.lifetime_s = DTN_LIFETIME_S;
+    uint64_t id = content_id(dest, payload, len);
+    xSemaphoreTake(dtn_lock, portMAX_DELAY);
+    bool held = dtn_find(id) != NIL;
+    if (held) stats.duplicates++;
+    xSemaphoreGive(dtn_lock);
+    if (held) {
+        ESP_LOGI(TAG, "Bundle %08x to %s already queued", (unsigned)id, dest);
+        return true;
+    }
+    return dtn_store(dest, id, 0, &o, payload, len);
+}
+
+// Custody ack: [kind][id 8][acker len][acker][sig 64 over "custody" | id | acker].
+static size_t custody_msg(uint8_t *m, uint64_t id, const char *acker, size_t alen) {
+    memcpy(m, "custody", 7);
+    wr64(m + 7, id);
+    memcpy(m + 15, acker, alen);
+    return 15 + alen;
+}
+
+static void custody_ack(const char *to, uint64_t id) {
+    static uint8_t frame[ONION_MAX_BYTES];  // radio task only
+    size_t alen = strlen(NODE_ID);
+    size_t blen = 1 + 8 + 1 + alen + 64;
+    uint8_t *p = frame + sizeof(frame) - blen, *b = p;
+    uint8_t m[15 + 32];
+    *p++ = ONION_KIND_CUSTODY;
+    wr64(p, id);
+    p += 8;
+    *p++ = alen;
+    memcpy(p, NODE_ID, alen);
+    p += alen;
+    crypto_sign(p, m, custody_msg(m, id, NODE_ID, alen));
+    const char *route[1] = { to };
+    size_t outl = 0;
+    uint8_t *onion = onion_build(route, 1, b, blen, b - frame, &outl);
+    if (!onion || !radio_send(to, onion, outl)) ESP_LOGW(TAG, "Custody ack to %s not sent", to);
+}
+
+// Reads a [len][string] field; false if it does not fit.
+static bool take_str(const uint8_t **p, const uint8_t *end, char out[32]) {
+    if (*p >= end) return false;
+    size_t n = *(*p)++;
+    if (n == 0 || n >= 32 || (size_t)(end - *p) < n) return false;
+    memcpy(out, *p, n);
+    out[n] = 0;
+    *p += n;
+    return true;
+}
+
+bool dtn_on_bundle(const uint8_t *rec, size_t len, const uint8_t **payload, size_t *payload_len) {
+    const uint8_t *p = rec, *end = rec + len;
+    char from[32], dest[32], addr[64];
+    if (!dtn_ready) return false;
+    if (!take_str(&p, end, from) || !take_str(&p, end, dest) || end - p <= 15) return false;
+    uint64_t id = rd64(p);
+    dtn_opts_t o = { p[8], p[9], p[10], rd32(p + 11) };
+    if (o.mode > DTN_MODE_PROPHET || o.prio > DTN_PRIO_URGENT) return false;
+    p += 15;
+    bool custody = o.mode == DTN_MODE_CUSTODY;
+    bool mine = !strcmp(dest, NODE_ID) || (mesh_get_address(addr, sizeof(addr)) && !strcmp(dest, addr));
+
+    xSemaphoreTake(dtn_lock, portMAX_DELAY);
+    bool dup = false;
+    for (int i = 0; i < DTN_SEEN_SIZE && !dup; i++) dup = seen[i] == id;
+    if (!dup && !mine) dup = dtn_find(id) != NIL;  // our ack was lost, or a second copy
+    if (!dup && mine) {
+        seen[seen_idx] = id;
+        seen_idx = (seen_idx + 1) % DTN_SEEN_SIZE;
+    }
+    xSemaphoreGive(dtn_lock);
+
+    // Custody is only acked once the bundle is safe here; copies are not.
+    bool ok = dup || mine || dtn_store(dest, id, mesh_id_hash(from), &o, p, end - p);
+    xSemaphoreTake(dtn_lock, portMAX_DELAY);
+    if (!ok) stats.refused++;
+    else if (dup) stats.duplicates++;
+    else if (mine) stats.delivered++;
+    else stats.accepted++;
+    xSemaphoreGive(dtn_lock);
+    if (!ok) {
+        ESP_LOGW(TAG, "No room for bundle from %s to %s", from, dest);
+        return false;
+    }
+    if (custody) custody_ack(from, id);
+    if (!mine || dup) return false;
+    *payload = p;
+    *payload_len = end - p;
+    return true;
+}
+
+void dtn_on_custody(const uint8_t *rec, size_t len) {
+    const uint8_t *p = rec, *end = rec + len;
+    char acker[32];
+    uint8_t pub[32], m[15 + 32];
+    if (!dtn_ready || end - p < 8) return;
+    uint64_t id = rd64(p);
+    p += 8;
+    if (!take_str(&p, end, acker) || end - p != 64) return;
+    if (!mesh_get_ed25519_pub(acker, pub) || !crypto_verify(p, pub, m, custody_msg(m, id, acker, strlen(acker)))) {
+        ESP_LOGW(TAG, "Bad custody ack from %s", acker);
+        return;
+    }
+    xSemaphoreTake(dtn_lock, portMAX_DELAY);
+    int16_t i = dtn_find(id);
+    if (i != NIL) {
+        Q[i].cgr_route &= ~(1ull << Q[i].cgr_c);  // that contact carried it
+        dtn_remove(i);
+        stats.acked++;
+    }
+    xSemaphoreGive(dtn_lock);
+    if (i != NIL) ESP_LOGI(TAG, "%s took custody of bundle %08x", acker, (unsigned)id);
+}
+
+void dtn_stats(dtn_stats_t *st) {
+    memset(st, 0, sizeof(*st));
+    if (!dtn_ready) return;
+    xSemaphoreTake(dtn_lock, portMAX_DELAY);
+    *st = stats;
+    xSemaphoreGive(dtn_lock);
+}
+
+// Copies the payload to the tail of frame. Call with dtn_lock held: a
+// custody ack on the radio task may free the bundle as soon as it is released.
+static bool payload_load(uint8_t *frame, size_t cap, int16_t i) {
+    if ((size_t)Q[i].len + REC_HDR > cap) return false;
+    uint8_t *p = frame + cap - Q[i].len;
+    if (Q[i].buf) {
+        memcpy(p, Q[i].buf, Q[i].len);
+        return true;
+    }
+    // The record header lands just in front and is overwritten later.
+    return bundle_store_get(i, p - REC_HDR, Q[i].len + REC_HDR);
+}
+
+// Puts [kind][from][dest][id 8][mode][copies][prio][lifetime left 4] in front
+// of the payload at the tail of frame,
+// sealing it first if it was queued here, so the onion layer fills
+// the space in front. 0 while the destination's key is unknown.
+static size_t bundle_wrap(uint8_t *frame, size_t cap, const item_t *it, const char *dest) {
+    uint8_t *p = frame + cap - it->len;
+    if (!it->from_h) {
+        const char *dot = strchr(dest, '.');
+        const char *route[1] = { dot ? dot + 1 : dest };
+        size_t sl = 0;
+        *--p = ONION_KIND_MSG;
+        p = onion_build(route, 1, p, it->len + 1, p - frame, &sl);
+        if (!p) return 0;
+    }
+    size_t flen = strlen(NODE_ID), dlen = strlen(dest);
+    p -= 1 + 1 + flen + 1 + dlen + 8 + 7;
+    uint8_t *h = p;
+    *h++ = ONION_KIND_BUNDLE;
+    *h++ = flen;
+    memcpy(h, NODE_ID, flen);
+    h += flen;
+    *h++ = dlen;
+    memcpy(h, dest, dlen);
+    h += dlen;
+    wr64(h, it->id);
+    h[8] = it->mode;
+    h[9] = it->copies;
+    h[10] = it->prio;
+    uint64_t now = esp_timer_get_time();
+    wr32(h + 11, it->expires > now + 1000000 ? (it->expires - now) / 1000000 : 1);
+    return frame + cap - p;
+}
+
+static bool in_range(const char *node) {
+    char hop[1][32];
+    return mesh_next_hops(node, hop, 1) == 1 && !strcmp(hop[0], node);
+}
+
+// One-hop onion from the bundle at the tail of frame to a direct neighbor.
+static bool hand_to(uint8_t *frame, size_t cap, size_t blen, const char *hop) {
+    const char *route[1] = { hop };
+    size_t outl = 0;
+    uint8_t *onion = onion_build(route, 1, frame + cap - blen, blen, cap - blen, &outl);
+    return onion && radio_send(hop, onion, outl);
+}
+
+// Signed over "summary" | BLAKE2b of everything after the kind byte.
+static void sv_msg(uint8_t m[7 + 32], const uint8_t *body, size_t len) {
+    memcpy(m, "summary", 7);
+    crypto_blake2b(m + 7, 32, body, len);
+}
+
+// Copies pushed to a peer in the last round of a contact. If its next
+// vector lacks any of them, it refused them for want of room and gets no
+// more copies until the next contact, instead of the same ones every round.
+// Rounds follow each other within DTN_RETRY_MS, and a refusal keeps its
+// entry alive while the peer's vectors keep coming; a new contact starts
+// over. Eight entries cover a node passing through a crowd.
+typedef struct { uint32_t h; uint64_t t; uint8_t n; uint64_t ids[DTN_SV_PUSH_MAX]; } sv_round_t;
+static sv_round_t sv_rounds[8];
+static int sv_rounds_idx;
+
+static sv_round_t *sv_round(uint32_t h, uint64_t now) {
+    for (int i = 0; i < 8; i++) {
+        if (sv_rounds[i].h == h && now - sv_rounds[i].t < 2ull * DTN_RETRY_MS * 1000) return &sv_rounds[i];
+    }
+    return NULL;
+}
+
+// Held ids go in a Bloom filter of bn bytes, 16 bits per bundle up to
+// DTN_SV_BLOOM_BITS, so a vector covers the whole queue. Ids are content
+// hashes, so their two halves serve as the probe hashes.
+static void sv_bloom_add(uint8_t *bloom, size_t bn, uint64_t id) {
+    uint32_t h1 = (uint32_t)id, h2 = (uint32_t)(id >> 32) | 1;
+    for (uint32_t j = 0; j < DTN_SV_BLOOM_PROBES; j++) {
+        uint32_t bit = (h1 + j * h2) % (bn * 8);
+        bloom[bit / 8] |= 1 << (bit % 8);
+    }
+}
+
+static bool sv_bloom_has(const uint8_t *bloom, size_t bn, uint64_t id) {
+    if (!bn) return false;
+    uint32_t h1 = (uint32_t)id, h2 = (uint32_t)(id >> 32) | 1;
+    for (uint32_t j = 0; j < DTN_SV_BLOOM_PROBES; j++) {
+        uint32_t bit = (h1 + j * h2) % (bn * 8);
+        if (!(bloom[bit / 8] & (1 << (bit % 8)))) return false;
+    }
+    return true;
+}
+
+// Our summary vector: [kind][ask][from][n 2][ids 8*n][bn 2][bloom bn][pn]
+// [(hash 4, p) * pn][sig 64]: the ids of bundles delivered here, a filter
+// of those held, and our delivery predictabilities. ask wants theirs back.
+// When both ends see the contact, each answers the other's ask as well;
+// the holdoff keeps that to one vector each way.
+static_assert(DTN_SV_BLOOM_BITS >= 16 * DTN_MAX_ITEMS, "a full queue gets 16 filter bits per bundle");
+static_assert(ONION_HEADROOM(1) + 3 + 31 + 2 + 8 * DTN_SEEN_SIZE + 2 + DTN_SV_BLOOM_BITS / 8 + 1 + 5 * DTN_PROPHET_SIZE + 64 <= ONION_MAX_BYTES,
+              "summary vector does not fit one onion");
+static struct { uint32_t h; uint64_t t; } sv_sent[4];  // last vectors sent, for the holdoff
+static int sv_sent_idx;
+
+static void sv_send(uint8_t *frame, const contact_t *c) {
+    if (!in_range(c->peer)) return;  // gone again
+    uint32_t h = mesh_id_hash(c->peer);
+    uint64_t now = esp_timer_get_time();
+    for (int i = 0; i < 4 && !c->force; i++) {
+        if (sv_sent[i].h == h && now - sv_sent[i].t < (uint64_t)DTN_SV_HOLDOFF_MS * 1000) return;
+    }
+    sv_sent[sv_sent_idx].h = h;
+    sv_sent[sv_sent_idx].t = now;
+    sv_sent_idx = (sv_sent_idx + 1) % 4;
+    sv_round_t *r = c->ask && !c->force ? sv_round(h, now) : NULL;
+    if (r) r->n = 0;  // a new contact
+    size_t flen = strlen(NODE_ID);
+    uint8_t *b = frame + ONION_HEADROOM(1), *p = b;
+    *p++ = ONION_KIND_SUMMARY;
+    *p++ = c->ask;
+    *p++ = flen;
+    memcpy(p, NODE_ID, flen);
+    p += flen;
+    uint8_t *np = p;
+    p += 2;
+    uint16_t n = 0;
+    xSemaphoreTake(dtn_lock, portMAX_DELAY);
+    for (int i = 0; i < DTN_SEEN_SIZE; i++) {
+        if (!seen[i]) continue;
+        wr64(p, seen[i]);
+        p += 8;
+        n++;
+    }
+    size_t bn = QN * 2 < DTN_SV_BLOOM_BITS / 8 ? QN * 2 : DTN_SV_BLOOM_BITS / 8;
+    p[0] = bn >> 8;
+    p[1] = bn;
+    p += 2;
+    memset(p, 0, bn);
+    for (int i = 0; bn && i < DTN_MAX_ITEMS; i++) {
+        if (Q[i].len) sv_bloom_add(p, bn, Q[i].id);
+    }
+    p += bn;
+    xSemaphoreGive(dtn_lock);
+    np[0] = n >> 8;
+    np[1] = n;
+    uint32_t ph[DTN_PROPHET_SIZE];
+    uint8_t pp[DTN_PROPHET_SIZE];
+    int pn = prophet_export(ph, pp, DTN_PROPHET_SIZE);
+    *p++ = pn;
+    for (int i = 0; i < pn; i++) {
+        wr32(p, ph[i]);
+        p[4] = pp[i];
+        p += 5;
+    }
+    uint8_t m[7 + 32];
+    sv_msg(m, b + 1, p - b - 1);
+    crypto_sign(p, m, sizeof(m));
+    p += 64;
+    size_t outl = 0;
+    const char *route[1] = { c->peer };
+    uint8_t *onion = onion_build(route, 1, b, p - b, b - frame, &outl);
+    if (!onion || !radio_send(c->peer, onion, outl)) ESP_LOGW(TAG, "Summary vector to %s not sent", c->peer);
+}
+
+static int cmp64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+void dtn_on_summary(const uint8_t *rec, size_t len) {
+    const uint8_t *p = rec, *end = rec + len;
+    char from[32];
+    uint8_t pub[32], m[7 + 32];
+    if (!dtn_ready || len < 1) return;
+    uint8_t ask = *p++;
+    if (!take_str(&p, end, from) || end - p < 2) return;
+    size_t n = (p[0] << 8) | p[1];
+    p += 2;
+    if (n > DTN_SEEN_SIZE || (size_t)(end - p) < n * 8 + 2 + 1 + 64) return;
+    const uint8_t *pb = p + n * 8;
+    size_t bn = (pb[0] << 8) | pb[1];
+    pb += 2;
+    if (bn > DTN_SV_BLOOM_BITS / 8 || (size_t)(end - pb) < bn + 1 + 64) return;
+    const uint8_t *pv = pb + bn;
+    size_t pn = *pv++;
+    if (pn > DTN_PROPHET_SIZE || (size_t)(end - pv) != pn * 5 + 64) return;
+    sv_msg(m, rec, len - 64);
+    if (!mesh_get_ed25519_pub(from, pub) || !crypto_verify(end - 64, pub, m, sizeof(m))) {
+        ESP_LOGW(TAG, "Bad summary vector from %s", from);
+        return;
+    }
+    xSemaphoreTake(dtn_lock, portMAX_DELAY);
+    int s = 0;
+    while (s < DTN_SV_SLOTS && sv_full[s]) s++;
+    if (s < DTN_SV_SLOTS) {
+        sv_t *v = &sv_in[s];
+        memcpy(v->peer, from, sizeof(v->peer));
+        v->n = n;
+        for (size_t i = 0; i < n; i++) v->ids[i] = rd64(p + 8 * i);
+        qsort(v->ids, n, sizeof(v->ids[0]), cmp64);
+        v->bn = bn;
+        memcpy(v->bloom, pb, bn);
+        v->pn = pn;
+        for (size_t i = 0; i < pn; i++) {
+            v->ph[i] = rd32(pv + 5 * i);
+            v->pp[i] = pv[5 * i + 4];
+        }
+        sv_full[s] = true;
+    }
+    xSemaphoreGive(dtn_lock);
+    if (s == DTN_SV_SLOTS) ESP_LOGW(TAG, "Summary vector from %s dropped, busy", from);
+    if (ask) {
+        contact_t c = { {0}, 0, 0 };
+        memcpy(c.peer, from, sizeof(c.peer));
+        xQueueSend(contacts, &c, 0);
+    }
+    xTaskNotifyGive(dtn_handle);
+}
+
+static bool sv_delivered(const sv_t *v, uint64_t id) {
+    return bsearch(&id, v->ids, v->n, sizeof(v->ids[0]), cmp64) != NULL;
+}
+
+// A false positive only costs a copy not pushed, or a refusal not noticed.
+static bool sv_has(const sv_t *v, uint64_t id) {
+    return sv_delivered(v, id) || sv_bloom_has(v->bloom, v->bn, id);
+}
+
+static uint8_t sv_pred(const sv_t *v, const char *node) {
+    uint32_t h = mesh_id_hash(node);
+    for (int i = 0; i < v->pn; i++) if (v->ph[i] == h) return v->pp[i];
+    return 0;
+}
+
+// Pushes the peer of summary vector s copies of what it lacks, at most
+// DTN_SV_PUSH_MAX per round and urgent ones first, and forgets bundles it
+// is the destination of and already has.
+static void sv_serve(uint8_t *frame, int s) {
+    static struct { int16_t i; uint8_t give; bool spray; uint64_t id; } push[DTN_SV_PUSH_MAX];
+    const sv_t *v = &sv_in[s];
+    int np = 0;
+    bool more = false;
+    prophet_encounter(v->peer);
+    prophet_transitive(v->peer, v->ph, v->pp, v->pn);
+    uint32_t ph = mesh_id_hash(v->peer);
+    uint64_t now = esp_timer_get_time();
+    sv_round_t *last = sv_round(ph, now);
+    bool full = false;
+    for (int k = 0; last && k < last->n && !full; k++) {
+        full = !sv_has(v, last->ids[k]);
+    }
+    if (full) {
+        last->t = now;  // still the same contact
+        ESP_LOGI(TAG, "%s has no room for copies; none more this contact", v->peer);
+    }
+    xSemaphoreTake(dtn_lock, portMAX_DELAY);
+    for (int k = 0; k < (DTN_PRIO_URGENT + 1) * DTN_MAX_ITEMS; k++) {
+        int i = k % DTN_MAX_ITEMS;
+        if (!Q[i].len || Q[i].prio != DTN_PRIO_URGENT - k / DTN_MAX_ITEMS) continue;
+        const char *dest = D[Q[i].d].dest, *dot = strchr(dest, '.');
+        const char *node = dot ? dot + 1 : dest;
+        bool to_dest = !strcmp(node, v->peer);
+        if (to_dest && sv_delivered(v, Q[i].id)) {
+            dtn_remove(i);
+            continue;
+        }
+        if (sv_has(v, Q[i].id)) continue;
+        if (full || Q[i].mode == DTN_MODE_CUSTODY || Q[i].from_h == ph) continue;
+        if (Q[i].mode == DTN_MODE_PROPHET && !to_dest && sv_pred(v, node) <= prophet_get(node)) continue;
+        uint8_t give = Q[i].mode != DTN_MODE_SPRAY ? 0 : to_dest ? 1 : Q[i].copies / 2;
+        if (Q[i].mode == DTN_MODE_SPRAY && !give) continue;  // waiting for the destination
+        if (np == DTN_SV_PUSH_MAX) {
+            more = true;
+            break;
+        }
+        push[np].i = i;
+        push[np].give = give;
+        push[np].spray = Q[i].mode == DTN_MODE_SPRAY && !to_dest;
+        push[np++].id = Q[i].id;
+    }
+    xSemaphoreGive(dtn_lock);
+
+    sv_round_t *r = np ? sv_round(ph, now) : NULL;  // a round without copies changes nothing
+    if (np && !r) {
+        r = &sv_rounds[sv_rounds_idx];
+        sv_rounds_idx = (sv_rounds_idx + 1) % 8;
+    }
+    if (r) {
+        r->h = ph;
+        r->t = now;
+        r->n = 0;
+    }
+    for (int k = 0; k < np; k++) {
+        int16_t i = push[k].i;
+        xSemaphoreTake(dtn_lock, portMAX_DELAY);
+        bool ok = Q[i].len && Q[i].id == push[k].id && payload_load(frame, ONION_MAX_BYTES, i);
+        item_t it = Q[i];
+        char dest[32];
+        memcpy(dest, D[it.d].dest, sizeof(dest));
+        xSemaphoreGive(dtn_lock);
+        if (!ok) continue;
+        it.copies = push[k].give;
+        size_t blen = bundle_wrap(frame, ONION_MAX_BYTES, &it, dest);
+        if (!blen || !hand_to(frame, ONION_MAX_BYTES, blen, v->peer)) continue;
+        ESP_LOGI(TAG, "Copy of bundle %08x to %s pushed to %s", (unsigned)it.id, dest, v->peer);
+        r->ids[r->n++] = it.id;
+        xSemaphoreTake(dtn_lock, portMAX_DELAY);
+        if (push[k].spray && Q[i].len && Q[i].id == it.id) Q[i].copies -= it.copies;
+        stats.copied++;
+        xSemaphoreGive(dtn_lock);
+    }
+    if (more) {
+        contact_t c = { {0}, 1, 1 };  // another round
+        memcpy(c.peer, v->peer, sizeof(c.peer));
+        xQueueSend(contacts, &c, 0);
+    }
+    xSemaphoreTake(dtn_lock, portMAX_DELAY);
+    sv_full[s] = false;
+    xSemaphoreGive(dtn_lock);
+}
+
+static uint64_t backoff_us(uint8_t tries) {
+    uint32_t ms = DTN_CUSTODY_TIMEOUT_MS << (tries - 1 < DTN_BACKOFF_MAX_SHIFT ? tries - 1 : DTN_BACKOFF_MAX_SHIFT);
+    uint32_t r;
+    random_bytes((uint8_t*)&r, sizeof(r));
+    return (uint64_t)(ms - ms / 4 + r % (ms / 2 + 1)) * 1000;  // +-25% so neighbors desync
+}
+
+// Logs every new low of this task's unused stack (bytes on ESP-IDF).
+static void stack_watch(void) {
+    static UBaseType_t low = DTN_TASK_STACK;
+    UBaseType_t left = uxTaskGetStackHighWaterMark(NULL);
+    if (left >= low) return;
+    low = left;
+    if (left < STACK_WARN_BYTES) ESP_LOGW(TAG, "dtn_task stack: only %u of %u bytes never used", (unsigned)left, DTN_TASK_STACK);
+    else ESP_LOGI(TAG, "dtn_task stack: %u of %u bytes never used", (unsigned)left, DTN_TASK_STACK);
+}
+
+// One pass of the DTN task: summary vectors owed and received, expiry,
+// then every due bundle. Returns when the next one falls due.
+static uint64_t dtn_step(uint8_t *frame) {
+    contact_t c;
+    while (xQueueReceive(contacts, &c, 0) == pdTRUE) sv_send(frame, &c);
+    for (int s = 0; s < DTN_SV_SLOTS; s++) {
+        xSemaphoreTake(dtn_lock, portMAX_DELAY);
+        bool full = sv_full[s];
+        xSemaphoreGive(dtn_lock);
+        if (full) sv_serve(frame, s);
+    }
+
+    uint64_t now = esp_timer_get_time();
+    uint64_t wake = now + (uint64_t)DTN_RETRY_MS * 1000;
+    xSemaphoreTake(dtn_lock, portMAX_DELAY);
+    dtn_expire(now);
+    if (HN && Q[H[0]].expires < wake) wake = Q[H[0]].expires;
+    xSemaphoreGive(dtn_lock);
+    // Every destination with a next hop gets each due bundle handed on;
+    // bundles waiting for their custody ack don't hold up the rest.
+    for (int k = 0; k < DTN_MAX_DESTS; k++) {
+        char dest[32];
+        xSemaphoreTake(dtn_lock, portMAX_DELAY);
+        int16_t i = D[k].head;
+        if (i != NIL) memcpy(dest, D[k].dest, sizeof(dest));
+        xSemaphoreGive(dtn_lock);
+        if (i == NIL) continue;
+
+        char hops[DTN_MAX_NEXT_HOPS][32];
+        int nh = mesh_next_hops(dest, hops, DTN_MAX_NEXT_HOPS);
+        while (i != NIL) {
+            xSemaphoreTake(dtn_lock, portMAX_DELAY);
+            // An ack may have freed i since the last step; stop there.
+            if (!Q[i].len || Q[i].d != k) {
+                xSemaphoreGive(dtn_lock);
+                break;
+            }
+            item_t it = Q[i];
+            bool custody = it.mode == DTN_MODE_CUSTODY;
+            bool due = custody && it.due <= now;
+            char via[32];
+            if (due && nh == 0) {
+                // No way through the mesh; the contact plan's route, if any.
+                uint64_t open;
+                if (!cgr_contact(it.cgr_c, it.cgr_gen, via, &open)) {
+                    cgr_unreserve(i);  // contact over or plan changed: reroute
+                    if (!cgr_route(dest, cgr_size(i), &Q[i].cgr_c, &Q[i].cgr_gen, &Q[i].cgr_route) ||
+                        !cgr_contact(Q[i].cgr_c, Q[i].cgr_gen, via, &open)) {
+                        xSemaphoreGive(dtn_lock);
+                        break;  // nor for the rest of the list
+                    }
                 }
-                for(size_t i = 0; i < rl; i++) free((void*)route[i]);
-                
-                free(Q[0].buf);
-                for (int i = 1; i < QN; i++) Q[i - 1] = Q[i];
-                QN--;
+                if (open > now && open < wake) wake = open;
+                due = open <= now && in_range(via);
+            } else if (nh) {
+                cgr_unreserve(i);  // a way through the mesh after all
             }
+            if (due && !payload_load(frame, ONION_MAX_BYTES, i)) {
+                ESP_LOGE(TAG, "Dropping unreadable bundle to %s", dest);
+                dtn_remove(i);
+                stats.dropped++;
+                due = false;
+            }
+            xSemaphoreGive(dtn_lock);
+            if (custody && it.due > now && it.due < wake) wake = it.due;
+            if (!due) {
+                i = it.next;
+                continue;
+            }
+            size_t blen = bundle_wrap(frame, ONION_MAX_BYTES, &it, dest);
+            if (!blen) break;  // directory lookup started; next pass
+            // Alternate next hops on retries, never straight back to the
+            // custodian it came from unless that is all there is.
+            const char *hop = via;
+            if (nh) {
+                int h = it.tries % nh;
+                if (nh > 1 && mesh_id_hash(hops[h]) == it.from_h && strcmp(hops[h], dest)) h = (h + 1) % nh;
+                hop = hops[h];
+            }
+            if (!hand_to(frame, ONION_MAX_BYTES, blen, hop)) break;  // keys or radio; next pass
+            ESP_LOGI(TAG, "Bundle %08x to %s handed to %s (try %u)", (unsigned)it.id, dest, hop, it.tries + 1);
+            xSemaphoreTake(dtn_lock, portMAX_DELAY);
+            if (Q[i].len && Q[i].id == it.id) {
+                Q[i].tries = it.tries < 255 ? it.tries + 1 : 255;
+                Q[i].due = now + backoff_us(Q[i].tries);
+                if (Q[i].due < wake) wake = Q[i].due;
+            }
+            stats.handed++;
+            if (it.tries) stats.retries++;
+            xSemaphoreGive(dtn_lock);
+            i = it.next;
         }
-        vTaskDelay(pdMS_TO_TICKS(5000));
+    }
+    return wake;
+}
+
+static void dtn_task(void *arg) {
+    static uint8_t frame[ONION_MAX_BYTES];
+    while (1) {
+        uint64_t wake = dtn_step(frame);
+        stack_watch();
+        // Sleep until a neighbor or route shows up, the next bundle is due,
+        // or the retry deadline while bundles wait (e.g. for a key lookup).
+        xSemaphoreTake(dtn_lock, portMAX_DELAY);
+        bool waiting = QN > 0;
+        xSemaphoreGive(dtn_lock);
+        uint64_t now = esp_timer_get_time();
+        TickType_t ticks = wake > now ? pdMS_TO_TICKS((wake - now) / 1000) : 0;
+        ulTaskNotifyTake(pdTRUE, waiting ? ticks + 1 : portMAX_DELAY);
     }
 }
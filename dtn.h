@@ -3,5 +3,53 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+// How a bundle travels. Custody: handed hop by hop towards the destination,
+// each hop signing for it. Epidemic: copied to every neighbor met that lacks
+// it. Spray: binary spray-and-wait, copies split with the neighbors met
+// until one is left, which then waits to meet the destination. PRoPHET:
+// copied only to neighbors more likely to meet the destination (prophet.h).
+#define DTN_MODE_CUSTODY  0
+#define DTN_MODE_EPIDEMIC 1
+#define DTN_MODE_SPRAY    2
+#define DTN_MODE_PROPHET  3
+
+// When the store is full, higher priorities evict lower ones.
+#define DTN_PRIO_BULK   0
+#define DTN_PRIO_NORMAL 1
+#define DTN_PRIO_URGENT 2
+
+typedef struct {
+    uint8_t mode;
+    uint8_t copies;       // spray only; 0 means DTN_SPRAY_COPIES
+    uint8_t prio;
+    uint32_t lifetime_s;  // dropped everywhere after this; 0 means DTN_LIFETIME_S
+} dtn_opts_t;
+
 void dtn_init(void);
-bool dtn_enqueue(const char *dest, const uint8_t *payload, size_t len);
\ No newline at end of file
+// opts NULL: custody, normal priority, default lifetime. A bundle is
+// identified by a hash of origin, destination and payload; queueing one
+// already held returns true without a second copy.
+bool dtn_enqueue(const char *dest, const uint8_t *payload, size_t len, const dtn_opts_t *opts);
+// Bundle, custody and summary vector records from a neighbor, kind byte
+// stripped (radio task). dtn_on_bundle() stores or delivers and acks; it returns true with
+// the onion the origin sealed to us when the bundle is for this node and
+// not seen before.
+bool dtn_on_bundle(const uint8_t *rec, size_t len, const uint8_t **payload, size_t *payload_len);
+void dtn_on_custody(const uint8_t *rec, size_t len);
+void dtn_on_summary(const uint8_t *rec, size_t len);
+
+typedef struct {
+    uint32_t queued;      // bundles held now
+    uint32_t handed;      // sends to a next hop, retries included
+    uint32_t retries;
+    uint32_t acked;       // custody taken over by a neighbor
+    uint32_t accepted;    // custody or a copy taken over from a neighbor
+    uint32_t copied;      // copies pushed to neighbors on contact
+    uint32_t delivered;   // bundles for this node
+    uint32_t duplicates;  // copies or phone retries already held or delivered
+    uint32_t refused;     // no room, not acked
+    uint32_t dropped;     // lost payloads
+    uint32_t expired;     // lifetime ran out here
+    uint32_t evicted;     // pushed out by higher-priority bundles
+} dtn_stats_t;
+void dtn_stats(dtn_stats_t *st);
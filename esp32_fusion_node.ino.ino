@@ -10,8 +10,12 @@
 #include "wifi_setup.h"
 #include "radio.h"
 #include "mesh.h"
+#include "keydir.h"
 #include "onion.h"
 #include "dtn.h"
+#include "stream.h"
+#include "cgr.h"
+#include "crypto_abstraction.h"
 
 static const char *TAG = "main";
 
@@ -40,6 +44,9 @@ void setup() {
     
     mesh_init();
     Serial.println("DEBUG: Mesh initialized.");
+
+    keydir_init();
+    Serial.println("DEBUG: Key directory initialized.");
     
     dtn_init();
     Serial.println("DEBUG: DTN initialized.");
@@ -73,6 +80,11 @@ static void phone_server_task(void *arg) {
             if (id_payload) {
                 cJSON_AddStringToObject(id_payload, "type", "NODE_ID");
                 cJSON_AddStringToObject(id_payload, "id", NODE_ID);
+                char addr[64];
+                if (mesh_get_address(addr, sizeof(addr))) cJSON_AddStringToObject(id_payload, "addr", addr);
+                char key[65];  // for the anchor to certify (keydir.h)
+                for (int i = 0; i < 32; i++) sprintf(key + i * 2, "%02x", crypto_get_ed25519_public()[i]);
+                cJSON_AddStringToObject(id_payload, "key", key);
                 char *id_str = cJSON_PrintUnformatted(id_payload);
                 if (id_str) {
                    g_phone_client.write(id_str);
@@ -86,34 +98,77 @@ static void phone_server_task(void *arg) {
 
         if (g_phone_client && g_phone_client.connected()) {
             if (g_phone_client.available()) {
-                uint8_t buf[ONION_MAX_BYTES];
-                int r = g_phone_client.read(buf, sizeof(buf));
+                // Read straight into the onion frame, leaving room for every
+                // layer in front so the payload never has to move. A phone
+                // conversation rides a circuit: after the CREATE, relays
+                // only do symmetric crypto per packet.
+                static uint8_t frame[ONION_CIRC_HEADROOM(ONION_MAX_HOPS) + ONION_MAX_BYTES];
+                uint8_t *buf = frame + ONION_CIRC_HEADROOM(ONION_MAX_HOPS);
+                int r = g_phone_client.read(buf, ONION_MAX_BYTES);
 
                 if (r > 0) {
+                    // [dlen][dest][payload]; with bit 7 of dlen set the dest is
+                    // followed by a 4-byte big-endian length and the payload
+                    // is streamed in chunks (it may exceed ONION_MAX_BYTES).
+                    // With bit 6 set, [mode][copies][prio][lifetime 4] follow
+                    // the dest and the message goes through the DTN with those
+                    // options (dtn.h; lifetime big-endian seconds, 0 = default).
+                    // An empty dest carries a JSON control message for this
+                    // node instead (a contact plan, cgr.h, or a key
+                    // certificate, keydir.h).
                     int off = 0;
                     uint8_t dlen = buf[off++];
-                    if (dlen >= 64 || (dlen + 1) > r) {
+                    bool large = dlen & 0x80;
+                    bool dtn = dlen & 0x40;
+                    dlen &= 0x3F;
+                    if (dlen + 1 + (dtn ? 7 : 0) + (large ? 4 : 0) > r) {
                         ESP_LOGE("phone", "Invalid destination length from phone.");
                         continue;
                     }
+                    if (dlen == 0) {
+                        const char *ctl = (const char*)buf + off;
+                        bool ok = memmem(ctl, r - off, "\"KEY_CERT\"", 10) ? keydir_load_cert(ctl, r - off) : cgr_load(ctl, r - off);
+                        if (!ok) ESP_LOGE("phone", "Bad control message from phone.");
+                        continue;
+                    }
                     char dest[64] = {0};
                     memcpy(dest, buf + off, dlen);
                     off += dlen;
+                    dtn_opts_t opts = { DTN_MODE_CUSTODY, 0, DTN_PRIO_NORMAL, 0 };
+                    if (dtn) {
+                        opts.mode = buf[off];
+                        opts.copies = buf[off + 1];
+                        opts.prio = buf[off + 2];
+                        opts.lifetime_s = ((uint32_t)buf[off + 3] << 24) | ((uint32_t)buf[off + 4] << 16) | ((uint32_t)buf[off + 5] << 8) | buf[off + 6];
+                        off += 7;
+                    }
+                    if (large) {
+                        uint32_t total = ((uint32_t)buf[off] << 24) | ((uint32_t)buf[off + 1] << 16) | ((uint32_t)buf[off + 2] << 8) | buf[off + 3];
+                        off += 4;
+                        stream_send(dest, total, buf + off, r - off);
+                        continue;
+                    }
                     uint8_t *inner = buf + off;
                     size_t inner_len = r - off;
+                    if (dtn) {
+                        if (!dtn_enqueue(dest, inner, inner_len, &opts)) ESP_LOGE("phone", "DTN queue refused message to %s", dest);
+                        continue;
+                    }
 
-                    const char *route[8];
+                    const char *route[ONION_MAX_HOPS];
                     size_t route_len = 0;
                     if (!mesh_choose_route(dest, route, &route_len)) {
                         ESP_LOGW("phone", "No route to %s, queueing for DTN", dest);
-                        dtn_enqueue(dest, inner, inner_len);
+                        dtn_enqueue(dest, inner, inner_len, NULL);
                         continue;
                     }
 
-                    uint8_t onion[ONION_MAX_BYTES];
+                    *--inner = ONION_KIND_MSG;  // overwrites the consumed header
+                    inner_len++;
                     size_t onion_len = 0;
-                    if (!onion_build(route, route_len, inner, inner_len, onion, &onion_len)) {
-                        ESP_LOGE("phone", "onion_build failed");
+                    uint8_t *onion = onion_circuit_build(route, route_len, inner, inner_len, inner - frame, &onion_len);
+                    if (!onion) {
+                        ESP_LOGE("phone", "onion_circuit_build failed");
                         for(size_t i = 0; i < route_len; i++) free((void*)route[i]);
                         continue;
                     }
@@ -0,0 +1,387 @@
+#include "keydir.h"
+#include "mesh.h"
+#include "radio.h"
+#include "crypto_abstraction.h"
+#include "storage.h"
+#include "node_config.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include <cJSON.h>
+#include <string.h>
+#include <stdlib.h>
+#include <Arduino.h> // For FreeRTOS functions
+#include <cstdio>
+
+// DHT-style public key directory. Every node publishes a record signed with
+// its Ed25519 key; KEY_PUT and KEY_GET travel greedily towards the nodes whose
+// id hash is XOR-closest to the key, which keep (pin) the record. Replies
+// retrace the request path and every node they cross caches the record.
+// A self-signature only proves the sender holds the key, not that the id is
+// theirs, so a record also carries a certificate: the network anchor's
+// (KEYDIR_ANCHOR_PUB) signature over its id and Ed25519 key. Records without
+// one are dropped, never cached, so nobody can claim an id first.
+
+typedef struct {
+    char id[32];
+    uint8_t x_pub[32];
+    uint8_t e_pub[32];
+    uint32_t seq;
+    uint8_t sig[64];
+    uint8_t cert[64];  // anchor's signature over cert_bytes()
+} kd_rec_t;
+
+typedef struct {
+    kd_rec_t rec;
+    uint32_t h;
+    uint64_t used;  // LRU stamp
+    bool pinned;    // we are one of its responsible nodes
+    bool in_use;
+} kd_entry_t;
+
+static kd_entry_t KD[KEYDIR_CACHE_SIZE];
+static SemaphoreHandle_t kd_lock;
+static kd_rec_t kd_self;
+static uint8_t kd_anchor[32];
+static bool kd_anchored;   // KEYDIR_ANCHOR_PUB parsed
+static bool kd_certified;  // kd_self carries a valid certificate
+static uint32_t kd_seen[KEYDIR_SEEN_SIZE];       // request ids already handled
+static int kd_seen_idx = 0;
+static uint32_t kd_relayed[KEYDIR_SEEN_SIZE];    // KEY_GETs we forwarded
+static int kd_relayed_idx = 0;
+static struct { uint32_t h; uint64_t at; } kd_asked[8];  // our own pending lookups
+static const char *TAG = "keydir";
+
+#define KD_REC_TAG 0x80000000u  // keeps PUT/REC ids apart from GET ids in kd_seen
+
+static void keydir_task(void *arg);
+
+static char* hex_of(const uint8_t *b, size_t n) {
+    char *o = (char*)malloc(n * 2 + 1);
+    if (!o) return NULL;
+    for (size_t i = 0; i < n; i++) sprintf(o + i * 2, "%02x", b[i]);
+    o[n * 2] = 0;
+    return o;
+}
+static bool unhex(uint8_t *out, size_t n, const char *h) {
+    if (!h || strlen(h) != n * 2) return false;
+    for (size_t i = 0; i < n; i++) { unsigned v; if (sscanf(h + i * 2, "%02x", &v) != 1) return false; out[i] = v; }
+    return true;
+}
+
+static void rec_signed_bytes(const kd_rec_t *r, uint8_t out[32 + 32 + 32 + 4]) {
+    memset(out, 0, 32);
+    memcpy(out, r->id, strnlen(r->id, 31));
+    memcpy(out + 32, r->x_pub, 32);
+    memcpy(out + 64, r->e_pub, 32);
+    for (int i = 0; i < 4; i++) out[96 + i] = (uint8_t)(r->seq >> (8 * i));
+}
+
+static void cert_bytes(const char *id, const uint8_t e_pub[32], uint8_t out[64]) {
+    memset(out, 0, 32);
+    memcpy(out, id, strnlen(id, 31));
+    memcpy(out + 32, e_pub, 32);
+}
+
+static bool cert_verify(const char *id, const uint8_t e_pub[32], const uint8_t cert[64]) {
+    uint8_t msg[64];
+    cert_bytes(id, e_pub, msg);
+    return kd_anchored && crypto_verify(cert, kd_anchor, msg, sizeof(msg));
+}
+
+static bool rec_verify(const kd_rec_t *r) {
+    uint8_t msg[100];
+    rec_signed_bytes(r, msg);
+    return cert_verify(r->id, r->e_pub, r->cert) && crypto_verify(r->sig, r->e_pub, msg, sizeof(msg));
+}
+
+static cJSON* rec_to_json(const kd_rec_t *r) {
+    cJSON *o = cJSON_CreateObject();
+    cJSON_AddStringToObject(o, "id", r->id);
+    char *x = hex_of(r->x_pub, 32), *e = hex_of(r->e_pub, 32), *sg = hex_of(r->sig, 64), *c = hex_of(r->cert, 64);
+    cJSON_AddStringToObject(o, "x", x);
+    cJSON_AddStringToObject(o, "e", e);
+    cJSON_AddNumberToObject(o, "n", r->seq);
+    cJSON_AddStringToObject(o, "s", sg);
+    cJSON_AddStringToObject(o, "c", c);
+    free(x); free(e); free(sg); free(c);
+    return o;
+}
+
+static bool rec_from_json(const cJSON *o, kd_rec_t *r) {
+    if (!o) return false;
+    const cJSON *id = cJSON_GetObjectItem(o, "id"), *x = cJSON_GetObjectItem(o, "x");
+    const cJSON *e = cJSON_GetObjectItem(o, "e"), *n = cJSON_GetObjectItem(o, "n");
+    const cJSON *sg = cJSON_GetObjectItem(o, "s"), *c = cJSON_GetObjectItem(o, "c");
+    if (!id || !x || !e || !n || !sg || !c || !id->valuestring || strlen(id->valuestring) >= sizeof(r->id)) return false;
+    memset(r, 0, sizeof(*r));
+    strcpy(r->id, id->valuestring);
+    r->seq = (uint32_t)n->valuedouble;
+    return unhex(r->x_pub, 32, x->valuestring) && unhex(r->e_pub, 32, e->valuestring) && unhex(r->sig, 64, sg->valuestring) &&
+           unhex(r->cert, 64, c->valuestring);
+}
+
+// Responsible for a key when fewer than KEYDIR_REPLICAS nodes we know of are
+// XOR-closer to it than we are.
+static bool kd_is_responsible(uint32_t key_h) {
+    uint32_t mine = mesh_id_hash(NODE_ID) ^ key_h;
+    int closer = 0;
+    for (int i = 0; i < KEYDIR_CACHE_SIZE; i++) {
+        if (KD[i].in_use && (KD[i].h ^ key_h) < mine && ++closer >= KEYDIR_REPLICAS) return false;
+    }
+    return true;
+}
+
+static kd_entry_t* kd_find(uint32_t h, const char *id) {
+    for (int i = 0; i < KEYDIR_CACHE_SIZE; i++) {
+        if (KD[i].in_use && KD[i].h == h && !strcmp(KD[i].rec.id, id)) return &KD[i];
+    }
+    return NULL;
+}
+
+// Caller holds kd_lock. The record's signature and certificate have already
+// been checked.
+static void kd_store(const kd_rec_t *r) {
+    uint32_t h = mesh_id_hash(r->id);
+    kd_entry_t *e = kd_find(h, r->id);
+    if (e) {
+        // Same signing key required: a key the anchor certified for the id
+        // stays until the entry is evicted; its owner refreshes it.
+        if (memcmp(e->rec.e_pub, r->e_pub, 32) || r->seq < e->rec.seq) return;
+    } else {
+        kd_entry_t *victim = NULL;
+        int pinned = 0;
+        for (int i = 0; i < KEYDIR_CACHE_SIZE; i++) {
+            if (!KD[i].in_use && !victim) victim = &KD[i];
+            if (KD[i].in_use && KD[i].pinned) pinned++;
+        }
+        bool pin = kd_is_responsible(h) && pinned < KEYDIR_CACHE_SIZE / 2;
+        for (int i = 0; i < KEYDIR_CACHE_SIZE && !victim; i++) {
+            if (KD[i].pinned) continue;
+            victim = &KD[i];
+            for (int j = i + 1; j < KEYDIR_CACHE_SIZE; j++) {
+                if (!KD[j].pinned && KD[j].used < victim->used) victim = &KD[j];
+            }
+        }
+        if (!victim) return;
+        e = victim;
+        memset(e, 0, sizeof(*e));
+        e->h = h;
+        e->pinned = pin;
+        e->in_use = true;
+    }
+    e->rec = *r;
+    e->used = esp_timer_get_time();
+}
+
+bool keydir_get_x25519_pub(const char *node_id, uint8_t out_pub[32]) {
+    if (!kd_lock) return false;
+    xSemaphoreTake(kd_lock, portMAX_DELAY);
+    kd_entry_t *e = kd_find(mesh_id_hash(node_id), node_id);
+    if (e) {
+        memcpy(out_pub, e->rec.x_pub, 32);
+        e->used = esp_timer_get_time();
+    }
+    xSemaphoreGive(kd_lock);
+    return e != NULL;
+}
+
+// Caller holds kd_lock.
+static bool seen_before(uint32_t *ring, int *idx, uint32_t q, bool mark) {
+    for (int i = 0; i < KEYDIR_SEEN_SIZE; i++) if (ring[i] == q) return true;
+    if (mark) {
+        ring[*idx] = q;
+        *idx = (*idx + 1) % KEYDIR_SEEN_SIZE;
+    }
+    return false;
+}
+
+static void kd_broadcast(cJSON *msg) {
+    char *txt = cJSON_PrintUnformatted(msg);
+    if (txt) {
+        radio_send("BCAST", (const uint8_t*)txt, strlen(txt));
+        free(txt);
+    }
+}
+
+static void send_get(const char *target, uint32_t q, int ttl) {
+    cJSON *m = cJSON_CreateObject();
+    cJSON_AddStringToObject(m, "type", "KEY_GET");
+    cJSON_AddStringToObject(m, "id", target);
+    cJSON_AddNumberToObject(m, "q", q);
+    cJSON_AddNumberToObject(m, "ttl", ttl);
+    cJSON_AddStringToObject(m, "via", NODE_ID);
+    kd_broadcast(m);
+    cJSON_Delete(m);
+}
+
+static void send_rec(const char *type, const kd_rec_t *r, uint32_t q, int ttl) {
+    cJSON *m = cJSON_CreateObject();
+    cJSON_AddStringToObject(m, "type", type);
+    cJSON_AddItemToObject(m, "rec", rec_to_json(r));
+    cJSON_AddNumberToObject(m, "q", q);
+    cJSON_AddNumberToObject(m, "ttl", ttl);
+    cJSON_AddStringToObject(m, "via", NODE_ID);
+    kd_broadcast(m);
+    cJSON_Delete(m);
+}
+
+// Starts an asynchronous lookup; the answer lands in the cache and the
+// caller's next attempt (e.g. the DTN retry) finds it there.
+void keydir_lookup(const char *node_id) {
+    if (!kd_lock) return;
+    uint32_t h = mesh_id_hash(node_id);
+    uint64_t now = esp_timer_get_time();
+    int slot = 0;
+    uint32_t q;
+    random_bytes((uint8_t*)&q, sizeof(q));
+    xSemaphoreTake(kd_lock, portMAX_DELAY);
+    for (int i = 0; i < 8; i++) {
+        if (kd_asked[i].h == h && now - kd_asked[i].at < (uint64_t)KEYDIR_LOOKUP_RETRY_MS * 1000) {
+            xSemaphoreGive(kd_lock);
+            return;
+        }
+        if (kd_asked[i].at < kd_asked[slot].at) slot = i;
+    }
+    kd_asked[slot].h = h;
+    kd_asked[slot].at = now;
+    seen_before(kd_seen, &kd_seen_idx, q, true);
+    xSemaphoreGive(kd_lock);
+    ESP_LOGI(TAG, "Looking up key for %s", node_id);
+    send_get(node_id, q, KEYDIR_TTL);
+}
+
+static bool closer_than(const char *a, const char *b, uint32_t key_h) {
+    return (mesh_id_hash(a) ^ key_h) < (mesh_id_hash(b) ^ key_h);
+}
+
+void keydir_on_frame(const uint8_t *buf, size_t len) {
+    if (!kd_lock) return;
+    char *s = strndup((const char*)buf, len);
+    cJSON *m = cJSON_Parse(s);
+    free(s);
+    if (!m) return;
+    const cJSON *type = cJSON_GetObjectItem(m, "type"), *via = cJSON_GetObjectItem(m, "via");
+    const cJSON *q_item = cJSON_GetObjectItem(m, "q"), *ttl_item = cJSON_GetObjectItem(m, "ttl");
+    if (!type || !via || !q_item || !ttl_item || !type->valuestring || !via->valuestring) { cJSON_Delete(m); return; }
+    uint32_t q = (uint32_t)q_item->valuedouble;
+    int ttl = ttl_item->valueint;
+
+    if (!strcmp(type->valuestring, "KEY_GET")) {
+        const cJSON *id = cJSON_GetObjectItem(m, "id");
+        if (!id || !id->valuestring) { cJSON_Delete(m); return; }
+        kd_rec_t r;
+        bool have = false;
+        xSemaphoreTake(kd_lock, portMAX_DELAY);
+        if (seen_before(kd_seen, &kd_seen_idx, q, true)) {
+            xSemaphoreGive(kd_lock);
+            cJSON_Delete(m);
+            return;
+        }
+        if (!strcmp(id->valuestring, NODE_ID) && kd_certified) { r = kd_self; have = true; }
+        kd_entry_t *e = kd_find(mesh_id_hash(id->valuestring), id->valuestring);
+        if (e) { r = e->rec; have = true; }
+        xSemaphoreGive(kd_lock);
+        if (have) {
+            send_rec("KEY_REC", &r, q, KEYDIR_TTL);
+        } else if (ttl > 0 && closer_than(NODE_ID, via->valuestring, mesh_id_hash(id->valuestring))) {
+            xSemaphoreTake(kd_lock, portMAX_DELAY);
+            seen_before(kd_relayed, &kd_relayed_idx, q, true);
+            xSemaphoreGive(kd_lock);
+            send_get(id->valuestring, q, ttl - 1);
+        }
+    } else {
+        kd_rec_t r;
+        bool is_put = !strcmp(type->valuestring, "KEY_PUT");
+        bool is_rec = !strcmp(type->valuestring, "KEY_REC");
+        if ((!is_put && !is_rec) || !rec_from_json(cJSON_GetObjectItem(m, "rec"), &r) || !strcmp(r.id, NODE_ID)) { cJSON_Delete(m); return; }
+        // Each PUT/REC is acted on once; a reply is only relayed by nodes that
+        // relayed the matching request.
+        xSemaphoreTake(kd_lock, portMAX_DELAY);
+        bool dup = seen_before(kd_seen, &kd_seen_idx, q ^ KD_REC_TAG, true);
+        bool relay_rec = is_rec && seen_before(kd_relayed, &kd_relayed_idx, q, false);
+        xSemaphoreGive(kd_lock);
+        if (dup) { cJSON_Delete(m); return; }
+        uint8_t known_e[32];
+        if (!rec_verify(&r) || (mesh_get_ed25519_pub(r.id, known_e) && memcmp(known_e, r.e_pub, 32))) {
+            ESP_LOGW(TAG, "Rejected key record for %s", r.id);
+            cJSON_Delete(m);
+            return;
+        }
+        xSemaphoreTake(kd_lock, portMAX_DELAY);
+        kd_store(&r);
+        xSemaphoreGive(kd_lock);
+        if (ttl > 0 && (relay_rec || (is_put && closer_than(NODE_ID, via->valuestring, mesh_id_hash(r.id))))) {
+            send_rec(type->valuestring, &r, q, ttl - 1);
+        }
+    }
+    cJSON_Delete(m);
+}
+
+// {"type":"KEY_CERT","c":"<128 hex>"}: the anchor's signature over this
+// node's id and Ed25519 key, kept in storage.
+bool keydir_load_cert(const char *json, size_t len) {
+    char *s = strndup(json, len);
+    cJSON *m = cJSON_Parse(s);
+    free(s);
+    const cJSON *c = m ? cJSON_GetObjectItem(m, "c") : NULL;
+    uint8_t cert[64];
+    bool ok = c && unhex(cert, 64, c->valuestring) && cert_verify(NODE_ID, crypto_get_ed25519_public(), cert);
+    cJSON_Delete(m);
+    if (!ok) {
+        ESP_LOGE(TAG, "Key certificate does not verify against the anchor");
+        return false;
+    }
+    if (!storage_set_blob("kd_cert", cert, 64)) ESP_LOGW(TAG, "Key certificate not saved");
+    if (kd_lock) xSemaphoreTake(kd_lock, portMAX_DELAY);
+    memcpy(kd_self.cert, cert, 64);
+    kd_certified = true;
+    if (kd_lock) xSemaphoreGive(kd_lock);
+    ESP_LOGI(TAG, "Key certificate installed");
+    return true;
+}
+
+void keydir_init(void) {
+    kd_lock = xSemaphoreCreateMutex();
+    kd_anchored = unhex(kd_anchor, 32, KEYDIR_ANCHOR_PUB);
+    if (!kd_anchored) ESP_LOGW(TAG, "No KEYDIR_ANCHOR_PUB: key records cannot be checked, directory off");
+    uint32_t boot = 0;
+    size_t l = sizeof(boot);
+    storage_get_blob("kd_seq", &boot, &l);
+    boot++;
+    storage_set_blob("kd_seq", &boot, sizeof(boot));
+
+    memset(&kd_self, 0, sizeof(kd_self));
+    strncpy(kd_self.id, NODE_ID, sizeof(kd_self.id) - 1);
+    memcpy(kd_self.x_pub, crypto_get_x25519_public(), 32);
+    memcpy(kd_self.e_pub, crypto_get_ed25519_public(), 32);
+    kd_self.seq = boot;
+    uint8_t msg[100];
+    rec_signed_bytes(&kd_self, msg);
+    crypto_sign(kd_self.sig, msg, sizeof(msg));
+    l = sizeof(kd_self.cert);
+    kd_certified = storage_get_blob("kd_cert", kd_self.cert, &l) && l == 64 && cert_verify(NODE_ID, kd_self.e_pub, kd_self.cert);
+    if (!kd_certified && kd_anchored) {
+        char *e = hex_of(kd_self.e_pub, 32);
+        ESP_LOGW(TAG, "No key certificate for %s (Ed25519 %s), not publishing", NODE_ID, e ? e : "?");
+        free(e);
+    }
+    xTaskCreate(keydir_task, "keydir", 4096, NULL, 4, NULL);
+}
+
+static void keydir_task(void *arg) {
+    while (1) {
+        uint32_t q;
+        random_bytes((uint8_t*)&q, sizeof(q));
+        xSemaphoreTake(kd_lock, portMAX_DELAY);
+        bool certified = kd_certified;
+        kd_rec_t r = kd_self;
+        if (certified) seen_before(kd_seen, &kd_seen_idx, q ^ KD_REC_TAG, true);
+        xSemaphoreGive(kd_lock);
+        if (!certified) {  // waiting for keydir_load_cert()
+            vTaskDelay(pdMS_TO_TICKS(KEYDIR_LOOKUP_RETRY_MS));
+            continue;
+        }
+        send_rec("KEY_PUT", &r, q, KEYDIR_TTL);
+        vTaskDelay(pdMS_TO_TICKS(KEYDIR_PUBLISH_MS));
+    }
+}
@@ -0,0 +1,15 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+void keydir_init(void);
+bool keydir_get_x25519_pub(const char *node_id, uint8_t out_pub[32]);
+void keydir_lookup(const char *node_id);
+void keydir_on_frame(const uint8_t *buf, size_t len);
+// Installs this node's certificate from the phone:
+//   {"type":"KEY_CERT","c":"<hex>"}
+// where c is the Ed25519 signature by the key in KEYDIR_ANCHOR_PUB over
+// [id, zero-padded to 32 bytes][this node's Ed25519 public key]. Until it
+// has one, a node uses the directory but publishes no record of its own.
+bool keydir_load_cert(const char *json, size_t len);
@@ -1,6 +1,8 @@
 #include "mesh.h"
 #include "radio.h"
 #include "crypto_abstraction.h"
+#include "storage.h"
+#include "keydir.h"
 #include "node_config.h"
 #include "esp_log.h"
 #include "esp_timer.h"
@@ -9,21 +11,119 @@
 #include <stdlib.h>
 #include <Arduino.h> // For FreeRTOS functions
 #include <cstdio>    // For sprintf, sscanf
+#include <atomic>
 
 #define MAX_NB 32
+#define NB_DIRECT_TIMEOUT_MS (3 * HELLO_INTERVAL_MS)
+#define HELLO_SEEN_SIZE 32
+// A truncated two-hop list would leave some of those nodes uncovered.
+static_assert(MESH_MAX_NB2 >= MAX_NB, "nb2 must hold a neighbor's whole HELLO list");
+// Members can be 2 * MESH_CL_RADIUS hops apart and must hear each other's HELLOs.
+static_assert(2 * MESH_CL_RADIUS <= HELLO_TTL + 1, "HELLO floods must span a cluster");
 typedef struct { 
     char id[32]; 
     uint8_t x_pub[32];
     uint8_t e_pub[32];
     uint64_t last; 
+    uint8_t hops;   // 0 = heard directly, n = relayed n times
+    bool stale;     // restored from flash, not yet confirmed by a HELLO
+    uint32_t h;                  // mesh_id_hash(id)
+    uint64_t last_direct;        // last HELLO transmitted by the node itself
+    uint32_t nb2[MESH_MAX_NB2];  // its one-hop neighbors, as advertised (link state)
+    uint8_t nb2_n;
+    bool mpr;       // we picked it to relay our floods
+    bool mpr_sel;   // it picked us to relay its floods
+    uint8_t ch_hops;  // its radio hops to that head
+    uint32_t ch;    // cluster head it reported (MESH_CLUSTERED), 0 = none yet
+    char via[32];   // neighbor its freshest HELLO arrived through
+    uint8_t link_key[32];  // link_derive(x_pub), set whenever x_pub changes
 } nb_t;
 
-static nb_t NB[MAX_NB];
-static int NB_N = 0;
+// Cluster-level distance vector entry: how to reach any member of cluster ch.
+typedef struct {
+    uint32_t ch;
+    uint32_t next;  // mesh_id_hash() of the direct neighbor to send through
+    uint8_t hops;
+    uint64_t last;
+} cl_route_t;
+
+typedef struct { uint32_t ch; uint8_t hops; } cl_adv_t;
+
+// Fields of a verified HELLO that feed the neighbor table.
+typedef struct {
+    const char *id;
+    uint8_t x_pub[32];
+    uint8_t e_pub[32];
+    uint8_t hops;
+    bool direct;
+    uint32_t nb2[MESH_MAX_NB2];
+    int nb2_n;
+    bool selects_me;
+    const char *via;
+    uint32_t ch;
+    uint8_t ch_hops;
+    cl_adv_t cl[MESH_MAX_CLUSTERS];
+    int cl_n;
+} hello_t;
+
+// On-flash form of a neighbor entry; timestamps are meaningless across reboots.
+#define NB_CACHE_KEY     "nb_cache"
+#define NB_CACHE_VERSION 1
+typedef struct {
+    char id[32];
+    uint8_t x_pub[32];
+    uint8_t e_pub[32];
+    uint8_t hops;
+} nb_rec_t;
+
+// Double-buffered neighbor table published through a sequence counter.
+// Writers (serialized by nb_wlock) edit a private copy, nb_work, and publish
+// it into the spare buffer by bumping nb_seq; readers never block and only
+// retry when a second publish reused the buffer they were reading. Both
+// sides touch the published buffers only through the relaxed atomic word
+// copies below, so a reader overlapping a publish gets a stale copy that it
+// then discards, never a data race.
+typedef struct {
+    nb_t e[MAX_NB];
+    int n;
+    uint32_t my_ch;                       // MESH_CLUSTERED only
+    uint32_t my_ch_hops;                  // radio hops to my_ch, 0 = head
+    cl_route_t cl[MESH_MAX_CLUSTERS];
+    int cl_n;
+} nb_table_t;
+static nb_table_t NBT[2];
+static nb_table_t nb_work;               // always equal to the live buffer
+static_assert(sizeof(nb_table_t) % 4 == 0 && sizeof(nb_t) % 4 == 0 && sizeof(cl_route_t) % 4 == 0, "nb tables copy by words");
+static std::atomic<uint32_t> nb_seq(0);  // odd while a writer fills the spare
+static SemaphoreHandle_t nb_wlock;
+static uint8_t nb_blob[1 + MAX_NB * sizeof(nb_rec_t)];
+static std::atomic<bool> nb_dirty(false);
+static uint64_t nb_last_persist = 0;
+static struct { uint32_t h, seq; } hello_seen[HELLO_SEEN_SIZE];  // radio task only
+static int hello_seen_idx = 0;
 static const char *TAG = "mesh";
 
+// Link authentication. Binary frames carry a RADIO_LINK_TRAILER of
+// [src hash 4][dst hash 4][tag 16], the tag being keyed BLAKE2b over
+// frame|src|dst with the pair's link key (a hash of the static X25519
+// agreement). The key is derived once when a neighbor's x_pub is learned and
+// kept in its nb_t, so receiving never does public-key work: overheard
+// frames die on dst, unknown senders on the table lookup, forgeries on the tag.
+static std::atomic<uint32_t> link_overheard(0), link_unknown(0), link_bad_tag(0);
+
+static void link_derive(const uint8_t pub[32], uint8_t key[32]) {
+    uint8_t shared[32];
+    x25519_shared(crypto_get_x25519_private(), pub, shared);
+    crypto_blake2b_keyed(key, 32, shared, 32, (const uint8_t*)"link", 4);
+    crypto_wipe(shared, sizeof(shared));
+}
+
+#define MESH_MAX_SUBSCRIBERS 4
+static struct { mesh_event_cb_t cb; void *arg; } subs[MESH_MAX_SUBSCRIBERS];
+static std::atomic<int> subs_n(0);
+
 static void hello_task(void *arg);
-extern void onion_on_frame(const uint8_t *buf, size_t len);
+extern void onion_on_frame(uint8_t *buf, size_t len);
 
 static char* hex_of(const uint8_t *b, size_t n) {
     char *o = (char*)malloc(n * 2 + 1);
@@ -37,126 +137,813 @@ static void unhex(uint8_t* out, const char *h) {
     for (size_t i = 0; i < n; i++) { unsigned v; sscanf(h + i * 2, "%02x", &v); out[i] = v; }
 }
 
-static void nb_upsert(const char *id, const uint8_t x_pub[32], const uint8_t e_pub[32]) {
-    for (int i = 0; i < NB_N; i++) {
-        if (!strcmp(NB[i].id, id)) {
-            memcpy(NB[i].x_pub, x_pub, 32);
-            memcpy(NB[i].e_pub, e_pub, 32);
-            NB[i].last = esp_timer_get_time();
-            return;
+static void nb_load(void *dst, const void *src, size_t n) {
+    const uint32_t *w = (const uint32_t*)src;
+    for (size_t i = 0; i < n / 4; i++) {
+        uint32_t v = __atomic_load_n(&w[i], __ATOMIC_RELAXED);
+        memcpy((uint8_t*)dst + i * 4, &v, 4);
+    }
+}
+
+static void nb_store(void *dst, const void *src, size_t n) {
+    uint32_t *w = (uint32_t*)dst;
+    const uint32_t *s = (const uint32_t*)src;
+    for (size_t i = 0; i < n / 4; i++) __atomic_store_n(&w[i], s[i], __ATOMIC_RELAXED);
+}
+
+#define NB_LD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)  // 32-bit fields only
+
+uint32_t mesh_id_hash(const char *id) {
+    uint32_t h = 2166136261u;  // FNV-1a
+    while (*id) { h ^= (uint8_t)*id++; h *= 16777619u; }
+    return h;
+}
+
+static void hashes_to_hex(char *out, const uint32_t *h, int n) {
+    for (int i = 0; i < n; i++) sprintf(out + i * 8, "%08lx", (unsigned long)h[i]);
+    out[n * 8] = 0;
+}
+
+static int hex_to_hashes(const char *hex, uint32_t *out, int max) {
+    int n = 0;
+    size_t len = hex ? strlen(hex) : 0;
+    for (size_t i = 0; i + 8 <= len && n < max; i += 8) {
+        char tmp[9];
+        memcpy(tmp, hex + i, 8);
+        tmp[8] = 0;
+        out[n++] = (uint32_t)strtoul(tmp, NULL, 16);
+    }
+    return n;
+}
+
+// Cluster vectors travel as 8 hex digits of head hash plus 2 of hop count.
+static void cl_to_hex(char *out, const cl_adv_t *cl, int n) {
+    for (int i = 0; i < n; i++) sprintf(out + i * 10, "%08lx%02x", (unsigned long)cl[i].ch, cl[i].hops);
+    out[n * 10] = 0;
+}
+
+static int hex_to_cl(const char *hex, cl_adv_t *out, int max) {
+    int n = 0;
+    size_t len = hex ? strlen(hex) : 0;
+    for (size_t i = 0; i + 10 <= len && n < max; i += 10) {
+        char tmp[9];
+        memcpy(tmp, hex + i, 8);
+        tmp[8] = 0;
+        out[n].ch = (uint32_t)strtoul(tmp, NULL, 16);
+        memcpy(tmp, hex + i + 8, 2);
+        tmp[2] = 0;
+        out[n].hops = (uint8_t)strtoul(tmp, NULL, 16);
+        n++;
+    }
+    return n;
+}
+
+static uint32_t nb_read_begin(const nb_table_t **t) {
+    uint32_t seq = nb_seq.load(std::memory_order_acquire);
+    *t = &NBT[(seq >> 1) & 1];
+    return seq;
+}
+
+static bool nb_read_retry(uint32_t seq) {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return nb_seq.load(std::memory_order_relaxed) - (seq & ~1u) >= 3;
+}
+
+static int nb_count(const nb_table_t *t) {
+    int n = NB_LD(t->n);  // may be stale during a read that will be retried
+    return n < 0 ? 0 : (n > MAX_NB ? MAX_NB : n);
+}
+
+static int cl_count(const nb_table_t *t) {
+    int n = NB_LD(t->cl_n);
+    return n < 0 ? 0 : (n > MESH_MAX_CLUSTERS ? MESH_MAX_CLUSTERS : n);
+}
+
+static void nb_get(const nb_table_t *t, int i, nb_t *out) {
+    nb_load(out, &t->e[i], sizeof(*out));
+    out->id[sizeof(out->id) - 1] = 0;
+    out->via[sizeof(out->via) - 1] = 0;
+    if (out->nb2_n > MESH_MAX_NB2) out->nb2_n = MESH_MAX_NB2;
+}
+
+// Index of node id in a published table, -1 if absent.
+static int nb_find(const nb_table_t *t, const char *id) {
+    char cur[32];
+    int n = nb_count(t);
+    for (int i = 0; i < n; i++) {
+        nb_load(cur, t->e[i].id, sizeof(cur));
+        cur[sizeof(cur) - 1] = 0;
+        if (!strcmp(cur, id)) return i;
+    }
+    return -1;
+}
+
+static nb_table_t* nb_write_begin(void) {
+    xSemaphoreTake(nb_wlock, portMAX_DELAY);
+    return &nb_work;
+}
+
+static void nb_write_end(void) {
+    uint32_t seq = nb_seq.load(std::memory_order_relaxed);
+    nb_seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    nb_store(&NBT[((seq >> 1) + 1) & 1], &nb_work, sizeof(nb_work));
+    nb_seq.store(seq + 2, std::memory_order_release);
+    xSemaphoreGive(nb_wlock);
+}
+
+static bool nb_is_direct(const nb_t *nb, uint64_t now) {
+    return !nb->stale && nb->last_direct && now - nb->last_direct <= (uint64_t)NB_DIRECT_TIMEOUT_MS * 1000;
+}
+
+static bool nb_covers(const nb_t *nb, uint32_t h) {
+    for (int k = 0; k < nb->nb2_n; k++) if (nb->nb2[k] == h) return true;
+    return false;
+}
+
+// OLSR multipoint relay selection (RFC 3626 8.3.1 heuristic): first every
+// neighbor that is the only path to some two-hop node, then greedily the
+// neighbor covering the most still-uncovered two-hop nodes. Two-hop nodes
+// beyond MESH_MAX_2HOP are not tracked, so whoever reaches one is selected.
+static void mpr_select(nb_table_t *t) {
+    uint64_t now = esp_timer_get_time();
+    uint32_t self = mesh_id_hash(NODE_ID);
+    uint32_t n2[MESH_MAX_2HOP];
+    bool covered[MESH_MAX_2HOP];
+    int n2n = 0;
+
+    for (int i = 0; i < t->n; i++) {
+        t->e[i].mpr = false;
+        if (!nb_is_direct(&t->e[i], now)) continue;
+        for (int k = 0; k < t->e[i].nb2_n; k++) {
+            uint32_t h = t->e[i].nb2[k];
+            bool skip = (h == self);
+            for (int j = 0; j < t->n && !skip; j++) skip = (t->e[j].h == h && nb_is_direct(&t->e[j], now));
+            for (int j = 0; j < n2n && !skip; j++) skip = (n2[j] == h);
+            if (skip) continue;
+            if (n2n < MESH_MAX_2HOP) { covered[n2n] = false; n2[n2n++] = h; }
+            else t->e[i].mpr = true;
+        }
+    }
+
+    for (int j = 0; j < n2n; j++) {
+        nb_t *only = NULL;
+        int cnt = 0;
+        for (int i = 0; i < t->n; i++) {
+            if (nb_is_direct(&t->e[i], now) && nb_covers(&t->e[i], n2[j])) { only = &t->e[i]; cnt++; }
+        }
+        if (cnt == 1) only->mpr = true;
+    }
+    while (1) {
+        for (int j = 0; j < n2n; j++) {
+            for (int i = 0; i < t->n && !covered[j]; i++) covered[j] = t->e[i].mpr && nb_covers(&t->e[i], n2[j]);
+        }
+        nb_t *best = NULL;
+        int best_cnt = 0;
+        for (int i = 0; i < t->n; i++) {
+            nb_t *nb = &t->e[i];
+            if (nb->mpr || !nb_is_direct(nb, now)) continue;
+            int cnt = 0;
+            for (int j = 0; j < n2n; j++) if (!covered[j] && nb_covers(nb, n2[j])) cnt++;
+            if (cnt > best_cnt) { best = nb; best_cnt = cnt; }
+        }
+        if (!best) break;
+        best->mpr = true;
+    }
+}
+
+// Slot for a node not in a full table: the farthest relayed entry, if the
+// newcomer is closer. Floods fill the table with remote nodes, which must
+// not keep out the direct neighbors relay selection depends on.
+static nb_t* nb_make_room(nb_table_t *t, const hello_t *h, uint64_t now) {
+    nb_t *victim = NULL;
+    for (int i = 0; i < t->n; i++) {
+        nb_t *nb = &t->e[i];
+        if (nb_is_direct(nb, now)) continue;
+        if (!victim || nb->hops > victim->hops || (nb->hops == victim->hops && nb->last < victim->last)) victim = nb;
+    }
+    if (!victim || (!h->direct && victim->hops <= h->hops)) return NULL;
+    ESP_LOGI(TAG, "Neighbor table full, dropping %s (%u hops)", victim->id, victim->hops);
+    return victim;
+}
+
+// Lowest-ID clustering out to MESH_CL_RADIUS hops. A node joins the
+// lowest-hash head that a direct neighbor is less than MESH_CL_RADIUS hops
+// from; with none in reach it becomes a head once every lower-hash neighbor
+// has joined some other cluster. A head yields to a lower one in reach.
+static void cluster_elect(nb_table_t *t, uint64_t now) {
+    uint32_t self = mesh_id_hash(NODE_ID);
+    uint32_t best_head = 0, best_hops = 0;
+    bool lower_undecided = false;
+    for (int i = 0; i < t->n; i++) {
+        const nb_t *nb = &t->e[i];
+        if (!nb_is_direct(nb, now)) continue;
+        if (nb->ch && nb->ch != self && nb->ch_hops < MESH_CL_RADIUS &&
+            (!best_head || nb->ch < best_head || (nb->ch == best_head && nb->ch_hops + 1u < best_hops))) {
+            best_head = nb->ch;
+            best_hops = nb->ch_hops + 1;
+        }
+        if (!nb->ch && nb->h < self) lower_undecided = true;
+    }
+    uint32_t ch = t->my_ch, hops = t->my_ch_hops;
+    if (best_head && (ch != self || best_head < self)) { ch = best_head; hops = best_hops; }
+    else if (!best_head && !lower_undecided) { ch = self; hops = 0; }
+    else if (!best_head) ch = 0;
+    if (ch != t->my_ch) {
+        ESP_LOGI(TAG, "Cluster %08lx -> %08lx%s", (unsigned long)t->my_ch, (unsigned long)ch, ch == self ? " (head)" : "");
+        t->my_ch = ch;
+    }
+    t->my_ch_hops = hops;
+}
+
+// Bellman-Ford over clusters from a direct neighbor's advertised vector. The
+// table holds one entry per cluster, never per node, so it stays bounded by
+// MESH_MAX_CLUSTERS however large the network grows.
+static void cluster_learn(nb_table_t *t, const hello_t *h, uint64_t now) {
+    uint32_t via = mesh_id_hash(h->id);
+    // Its own cluster at distance 0 first, then the clusters it routes to.
+    for (int k = -1; k < h->cl_n; k++) {
+        cl_adv_t adv = k < 0 ? cl_adv_t{h->ch, 0} : h->cl[k];
+        if (!adv.ch || adv.ch == t->my_ch) continue;
+        uint8_t hops = adv.hops + 1;
+        cl_route_t *r = NULL;
+        for (int i = 0; i < t->cl_n; i++) if (t->cl[i].ch == adv.ch) { r = &t->cl[i]; break; }
+        bool renew = true;
+        if (!r) {
+            if (hops > MESH_CL_MAX_HOPS) continue;
+            if (t->cl_n < MESH_MAX_CLUSTERS) r = &t->cl[t->cl_n++];
+            else {
+                // Full: a nearer cluster displaces the farthest one, which
+                // is also where routes to vanished heads drift as they
+                // count up.
+                r = &t->cl[0];
+                for (int i = 1; i < t->cl_n; i++) if (t->cl[i].hops > r->hops) r = &t->cl[i];
+                if (r->hops <= hops) continue;
+            }
+            memset(r, 0, sizeof(*r));
+            r->ch = adv.ch;
+        } else if (r->next != via) {
+            if (hops >= r->hops) continue;  // no better than what we have
+        } else if (hops > r->hops) {
+            // Our next hop got farther. Follow it but let the route age: once
+            // a head is gone every copy of its route keeps getting longer, so
+            // none is renewed and the loops that count up to
+            // MESH_CL_MAX_HOPS time out instead.
+            renew = false;
+        }
+        r->next = via;
+        r->hops = hops;
+        if (renew) r->last = now;
+    }
+    for (int i = 0; i < t->cl_n; ) {
+        if (t->cl[i].hops > MESH_CL_MAX_HOPS) { t->cl[i] = t->cl[--t->cl_n]; continue; }
+        i++;
+    }
+}
+
+static void cluster_expire(nb_table_t *t, uint64_t now) {
+    for (int i = 0; i < t->cl_n; ) {
+        if (t->cl[i].ch == t->my_ch || now - t->cl[i].last > (uint64_t)NB_DIRECT_TIMEOUT_MS * 1000) {
+            t->cl[i] = t->cl[--t->cl_n];
+            continue;
+        }
+        i++;
+    }
+}
+
+bool mesh_subscribe(mesh_event_cb_t cb, void *arg) {
+    int n = subs_n;
+    if (n >= MESH_MAX_SUBSCRIBERS) return false;
+    subs[n].cb = cb;
+    subs[n].arg = arg;
+    subs_n = n + 1;
+    return true;
+}
+
+static void mesh_publish(mesh_event_t ev, const char *node_id) {
+    for (int i = 0; i < subs_n; i++) subs[i].cb(ev, node_id, subs[i].arg);
+}
+
+static void nb_upsert(const hello_t *h) {
+    int ev = -1;
+    bool cl_new = false;
+    uint64_t now = esp_timer_get_time();
+    nb_table_t *t = nb_write_begin();
+    nb_t *nb = NULL;
+    for (int i = 0; i < t->n; i++) {
+        if (!strcmp(t->e[i].id, h->id)) { nb = &t->e[i]; break; }
+    }
+    // In clustered mode only direct neighbors and members of our own cluster
+    // get an entry; everything else is reached through cluster routes.
+    if (MESH_CLUSTERED && !h->direct && h->ch != t->my_ch) {
+        if (nb && !nb_is_direct(nb, now)) *nb = t->e[--t->n];
+        nb_write_end();
+        return;
+    }
+    if (nb) {
+        if (memcmp(nb->x_pub, h->x_pub, 32) || memcmp(nb->e_pub, h->e_pub, 32)) nb_dirty = true;
+        if (nb->stale) {
+            ESP_LOGI(TAG, "Cached neighbor %s revalidated", h->id);
+            ev = MESH_EV_ROUTE_CHANGE;
+        }
+    } else if (t->n < MAX_NB || (nb = nb_make_room(t, h, now))) {
+        if (!nb) nb = &t->e[t->n++];
+        memset(nb, 0, sizeof(nb_t));
+        strncpy(nb->id, h->id, sizeof(nb->id) - 1);
+        nb->h = mesh_id_hash(nb->id);
+        nb_dirty = true;
+        ESP_LOGI(TAG, "New secure neighbor: %s", h->id);
+        ev = MESH_EV_NEIGHBOR_UP;
+    } else {
+        nb_write_end();
+        return;
+    }
+
+    if (ev == MESH_EV_NEIGHBOR_UP || memcmp(nb->x_pub, h->x_pub, 32)) link_derive(h->x_pub, nb->link_key);
+    memcpy(nb->x_pub, h->x_pub, 32);
+    memcpy(nb->e_pub, h->e_pub, 32);
+    nb->last = now;
+    nb->stale = false;
+    nb->ch = h->ch;
+    nb->ch_hops = h->ch_hops;
+    if (ev < 0 && strncmp(nb->via, h->via, sizeof(nb->via) - 1)) ev = MESH_EV_ROUTE_CHANGE;
+    strncpy(nb->via, h->via, sizeof(nb->via) - 1);
+    // A relayed copy must not hide a link we still hear directly.
+    uint8_t hops = h->hops;
+    if (!h->direct && nb_is_direct(nb, now)) hops = 0;
+    if (nb->hops != hops) {
+        nb_dirty = true;
+        if (ev < 0) ev = MESH_EV_ROUTE_CHANGE;
+    }
+    nb->hops = hops;
+    memcpy(nb->nb2, h->nb2, h->nb2_n * sizeof(uint32_t));
+    nb->nb2_n = h->nb2_n;
+    if (h->direct) {
+        nb->last_direct = now;
+        nb->mpr_sel = h->selects_me;
+        mpr_select(t);
+        int cl_n = t->cl_n;
+        if (MESH_CLUSTERED) cluster_learn(t, h, now);
+        cl_new = t->cl_n > cl_n;
+    }
+    nb_write_end();
+    if (ev >= 0) mesh_publish((mesh_event_t)ev, h->id);
+    if (cl_new) mesh_publish(MESH_EV_ROUTE_CHANGE, NULL);
+}
+
+// Cluster this node currently belongs to; 0 outside clustered mode or while
+// the election has not settled.
+static uint32_t nb_my_cluster(void) {
+    const nb_table_t *t;
+    uint32_t seq, ch;
+    do {
+        seq = nb_read_begin(&t);
+        ch = NB_LD(t->my_ch);
+    } while (nb_read_retry(seq));
+    return ch;
+}
+
+bool mesh_get_address(char *out, size_t len) {
+    uint32_t ch = nb_my_cluster();
+    if (!MESH_CLUSTERED || !ch) return snprintf(out, len, "%s", NODE_ID) < (int)len;
+    return snprintf(out, len, "%08lx.%s", (unsigned long)ch, NODE_ID) < (int)len;
+}
+
+// True if the neighbor that transmitted a flood chose us as one of its MPRs,
+// i.e. we are responsible for retransmitting it.
+static bool nb_selected_by(const char *via) {
+    const nb_table_t *t;
+    uint32_t seq;
+    bool sel;
+    do {
+        seq = nb_read_begin(&t);
+        sel = false;
+        int i = nb_find(t, via);
+        if (i >= 0) {
+            nb_t nb;
+            nb_get(t, i, &nb);
+            sel = nb.mpr_sel;
         }
+    } while (nb_read_retry(seq));
+    return sel;
+}
+
+// Restores the neighbor table saved by nb_persist(). Entries come back marked
+// stale so they can route immediately; nb_expire() drops the ones no
+// HELLO confirms within NB_STALE_GRACE_MS.
+static void nb_restore(void) {
+    uint8_t *blob = nb_blob;
+    size_t len = sizeof(nb_blob);
+    if (!storage_get_blob(NB_CACHE_KEY, blob, &len)) return;
+    if (len < 1 || blob[0] != NB_CACHE_VERSION || (len - 1) % sizeof(nb_rec_t)) {
+        ESP_LOGW(TAG, "Ignoring incompatible neighbor cache");
+        return;
+    }
+    uint64_t now = esp_timer_get_time();
+    size_t n = (len - 1) / sizeof(nb_rec_t);
+    nb_table_t *t = nb_write_begin();
+    for (size_t i = 0; i < n && t->n < MAX_NB; i++) {
+        nb_rec_t r;
+        memcpy(&r, blob + 1 + i * sizeof(nb_rec_t), sizeof(r));
+        r.id[sizeof(r.id) - 1] = 0;
+        if (!r.id[0] || !strcmp(r.id, NODE_ID)) continue;
+        nb_t *nb = &t->e[t->n++];
+        memset(nb, 0, sizeof(*nb));
+        strcpy(nb->id, r.id);
+        nb->h = mesh_id_hash(nb->id);
+        memcpy(nb->x_pub, r.x_pub, 32);
+        memcpy(nb->e_pub, r.e_pub, 32);
+        link_derive(nb->x_pub, nb->link_key);
+        nb->hops = r.hops;
+        nb->last = now;
+        nb->stale = true;
     }
-    if (NB_N < MAX_NB) {
-        strncpy(NB[NB_N].id, id, sizeof(NB[NB_N].id) - 1);
-        memcpy(NB[NB_N].x_pub, x_pub, 32);
-        memcpy(NB[NB_N].e_pub, e_pub, 32);
-        NB[NB_N].last = esp_timer_get_time();
-        NB_N++;
-        ESP_LOGI(TAG, "New secure neighbor: %s", id);
+    int restored = t->n;
+    nb_write_end();
+    nb_last_persist = now;
+    ESP_LOGI(TAG, "Restored %d cached neighbors (stale until heard)", restored);
+}
+
+// Writes the table to flash, at most once per NB_PERSIST_INTERVAL_MS and only
+// when an entry was added, removed or rekeyed, so HELLO traffic alone never
+// wears the flash.
+static void nb_persist(void) {
+    uint64_t now = esp_timer_get_time();
+    if (!nb_dirty || now - nb_last_persist < (uint64_t)NB_PERSIST_INTERVAL_MS * 1000) return;
+    nb_dirty = false;
+    uint8_t *blob = nb_blob;
+    blob[0] = NB_CACHE_VERSION;
+    const nb_table_t *t;
+    uint32_t seq;
+    int n;
+    do {
+        seq = nb_read_begin(&t);
+        n = nb_count(t);
+        for (int i = 0; i < n; i++) {
+            nb_t nb;
+            nb_get(t, i, &nb);
+            nb_rec_t r;
+            memset(&r, 0, sizeof(r));
+            memcpy(r.id, nb.id, sizeof(r.id) - 1);
+            memcpy(r.x_pub, nb.x_pub, 32);
+            memcpy(r.e_pub, nb.e_pub, 32);
+            r.hops = nb.hops;
+            memcpy(blob + 1 + i * sizeof(nb_rec_t), &r, sizeof(r));
+        }
+    } while (nb_read_retry(seq));
+    if (storage_set_blob(NB_CACHE_KEY, blob, 1 + n * sizeof(nb_rec_t))) {
+        nb_last_persist = now;
+    } else {
+        nb_dirty = true;
+        ESP_LOGW(TAG, "Neighbor cache write failed");
     }
 }
 
+static void nb_expire(void) {
+    uint64_t now = esp_timer_get_time();
+    nb_table_t *t = nb_write_begin();
+    if (MESH_CLUSTERED) cluster_elect(t, now);
+    for (int i = 0; i < t->n; ) {
+        nb_t *nb = &t->e[i];
+        if (nb->stale && now - nb->last > (uint64_t)NB_STALE_GRACE_MS * 1000) {
+            ESP_LOGI(TAG, "Cached neighbor %s not heard, dropping", nb->id);
+        } else if (!nb->stale && now - nb->last > (uint64_t)NB_EXPIRE_MS * 1000) {
+            ESP_LOGI(TAG, "Neighbor %s timed out", nb->id);
+        } else if (MESH_CLUSTERED && !nb->stale && !nb_is_direct(nb, now) && nb->ch != t->my_ch) {
+            // left our cluster after a re-election
+        } else {
+            i++;
+            continue;
+        }
+        *nb = t->e[--t->n];
+        nb_dirty = true;
+    }
+    mpr_select(t);
+    if (MESH_CLUSTERED) cluster_expire(t, now);
+    nb_write_end();
+}
+
 bool mesh_get_x25519_pub(const char *node_id, uint8_t out_pub[32]) {
-    for (int i = 0; i < NB_N; i++) {
-        if (!strcmp(NB[i].id, node_id)) {
-            memcpy(out_pub, NB[i].x_pub, 32);
-            return true;
+    const nb_table_t *t;
+    uint32_t seq;
+    bool found;
+    do {
+        seq = nb_read_begin(&t);
+        int i = nb_find(t, node_id);
+        found = i >= 0;
+        if (found) nb_load(out_pub, t->e[i].x_pub, 32);
+    } while (nb_read_retry(seq));
+    return found;
+}
+
+bool mesh_get_ed25519_pub(const char *node_id, uint8_t out_pub[32]) {
+    const nb_table_t *t;
+    uint32_t seq;
+    bool found;
+    do {
+        seq = nb_read_begin(&t);
+        int i = nb_find(t, node_id);
+        found = i >= 0;
+        if (found) nb_load(out_pub, t->e[i].e_pub, 32);
+    } while (nb_read_retry(seq));
+    return found;
+}
+
+static bool nb_link_key(const char *node_id, uint8_t key[32]) {
+    const nb_table_t *t;
+    uint32_t seq;
+    bool found;
+    do {
+        seq = nb_read_begin(&t);
+        int i = nb_find(t, node_id);
+        found = i >= 0;
+        if (found) nb_load(key, t->e[i].link_key, 32);
+    } while (nb_read_retry(seq));
+    return found;
+}
+
+static bool nb_link_key_by_hash(uint32_t h, uint8_t key[32]) {
+    const nb_table_t *t;
+    uint32_t seq;
+    bool found;
+    do {
+        seq = nb_read_begin(&t);
+        found = false;
+        int n = nb_count(t);
+        for (int i = 0; i < n; i++) {
+            if (NB_LD(t->e[i].h) == h) {
+                nb_load(key, t->e[i].link_key, 32);
+                found = true;
+                break;
+            }
         }
+    } while (nb_read_retry(seq));
+    return found;
+}
+
+bool mesh_neighbor_by_hash(uint32_t h, char out_id[32]) {
+    const nb_table_t *t;
+    uint32_t seq;
+    bool found;
+    do {
+        seq = nb_read_begin(&t);
+        found = false;
+        int n = nb_count(t);
+        for (int i = 0; i < n; i++) {
+            if (NB_LD(t->e[i].h) == h) {
+                nb_load(out_id, t->e[i].id, 32);
+                found = true;
+                break;
+            }
+        }
+    } while (nb_read_retry(seq));
+    out_id[31] = 0;
+    return found;
+}
+
+static void link_tag(const uint8_t key[32], const uint8_t *buf, size_t len, const uint8_t ids[8], uint8_t tag[16]) {
+    crypto_blake2b_ctx ctx;
+    crypto_blake2b_keyed_init(&ctx, 16, key, 32);
+    crypto_blake2b_update(&ctx, buf, len);
+    crypto_blake2b_update(&ctx, ids, 8);
+    crypto_blake2b_final(&ctx, tag);
+}
+
+static void put_be32(uint8_t *p, uint32_t v) { p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v; }
+static uint32_t get_be32(const uint8_t *p) { return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3]; }
+
+int mesh_link_seal(const char *next_hop_id, const uint8_t *buf, size_t len, uint8_t trailer[RADIO_LINK_TRAILER]) {
+    if (len && buf[0] == '{') return 0;  // signed JSON control traffic
+    if (len && buf[0] == RADIO_CT_FMT) return 0;  // per-hop header tag instead
+    uint8_t key[32];
+    if (!nb_link_key(next_hop_id, key)) return -1;
+    put_be32(trailer, mesh_id_hash(NODE_ID));
+    put_be32(trailer + 4, mesh_id_hash(next_hop_id));
+    link_tag(key, buf, len, trailer, trailer + 8);
+    crypto_wipe(key, sizeof(key));
+    return RADIO_LINK_TRAILER;
+}
+
+static bool link_open(const uint8_t *buf, size_t len) {
+    const uint8_t *tr = buf + len - RADIO_LINK_TRAILER;
+    if (get_be32(tr + 4) != mesh_id_hash(NODE_ID)) {
+        link_overheard++;
+        return false;
     }
-    return false;
+    uint8_t key[32], tag[16];
+    if (!nb_link_key_by_hash(get_be32(tr), key)) {
+        link_unknown++;
+        return false;
+    }
+    link_tag(key, buf, len - RADIO_LINK_TRAILER, tr, tag);
+    crypto_wipe(key, sizeof(key));
+    if (crypto_verify16(tag, tr + 8) != 0) {
+        link_bad_tag++;
+        return false;
+    }
+    return true;
+}
+
+void mesh_link_stats(uint32_t *overheard, uint32_t *unknown_src, uint32_t *bad_tag) {
+    *overheard = link_overheard;
+    *unknown_src = link_unknown;
+    *bad_tag = link_bad_tag;
 }
 
 void mesh_init(void) {
+    nb_wlock = xSemaphoreCreateMutex();
     crypto_keys_load_or_create();
+    x25519_pool_init();
+    nb_restore();
     xTaskCreate(hello_task, "hello", 8192, NULL, 5, NULL); // Increased stack size for hello_task
 }
 
+// Outer, unsigned part of a HELLO: relays only rewrite ttl and via, so the
+// originator's signature over "data" survives the flood.
+static char* hello_envelope(const char *data_txt, const char *sig_hex, int ttl) {
+    cJSON *final_pl = cJSON_CreateObject();
+    cJSON_AddStringToObject(final_pl, "type", "HELLO");
+    cJSON_AddStringToObject(final_pl, "data", data_txt);
+    cJSON_AddStringToObject(final_pl, "sig", sig_hex);
+    cJSON_AddNumberToObject(final_pl, "ttl", ttl);
+    cJSON_AddStringToObject(final_pl, "via", NODE_ID);
+    char *final_txt = cJSON_PrintUnformatted(final_pl);
+    cJSON_Delete(final_pl);
+    return final_txt;
+}
+
+// This node's signed HELLO, ready to broadcast; the caller frees it.
+static char* hello_make(uint32_t hello_seq) {
+    uint32_t nbh[MAX_NB], mprh[MAX_NB], my_ch, my_ch_hops;
+    cl_adv_t cl[MESH_MAX_CLUSTERS];
+    int nn, mn, cn;
+    const nb_table_t *t;
+    uint32_t seq;
+    uint64_t now = esp_timer_get_time();
+    do {
+        seq = nb_read_begin(&t);
+        nn = mn = cn = 0;
+        int n = nb_count(t);
+        for (int i = 0; i < n; i++) {
+            nb_t nb;
+            nb_get(t, i, &nb);
+            if (!nb_is_direct(&nb, now)) continue;
+            nbh[nn++] = nb.h;
+            if (nb.mpr) mprh[mn++] = nb.h;
+        }
+        my_ch = NB_LD(t->my_ch);
+        my_ch_hops = NB_LD(t->my_ch_hops);
+        int c = cl_count(t);
+        for (int i = 0; i < c; i++) {
+            cl_route_t r;
+            nb_load(&r, &t->cl[i], sizeof(r));
+            cl[cn].ch = r.ch;
+            cl[cn].hops = r.hops;
+            cn++;
+        }
+    } while (nb_read_retry(seq));
+    char nb_hex[MAX_NB * 8 + 1], mpr_hex[MAX_NB * 8 + 1];
+    hashes_to_hex(nb_hex, nbh, nn);
+    hashes_to_hex(mpr_hex, mprh, mn);
+
+    cJSON *data_pl = cJSON_CreateObject();
+    cJSON_AddStringToObject(data_pl, "type", "HELLO");
+    cJSON_AddStringToObject(data_pl, "id", NODE_ID);
+    char *x_pub_hex = hex_of(crypto_get_x25519_public(), 32);
+    cJSON_AddStringToObject(data_pl, "x_pub", x_pub_hex);
+    free(x_pub_hex);
+    char *e_pub_hex = hex_of(crypto_get_ed25519_public(), 32);
+    cJSON_AddStringToObject(data_pl, "e_pub", e_pub_hex);
+    free(e_pub_hex);
+    cJSON_AddNumberToObject(data_pl, "seq", hello_seq);
+    cJSON_AddStringToObject(data_pl, "nb", nb_hex);
+    cJSON_AddStringToObject(data_pl, "mpr", mpr_hex);
+    if (MESH_CLUSTERED) {
+        char ch_hex[9], cl_hex[MESH_MAX_CLUSTERS * 10 + 1];
+        hashes_to_hex(ch_hex, &my_ch, 1);
+        cl_to_hex(cl_hex, cl, cn);
+        cJSON_AddStringToObject(data_pl, "ch", ch_hex);
+        cJSON_AddNumberToObject(data_pl, "chd", my_ch_hops);
+        cJSON_AddStringToObject(data_pl, "cl", cl_hex);
+    }
+    char *data_txt = cJSON_PrintUnformatted(data_pl);
+    cJSON_Delete(data_pl);
+
+    uint8_t signature[64];
+    crypto_sign(signature, (const uint8_t*)data_txt, strlen(data_txt));
+    char *sig_hex = hex_of(signature, 64);
+
+    char *final_txt = hello_envelope(data_txt, sig_hex, HELLO_TTL);
+    free(data_txt);
+    free(sig_hex);
+    return final_txt;
+}
+
 static void hello_task(void *arg) {
+    uint32_t hello_seq;
+    random_bytes((uint8_t*)&hello_seq, sizeof(hello_seq));
     while (1) {
-        Serial.println("DEBUG: hello_task waiting...");
-        vTaskDelay(pdMS_TO_TICKS(HELLO_INTERVAL_MS));
-        
-        Serial.println("DEBUG: hello_task creating data payload...");
-        cJSON *data_pl = cJSON_CreateObject();
-        cJSON_AddStringToObject(data_pl, "type", "HELLO");
-        cJSON_AddStringToObject(data_pl, "id", NODE_ID);
-        char *x_pub_hex = hex_of(crypto_get_x25519_public(), 32);
-        cJSON_AddStringToObject(data_pl, "x_pub", x_pub_hex);
-        free(x_pub_hex);
-        char *e_pub_hex = hex_of(crypto_get_ed25519_public(), 32);
-        cJSON_AddStringToObject(data_pl, "e_pub", e_pub_hex);
-        free(e_pub_hex);
-        cJSON_AddNumberToObject(data_pl, "ttl", HELLO_TTL);
-        char *data_txt = cJSON_PrintUnformatted(data_pl);
-        cJSON_Delete(data_pl);
-
-        Serial.println("DEBUG: hello_task signing data...");
-        uint8_t signature[64];
-        crypto_sign(signature, (const uint8_t*)data_txt, strlen(data_txt));
-        char *sig_hex = hex_of(signature, 64);
-
-        Serial.println("DEBUG: hello_task creating final payload...");
-        cJSON *final_pl = cJSON_CreateObject();
-        cJSON_AddStringToObject(final_pl, "data", data_txt);
-        cJSON_AddStringToObject(final_pl, "sig", sig_hex);
-        free(data_txt);
-        free(sig_hex);
-        char *final_txt = cJSON_PrintUnformatted(final_pl);
-        cJSON_Delete(final_pl);
-        
-        Serial.println("DEBUG: hello_task broadcasting...");
-        radio_send("BCAST", (const uint8_t*)final_txt, strlen(final_txt));
+        char *final_txt = hello_make(hello_seq++);
+        size_t final_len = strlen(final_txt);
+        radio_send("BCAST", (const uint8_t*)final_txt, final_len);
         free(final_txt);
-        Serial.println("DEBUG: hello_task broadcast complete.");
+        ESP_LOGD(TAG, "HELLO %u broadcast, %u bytes", (unsigned)(hello_seq - 1), (unsigned)final_len);
+
+        nb_expire();
+        nb_persist();
+        static uint32_t link_logged = 0;
+        if (link_unknown + link_bad_tag != link_logged) {
+            link_logged = link_unknown + link_bad_tag;
+            ESP_LOGW(TAG, "Link rejects: %u unknown sender, %u bad tag", (unsigned)link_unknown, (unsigned)link_bad_tag);
+        }
+
+        vTaskDelay(pdMS_TO_TICKS(HELLO_INTERVAL_MS));
     }
 }
 
+static bool hello_already_seen(uint32_t h, uint32_t seq) {
+    for (int i = 0; i < HELLO_SEEN_SIZE; i++) {
+        if (hello_seen[i].h == h && hello_seen[i].seq == seq) return true;
+    }
+    return false;
+}
+
+static void hello_mark_seen(uint32_t h, uint32_t seq) {
+    hello_seen[hello_seen_idx].h = h;
+    hello_seen[hello_seen_idx].seq = seq;
+    hello_seen_idx = (hello_seen_idx + 1) % HELLO_SEEN_SIZE;
+}
+
+static const char* json_str(const cJSON *obj, const char *key) {
+    const cJSON *it = cJSON_GetObjectItem(obj, key);
+    return it ? it->valuestring : NULL;
+}
+
 static void handle_hello(const uint8_t *buf, size_t len) {
     char *s = strndup((const char*)buf, len);
     cJSON *final_pl = cJSON_Parse(s);
     if (!final_pl) { free(s); return; }
 
-    cJSON *data_item = cJSON_GetObjectItem(final_pl, "data");
-    cJSON *sig_item = cJSON_GetObjectItem(final_pl, "sig");
-    if (!data_item || !sig_item) { cJSON_Delete(final_pl); free(s); return; }
+    const char *data_txt = json_str(final_pl, "data");
+    const char *sig_hex = json_str(final_pl, "sig");
+    const char *via = json_str(final_pl, "via");
+    cJSON *ttl_item = cJSON_GetObjectItem(final_pl, "ttl");
+    if (!data_txt || !sig_hex || !via || !ttl_item) { cJSON_Delete(final_pl); free(s); return; }
+    int ttl = ttl_item->valueint;
 
-    const char *data_txt = data_item->valuestring;
-    const char *sig_hex = sig_item->valuestring;
     cJSON *data_pl = cJSON_Parse(data_txt);
     if (!data_pl) { cJSON_Delete(final_pl); free(s); return; }
 
-    const char *id = cJSON_GetObjectItem(data_pl, "id")->valuestring;
-    if (!strcmp(id, NODE_ID)) { cJSON_Delete(data_pl); cJSON_Delete(final_pl); free(s); return; }
+    const char *id = json_str(data_pl, "id");
+    const char *e_pub_hex = json_str(data_pl, "e_pub");
+    const char *x_pub_hex = json_str(data_pl, "x_pub");
+    cJSON *seq_item = cJSON_GetObjectItem(data_pl, "seq");
+    if (!id || !e_pub_hex || !x_pub_hex || !seq_item || !strcmp(id, NODE_ID)) {
+        cJSON_Delete(data_pl); cJSON_Delete(final_pl); free(s); return;
+    }
+    uint32_t id_h = mesh_id_hash(id);
+    uint32_t hseq = (uint32_t)seq_item->valuedouble;
+    bool direct = !strcmp(via, id);
+    // Copies of a flood we already handled still tell us who relayed them,
+    // but there is nothing new to learn or forward.
+    if (hello_already_seen(id_h, hseq) && !direct) { cJSON_Delete(data_pl); cJSON_Delete(final_pl); free(s); return; }
 
-    const char *e_pub_hex = cJSON_GetObjectItem(data_pl, "e_pub")->valuestring;
-    uint8_t e_pub[32], signature[64];
-    unhex(e_pub, e_pub_hex);
+    static hello_t h;  // radio task only; the cluster list is too big for its stack
+    memset(&h, 0, sizeof(h));
+    uint8_t signature[64];
+    unhex(h.e_pub, e_pub_hex);
     unhex(signature, sig_hex);
 
-    if (!crypto_verify(signature, e_pub, (const uint8_t*)data_txt, strlen(data_txt))) {
+    if (!crypto_verify(signature, h.e_pub, (const uint8_t*)data_txt, strlen(data_txt))) {
         ESP_LOGW(TAG, "Invalid signature from %s! Dropping.", id);
         cJSON_Delete(data_pl); cJSON_Delete(final_pl); free(s); return;
     }
+    bool fresh = !hello_already_seen(id_h, hseq);
+    if (fresh) hello_mark_seen(id_h, hseq);
 
-    const char *x_pub_hex = cJSON_GetObjectItem(data_pl, "x_pub")->valuestring;
-    int ttl = cJSON_GetObjectItem(data_pl, "ttl")->valueint;
-    uint8_t x_pub[32];
-    unhex(x_pub, x_pub_hex);
-    nb_upsert(id, x_pub, e_pub);
-
-    if (ttl > 0) {
-        cJSON_ReplaceItemInObject(data_pl, "ttl", cJSON_CreateNumber(ttl - 1));
-        char *new_data_txt = cJSON_PrintUnformatted(data_pl);
-        uint8_t new_sig[64];
-        crypto_sign(new_sig, (const uint8_t*)new_data_txt, strlen(new_data_txt));
-        char *new_sig_hex = hex_of(new_sig, 64);
-        cJSON *rebroadcast_pl = cJSON_CreateObject();
-        cJSON_AddStringToObject(rebroadcast_pl, "data", new_data_txt);
-        cJSON_AddStringToObject(rebroadcast_pl, "sig", new_sig_hex);
-        free(new_data_txt);
-        free(new_sig_hex);
-        char *rebroadcast_txt = cJSON_PrintUnformatted(rebroadcast_pl);
-        cJSON_Delete(rebroadcast_pl);
+    h.id = id;
+    h.via = via;
+    unhex(h.x_pub, x_pub_hex);
+    h.direct = direct;
+    hex_to_hashes(json_str(data_pl, "ch"), &h.ch, 1);
+    cJSON *chd_item = cJSON_GetObjectItem(data_pl, "chd");
+    h.ch_hops = chd_item ? (uint8_t)chd_item->valueint : MESH_CL_RADIUS;
+    h.hops = (!direct && ttl < HELLO_TTL) ? HELLO_TTL - ttl : 0;
+    h.nb2_n = hex_to_hashes(json_str(data_pl, "nb"), h.nb2, MESH_MAX_NB2);
+    if (direct) {
+        uint32_t mpr[MAX_NB];
+        int mn = hex_to_hashes(json_str(data_pl, "mpr"), mpr, MAX_NB);
+        uint32_t self = mesh_id_hash(NODE_ID);
+        for (int i = 0; i < mn; i++) if (mpr[i] == self) h.selects_me = true;
+        h.cl_n = hex_to_cl(json_str(data_pl, "cl"), h.cl, MESH_MAX_CLUSTERS);
+    }
+    nb_upsert(&h);
+
+    // MPR flooding: only the relays the transmitter selected retransmit, and
+    // in clustered mode floods stay inside the originator's cluster.
+    bool in_scope = !MESH_CLUSTERED || h.ch == nb_my_cluster();
+    if (fresh && ttl > 0 && in_scope && nb_selected_by(via)) {
+        char *rebroadcast_txt = hello_envelope(data_txt, sig_hex, ttl - 1);
         radio_send("BCAST", (uint8_t*)rebroadcast_txt, strlen(rebroadcast_txt));
         free(rebroadcast_txt);
     }
@@ -166,27 +953,155 @@ static void handle_hello(const uint8_t *buf, size_t len) {
     free(s);
 }
 
-bool mesh_choose_route(const char *dest_id, const char **route_out, size_t *route_len) {
-    for (int i = 0; i < NB_N; i++) {
-        if (!strcmp(NB[i].id, dest_id)) {
-            route_out[0] = strdup(dest_id);
-            *route_len = 1;
-            return true;
+// Shortest chain of radio hops to entry dst over the links the table's
+// HELLOs advertise (each entry's nb2), read from a published table. Fills
+// path[] with entry indexes, first hop first; returns the hop count, 0 when
+// dst is not reachable within ONION_MAX_HOPS on what this node has heard.
+static int nb_path(const nb_table_t *t, int dst, uint64_t now, int8_t path[ONION_MAX_HOPS]) {
+    int n = nb_count(t);
+    int8_t prev[MAX_NB], q[MAX_NB];
+    uint8_t depth[MAX_NB];
+    uint32_t hs[MAX_NB];
+    int qh = 0, qt = 0;
+    nb_t nb;
+    for (int i = 0; i < n; i++) {
+        nb_get(t, i, &nb);
+        hs[i] = nb.h;
+        prev[i] = -2;
+        if (nb_is_direct(&nb, now)) { prev[i] = -1; depth[i] = 1; q[qt++] = i; }
+    }
+    while (qh < qt && prev[dst] == -2) {
+        int u = q[qh++];
+        if (depth[u] >= ONION_MAX_HOPS) continue;
+        nb_get(t, u, &nb);
+        for (int k = 0; k < nb.nb2_n; k++) {
+            for (int v = 0; v < n; v++) {
+                if (prev[v] != -2 || hs[v] != nb.nb2[k]) continue;
+                prev[v] = u;
+                depth[v] = depth[u] + 1;
+                q[qt++] = v;
+            }
         }
     }
-    if (NB_N > 0) {
-        route_out[0] = strdup(NB[0].id);
-        route_out[1] = strdup(dest_id);
-        *route_len = 2;
-        return true;
+    if (prev[dst] == -2) return 0;
+    int len = depth[dst];
+    for (int v = dst, k = len - 1; k >= 0; v = prev[v], k--) path[k] = v;
+    return len;
+}
+
+// dest_id is either a plain node id or, in clustered mode, a hierarchical
+// "<cluster>.<node>" address from mesh_get_address(). Routes are chains of
+// radio hops through the known link state, so only nodes this node has
+// heard a HELLO from qualify: its own cluster in clustered mode. Anything
+// else is for the DTN, which moves it hop by hop (mesh_next_hops).
+bool mesh_choose_route(const char *dest_id, const char **route_out, size_t *route_len) {
+    const char *dot = strchr(dest_id, '.');
+    const char *node = dot ? dot + 1 : dest_id;
+
+    const nb_table_t *t;
+    uint32_t seq;
+    int len;
+    char hop[ONION_MAX_HOPS][32];
+    uint64_t now = esp_timer_get_time();
+    do {
+        seq = nb_read_begin(&t);
+        len = 0;
+        int8_t path[ONION_MAX_HOPS];
+        int i = nb_find(t, node);
+        if (i >= 0) {
+            nb_t nb;
+            nb_get(t, i, &nb);
+            // A cached neighbor routes directly until it is confirmed or dropped.
+            if (nb.hops == 0 || nb_is_direct(&nb, now)) { path[0] = i; len = 1; }
+            else len = nb_path(t, i, now, path);
+        }
+        for (int k = 0; k < len; k++) nb_load(hop[k], t->e[path[k]].id, 32);
+    } while (nb_read_retry(seq));
+
+    for (int k = 0; k < len; k++) {
+        hop[k][31] = 0;
+        route_out[k] = strdup(hop[k]);
     }
-    return false;
+    *route_len = len;
+    return len > 0;
+}
+
+static void hops_add(char out[][32], int *k, int max, const char *id) {
+    if (!id[0] || *k >= max) return;
+    for (int i = 0; i < *k; i++) if (!strncmp(out[i], id, 31)) return;
+    memcpy(out[*k], id, 32);
+    out[(*k)++][31] = 0;
 }
 
-void mesh_on_radio_frame(const uint8_t *buf, size_t len) {
-    if (len > 10 && memmem(buf, len, "\"HELLO\"", 7)) {
-        handle_hello(buf, len);
+int mesh_next_hops(const char *dest_id, char out[][32], int max) {
+    const char *dot = strchr(dest_id, '.');
+    const char *node = dot ? dot + 1 : dest_id;
+    uint32_t dest_ch = dot ? (uint32_t)strtoul(dest_id, NULL, 16) : 0;
+    uint32_t h = mesh_id_hash(node);
+    const nb_table_t *t;
+    uint32_t seq;
+    int k;
+    uint64_t now = esp_timer_get_time();
+    do {
+        seq = nb_read_begin(&t);
+        k = 0;
+        int n = nb_count(t);
+        nb_t known;
+        int ki = nb_find(t, node);
+        if (ki >= 0) nb_get(t, ki, &known);
+        if (ki >= 0 && nb_is_direct(&known, now)) {
+            hops_add(out, &k, max, known.id);
+        } else {
+            // The first hop of the shortest known chain, the relay its HELLOs
+            // came through, any other direct neighbor that advertises it, and
+            // for another cluster the next hop of the cluster route.
+            int8_t path[ONION_MAX_HOPS];
+            if (ki >= 0 && nb_path(t, ki, now, path)) {
+                char id[32];
+                nb_load(id, t->e[path[0]].id, 32);
+                id[31] = 0;
+                hops_add(out, &k, max, id);
+            }
+            const char *via = ki >= 0 ? known.via : "";
+            for (int pass = 0; pass < 2; pass++) {
+                for (int i = 0; i < n && k < max; i++) {
+                    nb_t nb;
+                    nb_get(t, i, &nb);
+                    if (!nb_is_direct(&nb, now) || (pass == 0) != !strcmp(nb.id, via)) continue;
+                    if (pass == 1 && !nb_covers(&nb, h)) continue;
+                    hops_add(out, &k, max, nb.id);
+                }
+            }
+            if (MESH_CLUSTERED && dest_ch && dest_ch != NB_LD(t->my_ch)) {
+                int c = cl_count(t);
+                for (int i = 0; i < c; i++) {
+                    if (NB_LD(t->cl[i].ch) != dest_ch) continue;
+                    uint32_t next = NB_LD(t->cl[i].next);
+                    for (int j = 0; j < n; j++) {
+                        nb_t nb;
+                        nb_get(t, j, &nb);
+                        if (nb.h == next && nb_is_direct(&nb, now)) hops_add(out, &k, max, nb.id);
+                    }
+                    break;
+                }
+            }
+        }
+    } while (nb_read_retry(seq));
+    return k;
+}
+
+void mesh_on_radio_frame(uint8_t *buf, size_t len) {
+    if (!nb_wlock) return;  // radio starts before mesh_init()
+    // Control traffic is JSON; everything else is a binary onion frame.
+    if (len > 10 && buf[0] == '{') {
+        if (memmem(buf, len, "\"HELLO\"", 7)) handle_hello(buf, len);
+        else if (memmem(buf, len, "\"KEY_", 5)) keydir_on_frame(buf, len);
+        return;
+    }
+    if (len && buf[0] == RADIO_CT_FMT) {
+        onion_on_frame(buf, len);
         return;
     }
-    onion_on_frame(buf, len);
+    if (len <= RADIO_LINK_TRAILER || !link_open(buf, len)) return;
+    onion_on_frame(buf, len - RADIO_LINK_TRAILER);
 }
\ No newline at end of file
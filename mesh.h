@@ -4,6 +4,30 @@
 #include <stdbool.h>
 
 void mesh_init(void);
+// Shortest chain of radio hops to dest_id (at most ONION_MAX_HOPS, dest
+// last) over the links neighbors advertise in their HELLOs; false when dest
+// is beyond what this node has heard, e.g. in another cluster. Entries are
+// strdup()ed for the caller to free.
 bool mesh_choose_route(const char *dest_id, const char **route_out, size_t *route_len);
-void mesh_on_radio_frame(const uint8_t *buf, size_t len);
-bool mesh_get_x25519_pub(const char *node_id, uint8_t out_pub[32]);
\ No newline at end of file
+// Direct neighbors that can take a DTN bundle for dest_id, best first:
+// dest itself when in range, else the first hop of the route above, the
+// relay it is heard through, any neighbor advertising it as a one-hop
+// neighbor, and for a "<cluster>.<node>" address elsewhere the next hop
+// toward that cluster.
+int mesh_next_hops(const char *dest_id, char out[][32], int max);
+void mesh_on_radio_frame(uint8_t *buf, size_t len);
+bool mesh_get_x25519_pub(const char *node_id, uint8_t out_pub[32]);
+bool mesh_get_ed25519_pub(const char *node_id, uint8_t out_pub[32]);
+uint32_t mesh_id_hash(const char *node_id);
+// The neighbor whose id has mesh_id_hash() h; false if none is known.
+bool mesh_neighbor_by_hash(uint32_t h, char out_id[32]);
+bool mesh_get_address(char *out, size_t len);
+// Binary frames dropped by link authentication: addressed to another node,
+// from a sender with no known key, or with a bad tag.
+void mesh_link_stats(uint32_t *overheard, uint32_t *unknown_src, uint32_t *bad_tag);
+// Neighbor table changes, published once mesh_choose_route() can see them.
+// node_id is NULL for cluster routes. Callbacks run on the radio task and
+// must not block; subscribe during init.
+typedef enum { MESH_EV_NEIGHBOR_UP, MESH_EV_ROUTE_CHANGE } mesh_event_t;
+typedef void (*mesh_event_cb_t)(mesh_event_t ev, const char *node_id, void *arg);
+bool mesh_subscribe(mesh_event_cb_t cb, void *arg);
@@ -8,7 +8,9 @@
 #define NRF24_MOSI_PIN 13
 
 
+#ifndef NODE_ID  // host simulators run many nodes in one process
 #define NODE_ID        "E32-S2-01"
+#endif
 
 
 #define AP_SSID       "FUSION_NODE2_AP"
@@ -18,6 +20,123 @@
 
 #define HELLO_INTERVAL_MS 10000
 #define HELLO_TTL         5
+#define NB_PERSIST_INTERVAL_MS 60000
+#define NB_STALE_GRACE_MS (3 * HELLO_INTERVAL_MS)
+#define MESH_MAX_NB2      32   // a neighbor's whole advertised list (mesh.cpp MAX_NB)
+#define MESH_MAX_2HOP     64   // past this, neighbors reaching the rest all relay
+#define NB_EXPIRE_MS      (6 * HELLO_INTERVAL_MS)
+
+// Clustered mode: lowest-ID cluster heads, HELLO floods kept inside the
+// cluster and cluster-level routes in between. Per-node state is then
+// bounded by MAX_NB + MESH_MAX_CLUSTERS whatever the network size; routes
+// reach every cluster while there are at most MESH_MAX_CLUSTERS of them
+// within MESH_CL_MAX_HOPS (about 1000 nodes at 8 neighbors each).
+#ifndef MESH_CLUSTERED
+#define MESH_CLUSTERED    0
+#endif
+#define MESH_MAX_CLUSTERS 128
+#define MESH_CL_RADIUS    2   // hops from a member to its head
+#define MESH_CL_MAX_HOPS  32
 #define ONION_MAX_BYTES   2048
-#define DTN_MAX_ITEMS     32
-#define REPLAY_CACHE_SIZE 64
\ No newline at end of file
+#define ONION_MAX_HOPS    8
+// Sphinx onions: constant SPHINX_OVERHEAD whatever the route length, which
+// beats per-layer onions from 5 hops up; relays need both formats either way.
+#ifndef ONION_SPHINX
+#define ONION_SPHINX      0
+#endif
+#define ONION_MAX_CIRCUITS     16
+#define ONION_MAX_CIRCUITS_OWN 4
+#define ONION_CIRC_LIFETIME_MS 300000
+#define ONION_CIRC_IDLE_MS     600000
+#define ONION_CIRC_CREATED_MS  10000  // no CREATED back by then: rebuild it
+#define ONION_CUT_THROUGH      1    // relays pass large cells on per fragment
+// Paced for the half-duplex radio, cut-through only beats relays storing
+// and forwarding whole cells for big ones on long routes (test/sim_ct).
+#ifndef ONION_CT_MIN_BYTES
+#define ONION_CT_MIN_BYTES     1536
+#define ONION_CT_MIN_HOPS      8
+#endif
+#define ONION_CT_CHUNK         240  // payload bytes per end-to-end tag
+// Bundle slots. Payloads stay in the bundle store, but every slot costs 66
+// bytes of DRAM on the ESP32 whether used or not: its queue entry (56), the
+// expiry heap (2), the id index (4) and the store's record address (4), so
+// 256 slots take 17 KB of .bss; the build fails past DTN_SLOT_RAM_MAX.
+// dtn_init() logs the figure and complains when less than
+// DTN_MIN_FREE_DRAM is left for WiFi and the phone task.
+#ifndef DTN_MAX_ITEMS
+#define DTN_MAX_ITEMS     256
+#endif
+#define DTN_SLOT_RAM_MAX  (20 * 1024)
+#define DTN_MIN_FREE_DRAM (40 * 1024)
+#define DTN_MAX_RAM_ITEMS 32    // without the flash partition they sit in RAM
+#define DTN_MAX_DESTS     32
+#define DTN_RETRY_MS      5000  // while bundles wait; mesh events wake it sooner
+#define DTN_CUSTODY_TIMEOUT_MS 10000  // first resend without a custody ack
+#define DTN_BACKOFF_MAX_SHIFT  6      // then doubling, up to 64x
+#define DTN_MAX_NEXT_HOPS      4
+#define DTN_SEEN_SIZE          64     // delivered bundle ids, for resends
+#define DTN_SPRAY_COPIES       8      // default spray-and-wait copy budget
+#define DTN_SV_BLOOM_BITS      4096   // held ids in a summary vector, 16 bits each up to this
+#define DTN_SV_BLOOM_PROBES    4
+#define DTN_SV_SLOTS           2      // summary vectors waiting to be served
+#define DTN_SV_PUSH_MAX        16     // copies pushed per summary vector round
+#define DTN_SV_HOLDOFF_MS      3000   // one vector per neighbor per contact
+#define DTN_LIFETIME_S         86400  // default bundle lifetime
+#define DTN_BYTE_BUDGET        (1536 * 1024)  // payload bytes held in the bundle store
+#define DTN_RAM_BYTE_BUDGET    (16 * 1024)    // payload pool without it, allocated at boot
+// PRoPHET (RFC 6693 defaults), see prophet.h
+#define DTN_PROPHET_SIZE         64     // predictabilities kept and sent
+#define DTN_PROPHET_P_INIT       0.75f
+#define DTN_PROPHET_BETA         0.25f  // transitivity
+#define DTN_PROPHET_GAMMA        0.98f  // aging per unit
+#define DTN_PROPHET_AGE_UNIT_MS  30000
+#define DTN_PROPHET_ENCOUNTER_MS 60000  // one encounter per contact
+#define DTN_PROPHET_MIN          0.01f  // below this an entry is not worth a slot
+#define DTN_CGR_MAX_CONTACTS     64     // contact plan entries, see cgr.h
+#define DTN_CGR_PLAN_BYTES       4000   // largest plan kept in storage
+// Replay window: exact set for recent tags, then two rotating Bloom filters
+// of REPLAY_BLOOM_CAP tags each; 16 bits and 6 probes per tag keep false
+// positives (fresh packets dropped) near 0.1% per filter when full.
+#define REPLAY_SET_SIZE     256
+#define REPLAY_BLOOM_BITS   65536
+#define REPLAY_BLOOM_CAP    4096
+#define REPLAY_BLOOM_PROBES 6
+#define REPLAY_WINDOW_MS  1800000
+#define X25519_POOL_SIZE  16
+
+// Large phone messages: chunk size, reorder window at the destination and
+// how long either end waits for the next piece.
+#define STREAM_CHUNK            1024
+#define STREAM_WINDOW           4
+#define STREAM_RX_TIMEOUT_MS    30000
+#define STREAM_PHONE_TIMEOUT_MS 5000
+
+#define KEYDIR_CACHE_SIZE      64
+#define KEYDIR_REPLICAS        3
+#define KEYDIR_TTL             6
+#define KEYDIR_SEEN_SIZE       32
+#define KEYDIR_PUBLISH_MS      300000
+#define KEYDIR_LOOKUP_RETRY_MS 5000
+// Ed25519 key (64 hex) that certifies node keys for the directory
+// (keydir.h); unset, no key record is trusted and the directory is off.
+#ifndef KEYDIR_ANCHOR_PUB
+#define KEYDIR_ANCHOR_PUB      ""
+#endif
+
+// Bundle store: log-structured records on a data partition of this label
+// and subtype (see partitions.csv); host builds use a file instead.
+#define BUNDLE_STORE_LABEL       "bundles"
+#define BUNDLE_STORE_SUBTYPE     0x40
+#define BUNDLE_STORE_MAX_SECTORS 512
+#define BUNDLE_STORE_GC_FREE     4     // reclaim below this many free sectors
+#define BUNDLE_STORE_HOST_FILE   "bundles.bin"
+#define BUNDLE_STORE_HOST_SIZE   (64 * 4096)
+#define BUNDLE_POOL_MIN_BLOCK    64               // RAM payload size classes, bundle_pool.h
+#define BUNDLE_POOL_MAX_BLOCK    ONION_MAX_BYTES
+
+// Task stacks in bytes. The radio task checks signatures (HELLO, keys,
+// custody acks) and signs custody acks; the DTN task builds onions. Each
+// logs every new low of its unused stack and warns below STACK_WARN_BYTES.
+#define RADIO_RX_STACK   8192
+#define DTN_TASK_STACK   8192
+#define STACK_WARN_BYTES 1024
\ No newline at end of file
@@ -1,147 +1,914 @@
 #include "onion.h"
 #include "mesh.h"
+#include "keydir.h"
+#include "stream.h"
+#include "dtn.h"
 #include "radio.h"
 #include "crypto_abstraction.h"
 #include "node_config.h"
 #include "esp_log.h"
-#include "mbedtls/sha256.h"
-#include <cJSON.h>
+#include "esp_timer.h"
 #include <string.h>
 #include <stdlib.h>
-#include <cstdio>
+#include <atomic>
+#include <cstdio>    // For snprintf
 
 static const char *TAG = "onion";
-static uint8_t replay_cache[REPLAY_CACHE_SIZE][32];
-static int replay_cache_idx = 0;
 
-static bool is_replay(const uint8_t *buf, size_t len) {
-    uint8_t hash[32];
-    mbedtls_sha256(buf, len, hash, 0);
-    for (int i = 0; i < REPLAY_CACHE_SIZE; i++) {
-        if (memcmp(replay_cache[i], hash, 32) == 0) return true;
+static void wr32(uint8_t *p, uint32_t v) { for (int i = 0; i < 4; i++) p[i] = v >> (24 - 8 * i); }
+static uint32_t rd32(const uint8_t *p) { return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3]; }
+static void wr64(uint8_t *p, uint64_t v) { for (int i = 0; i < 8; i++) p[i] = v >> (56 - 8 * i); }
+static uint64_t rd64(const uint8_t *p) { uint64_t v = 0; for (int i = 0; i < 8; i++) v = (v << 8) | p[i]; return v; }
+
+// Circuits. A relay entry maps the inbound circuit id to its key, next hop
+// and outbound id, with a 64-cell anti-replay window over the counter;
+// entries idle for ONION_CIRC_IDLE_MS are reused first. Relay entries
+// are only touched by the radio rx task, origin entries by the sender.
+typedef struct {
+    uint32_t cid_in, cid_out;
+    uint8_t key[32];
+    char next[ONION_NEXT_LEN];
+    uint32_t prev;  // mesh_id_hash() of the hop CREATED goes back to
+    uint64_t top, window;
+    uint64_t last;
+    bool used;
+} circ_relay_t;
+
+typedef struct {
+    char hops[ONION_MAX_HOPS][ONION_NEXT_LEN];
+    uint8_t key[ONION_MAX_HOPS][32];
+    size_t n;
+    uint32_t cids[ONION_MAX_HOPS + 1];
+    bool up;  // the exit's CREATED came back
+    uint64_t ctr;
+    uint64_t created;
+    bool used;
+} circ_own_t;
+
+static circ_relay_t circ_relay[ONION_MAX_CIRCUITS];
+static circ_own_t circ_own[ONION_MAX_CIRCUITS_OWN];
+// CREATED replies for our own circuits, from the rx task to the sender:
+// one producer, one consumer.
+static uint8_t created_ring[ONION_MAX_CIRCUITS_OWN][ONION_CREATED_LEN];
+static std::atomic<uint32_t> created_head(0), created_tail(0);
+
+static circ_relay_t *circ_relay_find(uint32_t cid) {
+    uint64_t now = esp_timer_get_time();
+    for (int i = 0; i < ONION_MAX_CIRCUITS; i++) {
+        circ_relay_t *c = &circ_relay[i];
+        if (!c->used || c->cid_in != cid) continue;
+        if (now - c->last > (uint64_t)ONION_CIRC_IDLE_MS * 1000) {
+            crypto_wipe(c, sizeof(*c));
+            return NULL;
+        }
+        return c;
     }
-    memcpy(replay_cache[replay_cache_idx], hash, 32);
-    replay_cache_idx = (replay_cache_idx + 1) % REPLAY_CACHE_SIZE;
-    return false;
+    return NULL;
 }
 
-static char* hex_of(const uint8_t *b, size_t n) {
-    char *o = (char*)malloc(n * 2 + 1);
-    for (size_t i = 0; i < n; i++) sprintf(o + i * 2, "%02x", b[i]);
-    o[n * 2] = 0;
-    return o;
+static circ_relay_t *circ_relay_add(uint32_t cid_in, uint32_t cid_out, const char *next, const uint8_t key[32], uint32_t prev) {
+    circ_relay_t *c = &circ_relay[0];
+    for (int i = 0; i < ONION_MAX_CIRCUITS; i++) {
+        circ_relay_t *e = &circ_relay[i];
+        if (!e->used || e->cid_in == cid_in) { c = e; break; }
+        if (e->last < c->last) c = e;
+    }
+    // A repeated CREATE of the same circuit keeps the replay window.
+    if (!(c->used && c->cid_in == cid_in && !memcmp(c->key, key, 32))) {
+        memset(c, 0, sizeof(*c));
+        c->cid_in = cid_in;
+        c->cid_out = cid_out;
+        memcpy(c->key, key, 32);
+        strncpy(c->next, next, ONION_NEXT_LEN - 1);
+        c->prev = prev;
+        c->used = true;
+    }
+    c->last = esp_timer_get_time();
+    return c;
 }
-static uint8_t* unhex(const char *h, size_t *out) {
-    size_t n = strlen(h) / 2;
-    uint8_t *b = (uint8_t*)malloc(n);
-    for (size_t i = 0; i < n; i++) { unsigned v; sscanf(h + i * 2, "%02x", &v); b[i] = v; }
-    *out = n;
-    return b;
+
+// Replay protection. The tag is the packet's ephemeral element (layer epk
+// or Sphinx alpha), fresh for every packet and hop, so its first 8 bytes
+// serve as the fingerprint without hashing. Tags of the current bucket sit
+// in an exact open-addressing set; a full set is flushed into the newer of
+// two Bloom filters, which swap every REPLAY_WINDOW_MS / 2 or once they
+// hold REPLAY_BLOOM_CAP tags. Only tags that authenticated are recorded,
+// so frames meant for other nodes never fill the window.
+static uint64_t replay_set[REPLAY_SET_SIZE];
+static int replay_set_n;
+static uint8_t replay_bloom[2][REPLAY_BLOOM_BITS / 8];
+static int replay_bloom_n[2], replay_cur;
+static uint64_t replay_rotated;
+
+static uint64_t replay_fp(const uint8_t tag[32]) {
+    uint64_t f = rd64(tag);
+    return f ? f : 1;  // 0 marks a free slot
 }
 
-bool onion_build(const char **route, size_t route_len, const uint8_t *inner, size_t inner_len, uint8_t *out, size_t *out_len) {
-    uint8_t *payload = (uint8_t*)malloc(inner_len);
-    memcpy(payload, inner, inner_len);
-    size_t plen = inner_len;
+static bool bloom_test(int which, uint64_t f, bool set) {
+    uint32_t h1 = (uint32_t)f, h2 = (uint32_t)(f >> 32) | 1;
+    bool all = true;
+    for (uint32_t j = 0; j < REPLAY_BLOOM_PROBES; j++) {
+        uint32_t bit = (h1 + j * h2) % REPLAY_BLOOM_BITS;
+        if (set) replay_bloom[which][bit >> 3] |= 1 << (bit & 7);
+        else if (!(replay_bloom[which][bit >> 3] & (1 << (bit & 7)))) all = false;
+    }
+    return all;
+}
+
+static void replay_rotate(void) {
+    replay_cur ^= 1;
+    memset(replay_bloom[replay_cur], 0, sizeof(replay_bloom[0]));
+    replay_bloom_n[replay_cur] = 0;
+    replay_rotated = esp_timer_get_time();
+}
+
+static bool replay_seen(uint64_t f) {
+    if (esp_timer_get_time() - replay_rotated >= (uint64_t)REPLAY_WINDOW_MS * 500) replay_rotate();
+    for (uint32_t i = f % REPLAY_SET_SIZE; replay_set[i]; i = (i + 1) % REPLAY_SET_SIZE) {
+        if (replay_set[i] == f) return true;
+    }
+    return bloom_test(0, f, false) || bloom_test(1, f, false);
+}
+
+static void replay_add(uint64_t f) {
+    if (replay_set_n >= REPLAY_SET_SIZE * 3 / 4) {
+        for (int i = 0; i < REPLAY_SET_SIZE; i++) {
+            if (!replay_set[i]) continue;
+            if (replay_bloom_n[replay_cur] >= REPLAY_BLOOM_CAP) replay_rotate();
+            bloom_test(replay_cur, replay_set[i], true);
+            replay_bloom_n[replay_cur]++;
+        }
+        memset(replay_set, 0, sizeof(replay_set));
+        replay_set_n = 0;
+    }
+    uint32_t i = f % REPLAY_SET_SIZE;
+    while (replay_set[i]) i = (i + 1) % REPLAY_SET_SIZE;
+    replay_set[i] = f;
+    replay_set_n++;
+}
 
+// Binary layer, one per hop:
+//   [fmt 1][epk 32][nonce 24][mac 16][ E(next 32 | inner) ]
+// next is the NUL-padded id of the hop to forward to ("LOCAL" on the last
+// one) and inner is the next layer verbatim, so every hop costs exactly
+// ONION_LAYER_OVERHEAD bytes.
+//
+// Layers are built innermost first, each one written into the headroom in
+// front of the previous and encrypted in place, so the finished onion ends
+// where the caller's payload ends and nothing is allocated or copied.
+//
+// A circuit CREATE (cids != NULL) has the same layout with fmt
+// ONION_FMT_CREATE and next followed by the hop's inbound and outbound
+// circuit ids, its circuit key from ckeys and the hash of the hop before.
+static uint8_t* layers_build(const char **route, size_t route_len, const uint8_t hop_pub[][32], uint8_t *inner, size_t inner_len,
+                             const uint32_t *cids, const uint8_t ckeys[][32], size_t *out_len) {
+    size_t next_len = cids ? ONION_CREATE_NEXT_LEN : ONION_NEXT_LEN;
+    uint8_t *p = inner;
+    size_t plen = inner_len;
     for (int i = (int)route_len - 1; i >= 0; --i) {
         const char *hop = route[i];
-        uint8_t hop_pub[32];
-        if (!mesh_get_x25519_pub(hop, hop_pub)) {
-            ESP_LOGE(TAG, "no pub for %s", hop);
-            free(payload);
-            return false;
-        }
         eph_kp_t epk;
         x25519_ephemeral(&epk);
         uint8_t shared[32];
-        x25519_shared(epk.priv, hop_pub, shared);
+        x25519_shared(epk.priv, hop_pub[i], shared);
         char info[64];
         int ilen = snprintf(info, sizeof(info), "layer:%s", hop);
         uint8_t key[32];
         hkdf_sha256(shared, 32, (uint8_t*)info, ilen, key);
-        uint8_t nonce[24];
-        random_bytes(nonce, 24);
 
         const char *next = (i + 1 < (int)route_len) ? route[i + 1] : "LOCAL";
-        char *inner_hex = hex_of(payload, plen);
-        cJSON *pl = cJSON_CreateObject();
-        cJSON_AddStringToObject(pl, "next", next);
-        cJSON_AddStringToObject(pl, "inner", inner_hex);
-        free(inner_hex);
-        char *plain = cJSON_PrintUnformatted(pl);
-        size_t plain_len = strlen(plain);
-        cJSON_Delete(pl);
-
-        size_t ct_max = plain_len + 32;
-        uint8_t *ct = (uint8_t*)malloc(ct_max);
-        size_t ct_len = 0;
-        aead_encrypt_xc20p(key, nonce, (uint8_t*)plain, plain_len, ct, &ct_len);
-        free(plain);
-
-        size_t layer_len = 32 + 24 + ct_len;
-        uint8_t *layer = (uint8_t*)malloc(layer_len);
-        memcpy(layer, epk.pub, 32);
-        memcpy(layer + 32, nonce, 24);
-        memcpy(layer + 56, ct, ct_len);
-        free(ct);
-        free(payload);
-        payload = layer;
-        plen = layer_len;
-    }
-    memcpy(out, payload, plen);
+        uint8_t *layer = p - (ONION_LAYER_OVERHEAD - ONION_NEXT_LEN + next_len);
+        uint8_t *body = layer + 1 + 32 + 24 + 16;
+        memset(body, 0, ONION_NEXT_LEN);
+        strncpy((char*)body, next, ONION_NEXT_LEN - 1);
+        layer[0] = ONION_FMT_LAYER;
+        if (cids) {
+            layer[0] = ONION_FMT_CREATE;
+            wr32(body + ONION_NEXT_LEN, cids[i]);
+            wr32(body + ONION_NEXT_LEN + 4, cids[i + 1]);
+            memcpy(body + ONION_NEXT_LEN + 8, ckeys[i], 32);
+            wr32(body + ONION_NEXT_LEN + 40, mesh_id_hash(i ? route[i - 1] : NODE_ID));
+        }
+        memcpy(layer + 1, epk.pub, 32);
+        random_bytes(layer + 33, 24);
+        aead_lock_inplace_xc20p(key, layer + 33, body, next_len + plen, layer + 57);
+        crypto_wipe(&epk, sizeof(epk));
+        crypto_wipe(shared, sizeof(shared));
+        crypto_wipe(key, sizeof(key));
+        plen += p - layer;
+        p = layer;
+    }
     *out_len = plen;
-    free(payload);
-    return true;
+    return p;
+}
+
+// Sphinx packet:
+//   [fmt 1][alpha 32][beta SPHINX_BETA_LEN][gamma 16][delta: tag 32 | inner]
+// alpha is the one group element, re-blinded by every hop. beta holds one
+// (next 32 | gamma 16) slot per hop under a ChaCha20 stream; each hop
+// shifts its slot out and the filler keeps the length constant. gamma is
+// the hop's MAC over beta. delta is a LIONESS-style wide block (ChaCha20 +
+// keyed BLAKE2b) that every hop unwraps; a zero tag at the exit proves it
+// was not altered on the way. All of it keeps its size along the route.
+typedef struct { uint8_t rho[32], mu[32], pi[4][32]; } sphinx_keys_t;
+
+static void sphinx_keys(const uint8_t s[32], sphinx_keys_t *k) {
+    uint8_t pi[64];
+    crypto_blake2b_keyed(k->rho, 32, s, 32, (const uint8_t*)"sphinx-rho", 10);
+    crypto_blake2b_keyed(k->mu, 32, s, 32, (const uint8_t*)"sphinx-mu", 9);
+    crypto_blake2b_keyed(pi, 64, s, 32, (const uint8_t*)"sphinx-pi1", 10);
+    memcpy(k->pi[0], pi, 64);
+    crypto_blake2b_keyed(pi, 64, s, 32, (const uint8_t*)"sphinx-pi2", 10);
+    memcpy(k->pi[2], pi, 64);
+    crypto_wipe(pi, sizeof(pi));
+}
+
+// Blinding factor for the next alpha; X25519 clamps it like any scalar,
+// and the sender applies the very same clamped factors to each s.
+static void sphinx_blind(uint8_t alpha[32], const uint8_t s[32]) {
+    uint8_t b[32], out[32];
+    crypto_blake2b_keyed(b, 32, s, 32, alpha, 32);
+    crypto_x25519(out, b, alpha);
+    memcpy(alpha, out, 32);
+    crypto_wipe(b, sizeof(b));
+}
+
+// XORs buf with bytes [off, off + len) of the ChaCha20 keystream.
+static void xor_stream(const uint8_t key[32], const uint8_t nonce[8], uint8_t *buf, size_t len, size_t off) {
+    uint8_t blk[64];
+    while (len) {
+        size_t in = off % 64, n = 64 - in;
+        if (n > len) n = len;
+        crypto_chacha20_djb(blk, NULL, 64, key, nonce, off / 64);
+        for (size_t j = 0; j < n; j++) buf[j] ^= blk[in + j];
+        buf += n; off += n; len -= n;
+    }
+    crypto_wipe(blk, sizeof(blk));
+}
+
+static void sphinx_xor_stream(const uint8_t rho[32], uint8_t *buf, size_t len, size_t off) {
+    static const uint8_t nonce[8] = {0};
+    xor_stream(rho, nonce, buf, len, off);
+}
+
+static void sphinx_mac(const uint8_t mu[32], const uint8_t *beta, uint8_t gamma[16]) {
+    crypto_blake2b_keyed(gamma, 16, mu, 32, beta, SPHINX_BETA_LEN);
+}
+
+static void lioness_stream(const uint8_t l[32], const uint8_t k[32], uint8_t *r, size_t rlen) {
+    static const uint8_t nonce[8] = {0};
+    uint8_t key[32];
+    for (int i = 0; i < 32; i++) key[i] = l[i] ^ k[i];
+    crypto_chacha20_djb(r, r, rlen, key, nonce, 0);
+    crypto_wipe(key, sizeof(key));
+}
+
+static void lioness_hash(uint8_t l[32], const uint8_t k[32], const uint8_t *r, size_t rlen) {
+    uint8_t h[32];
+    crypto_blake2b_keyed(h, 32, k, 32, r, rlen);
+    for (int i = 0; i < 32; i++) l[i] ^= h[i];
+    crypto_wipe(h, sizeof(h));
+}
+
+static void lioness_encrypt(uint8_t pi[4][32], uint8_t *d, size_t len) {
+    lioness_stream(d, pi[0], d + 32, len - 32);
+    lioness_hash(d, pi[1], d + 32, len - 32);
+    lioness_stream(d, pi[2], d + 32, len - 32);
+    lioness_hash(d, pi[3], d + 32, len - 32);
+}
+
+static void lioness_decrypt(uint8_t pi[4][32], uint8_t *d, size_t len) {
+    lioness_hash(d, pi[3], d + 32, len - 32);
+    lioness_stream(d, pi[2], d + 32, len - 32);
+    lioness_hash(d, pi[1], d + 32, len - 32);
+    lioness_stream(d, pi[0], d + 32, len - 32);
+}
+
+// X25519 clamps its scalar, so the sender's running product m (mod L, the
+// group order) goes in as 8m, with m or L - m (same x coordinate) picked to
+// lie in [2^251, 2^252) where clamping leaves 8m alone. Fails only for an m
+// within 2^125 of 0 or L.
+static bool sphinx_scalar(const uint8_t m[32], uint8_t out[32]) {
+    static const uint8_t L[32] = {
+        0xed, 0xd3, 0xf5, 0x5c, 0x1a, 0x63, 0x12, 0x58, 0xd6, 0x9c, 0xf7, 0xa2, 0xde, 0xf9, 0xde, 0x14,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x10 };
+    uint8_t v[32];
+    memcpy(v, m, 32);
+    if (m[31] < 0x08) {
+        int borrow = 0;
+        for (int i = 0; i < 32; i++) {
+            int d = L[i] - m[i] - borrow;
+            v[i] = (uint8_t)d;
+            borrow = d < 0;
+        }
+    }
+    bool ok = v[31] >= 0x08 && v[31] < 0x10;
+    for (int i = 31; i > 0; i--) out[i] = (uint8_t)(v[i] << 3 | v[i - 1] >> 5);
+    out[0] = (uint8_t)(v[0] << 3);
+    crypto_wipe(v, sizeof(v));
+    return ok;
+}
+
+static void sphinx_clamp(uint8_t k[32]) {
+    k[0] &= 248;
+    k[31] = (k[31] & 127) | 64;
+}
+
+// The header is written straight into the headroom. beta is first used as
+// scratch for the filler, then wrapped from the exit back to the first hop.
+// s_i is x * b_0 * ... * b_(i-1) * P_i, so the sender keeps that product of
+// clamped scalars as one scalar and pays per hop one X25519 for s_i and one
+// fixed-base multiplication for the next alpha. Each relay does two X25519
+// operations: its shared secret and the re-blinding of alpha.
+static uint8_t* sphinx_build(const char **route, size_t route_len, const uint8_t hop_pub[][32], uint8_t *inner, size_t inner_len, size_t *out_len) {
+    static const uint8_t zero[32] = {0};
+    const size_t B = SPHINX_HOP_LEN, R = ONION_MAX_HOPS, n = route_len;
+    uint8_t alpha[32], s[ONION_MAX_HOPS][32], m[32], c[32], b[32];
+    eph_kp_t x;
+    x25519_ephemeral(&x);
+    memcpy(alpha, x.pub, 32);
+    uint8_t *pkt = inner - SPHINX_OVERHEAD;
+    pkt[0] = ONION_FMT_SPHINX;
+    memcpy(pkt + 1, alpha, 32);
+    memcpy(c, x.priv, 32);
+    sphinx_clamp(c);
+    for (int i = 0; i < 31; i++) m[i] = (uint8_t)(c[i] >> 3 | c[i + 1] << 5);
+    m[31] = c[31] >> 3;
+    bool ok = true;
+    for (size_t i = 0; i < n && ok; i++) {
+        crypto_x25519(s[i], c, hop_pub[i]);
+        if (i + 1 == n) break;
+        crypto_blake2b_keyed(b, 32, s[i], 32, alpha, 32);
+        sphinx_clamp(b);
+        crypto_eddsa_mul_add(m, m, b, zero);
+        ok = sphinx_scalar(m, c);
+        crypto_x25519_dirty_fast(alpha, c);
+    }
+    crypto_wipe(m, sizeof(m));
+    crypto_wipe(c, sizeof(c));
+    crypto_wipe(b, sizeof(b));
+    if (!ok) {
+        crypto_wipe(&x, sizeof(x));
+        crypto_wipe(s, sizeof(s));
+        return NULL;
+    }
+
+    uint8_t *beta = pkt + 33, *gamma = beta + SPHINX_BETA_LEN;
+    sphinx_keys_t k;
+    size_t fl = 0;
+    for (size_t i = 0; i + 1 < n; i++) {
+        sphinx_keys(s[i], &k);
+        memset(beta + fl, 0, B);
+        fl += B;
+        sphinx_xor_stream(k.rho, beta, fl, (R + 1) * B - fl);
+    }
+    size_t head = (R - n + 1) * B;
+    memmove(beta + head, beta, fl);
+    memset(beta, 0, ONION_NEXT_LEN);
+    strcpy((char*)beta, "LOCAL");
+    random_bytes(beta + ONION_NEXT_LEN, head - ONION_NEXT_LEN);
+    sphinx_keys(s[n - 1], &k);
+    sphinx_xor_stream(k.rho, beta, head, 0);
+    sphinx_mac(k.mu, beta, gamma);
+    for (int i = (int)n - 2; i >= 0; --i) {
+        sphinx_keys(s[i], &k);
+        memmove(beta + B, beta, (R - 1) * B);
+        memset(beta, 0, ONION_NEXT_LEN);
+        strncpy((char*)beta, route[i + 1], ONION_NEXT_LEN - 1);
+        memcpy(beta + ONION_NEXT_LEN, gamma, 16);
+        sphinx_xor_stream(k.rho, beta, R * B, 0);
+        sphinx_mac(k.mu, beta, gamma);
+    }
+
+    uint8_t *delta = inner - SPHINX_TAG_LEN;
+    size_t dlen = inner_len + SPHINX_TAG_LEN;
+    memset(delta, 0, SPHINX_TAG_LEN);
+    for (int i = (int)n - 1; i >= 0; --i) {
+        sphinx_keys(s[i], &k);
+        lioness_encrypt(k.pi, delta, dlen);
+    }
+    crypto_wipe(&x, sizeof(x));
+    crypto_wipe(s, sizeof(s));
+    crypto_wipe(&k, sizeof(k));
+    *out_len = SPHINX_OVERHEAD + inner_len;
+    return pkt;
+}
+
+uint8_t* onion_build(const char **route, size_t route_len, uint8_t *inner, size_t inner_len, size_t headroom, size_t *out_len) {
+    if (route_len == 0 || route_len > ONION_MAX_HOPS || inner_len == 0 || headroom < ONION_HEADROOM(route_len) ||
+        inner_len + ONION_HEADROOM(route_len) > ONION_MAX_BYTES) {
+        ESP_LOGE(TAG, "onion too large: %u bytes over %u hops", (unsigned)inner_len, (unsigned)route_len);
+        return NULL;
+    }
+    uint8_t hop_pub[ONION_MAX_HOPS][32];
+    for (size_t i = 0; i < route_len; i++) {
+        if (!mesh_get_x25519_pub(route[i], hop_pub[i]) && !keydir_get_x25519_pub(route[i], hop_pub[i])) {
+            keydir_lookup(route[i]);
+            ESP_LOGE(TAG, "no pub for %s, directory lookup started", route[i]);
+            return NULL;
+        }
+    }
+#if ONION_SPHINX
+    return sphinx_build(route, route_len, hop_pub, inner, inner_len, out_len);
+#else
+    return layers_build(route, route_len, hop_pub, inner, inner_len, NULL, NULL, out_len);
+#endif
+}
+
+static void deliver_local(uint8_t *inner, size_t inner_len) {
+    if (inner_len == 0) return;
+    if (inner[0] == ONION_KIND_STREAM) {
+        stream_on_chunk(inner + 1, inner_len - 1);
+        return;
+    }
+    if (inner[0] == ONION_KIND_CUSTODY) {
+        dtn_on_custody(inner + 1, inner_len - 1);
+        return;
+    }
+    if (inner[0] == ONION_KIND_SUMMARY) {
+        dtn_on_summary(inner + 1, inner_len - 1);
+        return;
+    }
+    if (inner[0] == ONION_KIND_BUNDLE) {
+        // A bundle for us carries the onion the origin sealed to us.
+        const uint8_t *sealed;
+        size_t sealed_len;
+        if (dtn_on_bundle(inner + 1, inner_len - 1, &sealed, &sealed_len)) onion_on_frame((uint8_t*)sealed, sealed_len);
+        return;
+    }
+    inner++;
+    inner_len--;
+    ESP_LOGI(TAG, "Deliver to local phone (%u bytes E2EE)", (unsigned)inner_len);
+    if (g_phone_client && g_phone_client.connected()) {
+        g_phone_client.write(inner, inner_len);
+        ESP_LOGI(TAG, "Pushed %u bytes to connected phone.", (unsigned)inner_len);
+    } else {
+        ESP_LOGW(TAG, "Packet for LOCAL, but no phone is connected.");
+    }
+}
+
+static void created_mac(const uint8_t key[32], uint32_t cid, uint8_t mac[16]) {
+    uint8_t m[11] = { 'c', 'r', 'e', 'a', 't', 'e', 'd' };
+    wr32(m + 7, cid);
+    crypto_blake2b_keyed(mac, 16, key, 32, m, sizeof(m));
+}
+
+static void created_to(uint32_t prev, const uint8_t *out) {
+    char hop[32];
+    if (!mesh_neighbor_by_hash(prev, hop)) {
+        ESP_LOGW(TAG, "CREATED on circuit %08x: no neighbor to pass it back to", (unsigned)rd32(out + 1));
+        return;
+    }
+    radio_send(hop, out, ONION_CREATED_LEN);
+}
+
+// The exit answers every CREATE, so one lost on the way back is made up by
+// the origin's next.
+static void created_send(const circ_relay_t *c) {
+    uint8_t out[ONION_CREATED_LEN];
+    out[0] = ONION_FMT_CREATED;
+    wr32(out + 1, c->cid_in);
+    created_mac(c->key, c->cid_in, out + 5);
+    created_to(c->prev, out);
 }
 
-static void peel_and_forward(const uint8_t *buf, size_t len) {
-    if (len < 56) return;
-    const uint8_t *epk = buf, *nonce = buf + 32, *ct = buf + 56;
-    size_t ct_len = len - 56;
+// A relay passes CREATED back under its inbound id; at the origin it waits
+// for the sender, which checks it.
+static void created_process(uint8_t *buf, size_t len) {
+    if (len != ONION_CREATED_LEN) return;
+    uint32_t cid = rd32(buf + 1);
+    for (int i = 0; i < ONION_MAX_CIRCUITS; i++) {
+        circ_relay_t *c = &circ_relay[i];
+        if (!c->used || c->cid_out != cid || !strcmp(c->next, "LOCAL")) continue;
+        wr32(buf + 1, c->cid_in);
+        created_to(c->prev, buf);
+        return;
+    }
+    uint32_t h = created_head.load(std::memory_order_relaxed);
+    if (h - created_tail.load(std::memory_order_acquire) == ONION_MAX_CIRCUITS_OWN) return;  // the next CREATE brings another
+    memcpy(created_ring[h % ONION_MAX_CIRCUITS_OWN], buf, ONION_CREATED_LEN);
+    created_head.store(h + 1, std::memory_order_release);
+}
+
+// Decrypts the layer in place inside the received frame; the next layer is
+// then just a slice of that same buffer and goes to the radio as is.
+static void peel_and_forward(uint8_t *buf, size_t len) {
+    size_t next_len = buf[0] == ONION_FMT_CREATE ? ONION_CREATE_NEXT_LEN : ONION_NEXT_LEN;
+    if (len < ONION_LAYER_OVERHEAD - ONION_NEXT_LEN + next_len) return;
+    const uint8_t *epk = buf + 1, *nonce = buf + 33, *mac = buf + 57;
+    uint8_t *body = buf + 73;
+    size_t body_len = len - 73;
+    uint64_t tag = replay_fp(epk);
+    if (replay_seen(tag)) {
+        ESP_LOGW(TAG, "Replay attack detected! Dropping packet.");
+        return;
+    }
     uint8_t shared[32];
     x25519_shared(crypto_get_x25519_private(), epk, shared);
     char info[64];
     int ilen = snprintf(info, sizeof(info), "layer:%s", NODE_ID);
     uint8_t key[32];
     hkdf_sha256(shared, 32, (uint8_t*)info, ilen, key);
-    uint8_t pt[ONION_MAX_BYTES];
-    size_t pt_len = 0;
-    if (!aead_decrypt_xc20p(key, nonce, ct, ct_len, pt, &pt_len)) {
+    bool ok = aead_unlock_inplace_xc20p(key, nonce, body, body_len, mac);
+    crypto_wipe(shared, sizeof(shared));
+    crypto_wipe(key, sizeof(key));
+    if (!ok) {
         ESP_LOGW(TAG, "AEAD fail");
         return;
     }
+    replay_add(tag);
 
-    char *s = strndup((char*)pt, pt_len);
-    cJSON *pl = cJSON_Parse(s);
-    if (!pl) { free(s); return; }
-    const char *next = cJSON_GetObjectItem(pl, "next")->valuestring;
-    const char *inner_hex = cJSON_GetObjectItem(pl, "inner")->valuestring;
-    size_t inner_len = 0;
-    uint8_t *inner = unhex(inner_hex, &inner_len);
-    cJSON_Delete(pl);
-    free(s);
-
+    char *next = (char*)body;
+    next[ONION_NEXT_LEN - 1] = 0;
+    if (next_len == ONION_CREATE_NEXT_LEN) {
+        circ_relay_t *c = circ_relay_add(rd32(body + ONION_NEXT_LEN), rd32(body + ONION_NEXT_LEN + 4), next,
+                                         body + ONION_NEXT_LEN + 8, rd32(body + ONION_NEXT_LEN + 40));
+        crypto_wipe(body + ONION_NEXT_LEN + 8, 32);
+        if (!strcmp(next, "LOCAL")) created_send(c);
+    }
     if (!strcmp(next, "LOCAL")) {
-        ESP_LOGI(TAG, "Deliver to local phone (%u bytes E2EE)", (unsigned)inner_len);
-        if (g_phone_client && g_phone_client.connected()) {
-            g_phone_client.write(inner, inner_len);
-            ESP_LOGI(TAG, "Pushed %u bytes to connected phone.", (unsigned)inner_len);
-        } else {
-            ESP_LOGW(TAG, "Packet for LOCAL, but no phone is connected.");
-        }
-        free(inner);
+        deliver_local(body + next_len, body_len - next_len);
         return;
     }
     ESP_LOGI(TAG, "Forwarding peeled onion to %s", next);
-    radio_send(next, inner, inner_len);
-    free(inner);
+    radio_send(next, body + next_len, body_len - next_len);
 }
 
-void onion_on_frame(const uint8_t *buf, size_t len) {
-    if (is_replay(buf, len)) {
+// Processes a Sphinx packet in place: same length out as in, so the frame
+// is forwarded from the reassembly buffer untouched apart from the rewrite.
+static void sphinx_process(uint8_t *buf, size_t len) {
+    static const uint8_t zero[32] = {0};
+    const size_t B = SPHINX_HOP_LEN, R = ONION_MAX_HOPS;
+    if (len <= SPHINX_OVERHEAD) return;
+    uint8_t *alpha = buf + 1, *beta = buf + 33, *gamma = beta + SPHINX_BETA_LEN;
+    uint8_t *delta = buf + SPHINX_HEADER_LEN;
+    size_t dlen = len - SPHINX_HEADER_LEN;
+    uint64_t tag = replay_fp(alpha);
+    if (replay_seen(tag)) {
         ESP_LOGW(TAG, "Replay attack detected! Dropping packet.");
         return;
     }
-    peel_and_forward(buf, len);
+    uint8_t s[32], mac[16];
+    x25519_shared(crypto_get_x25519_private(), alpha, s);
+    sphinx_keys_t k;
+    sphinx_keys(s, &k);
+    sphinx_mac(k.mu, beta, mac);
+    if (crypto_verify32(s, zero) == 0 || crypto_verify16(mac, gamma) != 0) {
+        ESP_LOGW(TAG, "Sphinx MAC fail");
+        crypto_wipe(s, sizeof(s));
+        crypto_wipe(&k, sizeof(k));
+        return;
+    }
+    replay_add(tag);
+    uint8_t hop[SPHINX_HOP_LEN];
+    memcpy(hop, beta, B);
+    sphinx_xor_stream(k.rho, hop, B, 0);
+    memmove(beta, beta + B, (R - 1) * B);
+    memset(beta + (R - 1) * B, 0, B);
+    sphinx_xor_stream(k.rho, beta, R * B, B);
+    memcpy(gamma, hop + ONION_NEXT_LEN, 16);
+    sphinx_blind(alpha, s);
+    lioness_decrypt(k.pi, delta, dlen);
+    crypto_wipe(s, sizeof(s));
+    crypto_wipe(&k, sizeof(k));
+
+    char *next = (char*)hop;
+    next[ONION_NEXT_LEN - 1] = 0;
+    if (!strcmp(next, "LOCAL")) {
+        if (crypto_verify32(delta, zero) != 0) {
+            ESP_LOGW(TAG, "Sphinx payload tag fail");
+            return;
+        }
+        deliver_local(delta + SPHINX_TAG_LEN, dlen - SPHINX_TAG_LEN);
+        return;
+    }
+    ESP_LOGI(TAG, "Forwarding Sphinx packet to %s", next);
+    radio_send(next, buf, len);
+}
+
+// 64-wide sliding window over the per-circuit counter.
+static bool circ_replayed(const circ_relay_t *c, uint64_t ctr) {
+    return ctr <= c->top && (c->top - ctr >= 64 || ((c->window >> (c->top - ctr)) & 1));
+}
+
+static void circ_accept(circ_relay_t *c, uint64_t ctr) {
+    if (ctr > c->top) {
+        c->window = ctr - c->top >= 64 ? 1 : (c->window << (ctr - c->top)) | 1;
+        c->top = ctr;
+    } else {
+        c->window |= 1ULL << (c->top - ctr);
+    }
+    c->last = esp_timer_get_time();
+}
+
+// Relay half of a cell: one AEAD open with the hop's circuit key, then the
+// header is rewritten with the outbound id right behind the spent MAC and
+// the shorter cell goes out from the same buffer.
+static void cell_process(uint8_t *buf, size_t len) {
+    if (len < ONION_CELL_OVERHEAD(1)) return;
+    uint32_t cid = rd32(buf + 1);
+    uint64_t ctr = rd64(buf + 5);
+    circ_relay_t *c = circ_relay_find(cid);
+    if (!c) return;  // the link tag says it is for us: the circuit expired or was torn down
+    if (circ_replayed(c, ctr)) {
+        ESP_LOGW(TAG, "Replayed cell on circuit %08x", (unsigned)cid);
+        return;
+    }
+    uint8_t nonce[24] = {0};
+    wr64(nonce, ctr);
+    uint8_t *body = buf + ONION_CELL_HDR + 16;
+    size_t body_len = len - ONION_CELL_HDR - 16;
+    if (!aead_unlock_inplace_xc20p(c->key, nonce, body, body_len, buf + ONION_CELL_HDR)) {
+        ESP_LOGW(TAG, "Cell AEAD fail on circuit %08x", (unsigned)cid);
+        return;
+    }
+    circ_accept(c, ctr);
+    if (!strcmp(c->next, "LOCAL")) {
+        deliver_local(body, body_len);
+        return;
+    }
+    uint8_t *out = buf + 16;
+    out[0] = ONION_FMT_CELL;
+    wr32(out + 1, c->cid_out);
+    wr64(out + 5, ctr);
+    radio_send(c->next, out, len - 16);
+}
+
+// Cut-through cells: [fmt][cid 4][ctr 8][len 2][tags 16 x ONION_MAX_HOPS]
+// then len payload bytes. The header never changes size, so fragment
+// boundaries stay put along the route: each relay checks the tag in slot 0,
+// shifts the slots left and pads with random bytes. The payload is XORed
+// with one ChaCha20 stream per hop (nonce = counter), which a relay can
+// strip from any fragment at its offset without seeing the rest. It is cut
+// into ONION_CT_CHUNK-byte chunks, each followed by a tag only the exit
+// can check, since nobody on the way holds the whole frame.
+#define CT_TAGS (1 + 4 + 8 + 2)
+#define CT_CHUNK_TAGGED (ONION_CT_CHUNK + 16)
+
+typedef struct { uint8_t stream[32], hdr[32], auth[32]; } ct_keys_t;
+
+static void ct_keys(const uint8_t key[32], ct_keys_t *k) {
+    crypto_blake2b_keyed(k->stream, 32, key, 32, (const uint8_t*)"ct-stream", 9);
+    crypto_blake2b_keyed(k->hdr, 32, key, 32, (const uint8_t*)"ct-hdr", 6);
+    crypto_blake2b_keyed(k->auth, 32, key, 32, (const uint8_t*)"ct-auth", 7);
+}
+
+static void ct_hdr_tag(const uint8_t key[32], uint32_t cid, const uint8_t *hdr, uint8_t tag[16]) {
+    uint8_t m[CT_TAGS];
+    m[0] = ONION_FMT_CT;
+    wr32(m + 1, cid);
+    memcpy(m + 5, hdr + 5, 10);  // ctr and len
+    crypto_blake2b_keyed(tag, 16, key, 32, m, sizeof(m));
+}
+
+static void ct_chunk_tag(const uint8_t auth[32], uint64_t ctr, uint16_t idx, bool last, const uint8_t *d, size_t n, uint8_t tag[16]) {
+    uint8_t m[11];
+    wr64(m, ctr);
+    m[8] = idx >> 8; m[9] = idx; m[10] = last;
+    crypto_blake2b_ctx ctx;
+    crypto_blake2b_keyed_init(&ctx, 16, auth, 32);
+    crypto_blake2b_update(&ctx, m, sizeof(m));
+    crypto_blake2b_update(&ctx, d, n);
+    crypto_blake2b_final(&ctx, tag);
+}
+
+// Finds the circuit and checks counter and header tag; NULL means drop.
+static circ_relay_t *ct_check(const uint8_t *hdr, ct_keys_t *k, uint64_t *ctr) {
+    uint32_t cid = rd32(hdr + 1);
+    *ctr = rd64(hdr + 5);
+    circ_relay_t *c = circ_relay_find(cid);
+    if (!c) return NULL;
+    if (circ_replayed(c, *ctr)) {
+        ESP_LOGW(TAG, "Replayed cut-through cell on circuit %08x", (unsigned)cid);
+        return NULL;
+    }
+    uint8_t tag[16];
+    ct_keys(c->key, k);
+    ct_hdr_tag(k->hdr, cid, hdr, tag);
+    if (crypto_verify16(tag, hdr + CT_TAGS) != 0) {
+        ESP_LOGW(TAG, "Cut-through header tag fail on circuit %08x", (unsigned)cid);
+        crypto_wipe(k, sizeof(*k));
+        return NULL;
+    }
+    return c;
+}
+
+static void ct_rewrite(const circ_relay_t *c, uint8_t *hdr) {
+    wr32(hdr + 1, c->cid_out);
+    memmove(hdr + CT_TAGS, hdr + CT_TAGS + 16, (ONION_MAX_HOPS - 1) * 16);
+    random_bytes(hdr + CT_TAGS + (ONION_MAX_HOPS - 1) * 16, 16);
+}
+
+int onion_ct_begin(uint8_t *hdr, radio_ct_t *ct) {
+    ct_keys_t k;
+    uint64_t ctr;
+    circ_relay_t *c = ct_check(hdr, &k, &ctr);
+    if (!c) return -1;
+    crypto_wipe(k.auth, sizeof(k.auth));
+    if (!strcmp(c->next, "LOCAL")) {  // checked again on the whole frame
+        crypto_wipe(&k, sizeof(k));
+        return 0;
+    }
+    circ_accept(c, ctr);
+    ct_rewrite(c, hdr);
+    strncpy(ct->next, c->next, sizeof(ct->next) - 1);
+    ct->next[sizeof(ct->next) - 1] = 0;
+    memcpy(ct->key, k.stream, 32);
+    wr64(ct->nonce, ctr);
+    crypto_wipe(&k, sizeof(k));
+    return 1;
+}
+
+void onion_ct_apply(const radio_ct_t *ct, uint8_t *data, size_t len, size_t offset) {
+    xor_stream(ct->key, ct->nonce, data, len, offset);
+}
+
+// Whole cut-through frame: the exit, or a relay whose radio reassembled it
+// anyway (store and forward).
+static void ct_process(uint8_t *buf, size_t len) {
+    if (len < RADIO_CT_HDR) return;
+    size_t plen = ((size_t)buf[13] << 8) | buf[14];
+    if (RADIO_CT_HDR + plen != len) return;
+    ct_keys_t k;
+    uint64_t ctr;
+    circ_relay_t *c = ct_check(buf, &k, &ctr);
+    if (!c) return;
+    circ_accept(c, ctr);
+    uint8_t nonce[8];
+    wr64(nonce, ctr);
+    uint8_t *p = buf + RADIO_CT_HDR;
+    xor_stream(k.stream, nonce, p, plen, 0);
+    if (strcmp(c->next, "LOCAL")) {
+        crypto_wipe(&k, sizeof(k));
+        ct_rewrite(c, buf);
+        radio_send(c->next, buf, len);
+        return;
+    }
+    // Check each chunk and close the gaps its tag leaves.
+    size_t off = 0, out = 0;
+    for (uint16_t idx = 0; off < plen; idx++) {
+        size_t n = plen - off;
+        if (n > CT_CHUNK_TAGGED) n = CT_CHUNK_TAGGED;
+        uint8_t tag[16];
+        if (n > 16) ct_chunk_tag(k.auth, ctr, idx, off + n == plen, p + off, n - 16, tag);
+        if (n <= 16 || crypto_verify16(tag, p + off + n - 16) != 0) {
+            ESP_LOGW(TAG, "Cut-through chunk %u fail on circuit %08x", idx, (unsigned)rd32(buf + 1));
+            crypto_wipe(&k, sizeof(k));
+            return;
+        }
+        memmove(p + out, p + off, n - 16);
+        out += n - 16;
+        off += n;
+    }
+    crypto_wipe(&k, sizeof(k));
+    deliver_local(p, out);
+}
+
+// Origin side: chunks move left into the headroom to make room for their
+// tags, then every hop's stream goes on, exit first. NULL if the packet
+// does not fit, and the caller falls back to a plain cell.
+static uint8_t *ct_build(const circ_own_t *c, uint8_t *inner, size_t inner_len, size_t headroom, size_t *out_len) {
+    size_t nch = (inner_len + ONION_CT_CHUNK - 1) / ONION_CT_CHUNK;
+    size_t plen = inner_len + nch * 16;
+    if (headroom < RADIO_CT_HDR + nch * 16 || RADIO_CT_HDR + plen > ONION_MAX_BYTES || plen > 0xFFFF) return NULL;
+    uint8_t *p = inner - nch * 16, *hdr = p - RADIO_CT_HDR;
+    ct_keys_t k;
+    ct_keys(c->key[c->n - 1], &k);
+    for (size_t idx = 0; idx < nch; idx++) {
+        size_t m = inner_len - idx * ONION_CT_CHUNK;
+        if (m > ONION_CT_CHUNK) m = ONION_CT_CHUNK;
+        uint8_t *d = p + idx * CT_CHUNK_TAGGED;
+        memmove(d, inner + idx * ONION_CT_CHUNK, m);  // never overtakes the chunks still to move
+        ct_chunk_tag(k.auth, c->ctr, idx, idx + 1 == nch, d, m, d + m);
+    }
+    hdr[0] = ONION_FMT_CT;
+    wr32(hdr + 1, c->cids[0]);
+    wr64(hdr + 5, c->ctr);
+    hdr[13] = plen >> 8; hdr[14] = plen;
+    uint8_t nonce[8];
+    wr64(nonce, c->ctr);
+    for (int i = (int)c->n - 1; i >= 0; --i) {
+        ct_keys(c->key[i], &k);
+        xor_stream(k.stream, nonce, p, plen, 0);
+        ct_hdr_tag(k.hdr, c->cids[i], hdr, hdr + CT_TAGS + 16 * i);
+    }
+    crypto_wipe(&k, sizeof(k));
+    random_bytes(hdr + CT_TAGS + 16 * c->n, 16 * (ONION_MAX_HOPS - c->n));
+    *out_len = RADIO_CT_HDR + plen;
+    return hdr;
+}
+
+static circ_own_t *circ_own_find(const char **route, size_t route_len) {
+    for (int i = 0; i < ONION_MAX_CIRCUITS_OWN; i++) {
+        circ_own_t *c = &circ_own[i];
+        if (!c->used || c->n != route_len) continue;
+        size_t j = 0;
+        while (j < route_len && !strncmp(c->hops[j], route[j], ONION_NEXT_LEN - 1)) j++;
+        if (j == route_len) return c;
+    }
+    return NULL;
+}
+
+// Marks up the circuits whose exit's CREATED has come back.
+static void created_drain(void) {
+    uint32_t t = created_tail.load(std::memory_order_relaxed);
+    for (; t != created_head.load(std::memory_order_acquire); t++) {
+        const uint8_t *r = created_ring[t % ONION_MAX_CIRCUITS_OWN];
+        for (int i = 0; i < ONION_MAX_CIRCUITS_OWN; i++) {
+            circ_own_t *c = &circ_own[i];
+            if (!c->used || c->up || c->cids[0] != rd32(r + 1)) continue;
+            uint8_t mac[16];
+            created_mac(c->key[c->n - 1], c->cids[c->n - 1], mac);
+            if (crypto_verify16(mac, r + 5) != 0) break;
+            c->up = true;
+            ESP_LOGI(TAG, "Circuit %08x up", (unsigned)c->cids[0]);
+            break;
+        }
+        created_tail.store(t + 1, std::memory_order_release);
+    }
+}
+
+uint8_t* onion_circuit_build(const char **route, size_t route_len, uint8_t *inner, size_t inner_len, size_t headroom, size_t *out_len) {
+    if (route_len == 0 || route_len > ONION_MAX_HOPS || inner_len == 0 || headroom < ONION_CIRC_HEADROOM(route_len) ||
+        inner_len + ONION_CIRC_HEADROOM(route_len) > ONION_MAX_BYTES) {
+        ESP_LOGE(TAG, "circuit packet too large: %u bytes over %u hops", (unsigned)inner_len, (unsigned)route_len);
+        return NULL;
+    }
+    uint64_t now = esp_timer_get_time();
+    created_drain();
+    circ_own_t *c = circ_own_find(route, route_len);
+    bool fresh = !c || now - c->created >= (uint64_t)ONION_CIRC_LIFETIME_MS * 1000;
+    if (c && !fresh && !c->up && now - c->created >= (uint64_t)ONION_CIRC_CREATED_MS * 1000) {
+        ESP_LOGW(TAG, "Circuit %08x: no CREATED back, rebuilding", (unsigned)c->cids[0]);
+        fresh = true;
+    }
+    if (!fresh && c->up) {
+        c->ctr++;
+        if (ONION_CUT_THROUGH && inner_len >= ONION_CT_MIN_BYTES && route_len >= ONION_CT_MIN_HOPS) {
+            uint8_t *p = ct_build(c, inner, inner_len, headroom, out_len);
+            if (p) return p;
+        }
+        uint8_t nonce[24] = {0};
+        wr64(nonce, c->ctr);
+        uint8_t *p = inner;
+        for (int i = (int)route_len - 1; i >= 0; --i) {
+            aead_lock_inplace_xc20p(c->key[i], nonce, p, inner_len + (route_len - 1 - i) * 16, p - 16);
+            p -= 16;
+        }
+        p -= ONION_CELL_HDR;
+        p[0] = ONION_FMT_CELL;
+        wr32(p + 1, c->cids[0]);
+        wr64(p + 5, c->ctr);
+        *out_len = ONION_CELL_OVERHEAD(route_len) + inner_len;
+        return p;
+    }
+
+    // New, expired or not up yet: CREATE along the route, carrying this
+    // payload. Until the exit's CREATED is back every packet goes as one;
+    // they repeat the same ids and keys, so they may arrive in any order,
+    // and the counter keeps running across them.
+    uint8_t hop_pub[ONION_MAX_HOPS][32];
+    for (size_t i = 0; i < route_len; i++) {
+        if (!mesh_get_x25519_pub(route[i], hop_pub[i]) && !keydir_get_x25519_pub(route[i], hop_pub[i])) {
+            keydir_lookup(route[i]);
+            ESP_LOGE(TAG, "no pub for %s, directory lookup started", route[i]);
+            return NULL;
+        }
+    }
+    if (fresh) {
+        if (!c) {
+            c = &circ_own[0];
+            for (int i = 0; i < ONION_MAX_CIRCUITS_OWN; i++) {
+                if (!circ_own[i].used) { c = &circ_own[i]; break; }
+                if (circ_own[i].created < c->created) c = &circ_own[i];
+            }
+        }
+        memset(c, 0, sizeof(*c));
+        c->used = true;
+        c->n = route_len;
+        for (size_t i = 0; i < route_len; i++) strncpy(c->hops[i], route[i], ONION_NEXT_LEN - 1);
+        for (size_t i = 0; i <= route_len; i++) {
+            do { random_bytes((uint8_t*)&c->cids[i], 4); } while (c->cids[i] == 0);
+        }
+        random_bytes(&c->key[0][0], sizeof(c->key));
+        c->created = now;
+        ESP_LOGI(TAG, "Circuit %08x created over %u hops", (unsigned)c->cids[0], (unsigned)route_len);
+    }
+    return layers_build(route, route_len, hop_pub, inner, inner_len, c->cids, c->key, out_len);
+}
+
+void onion_on_frame(uint8_t *buf, size_t len) {
+    if (len == 0) return;
+    if (buf[0] == ONION_FMT_CELL) {
+        cell_process(buf, len);  // replay-checked per circuit
+        return;
+    }
+    if (buf[0] == ONION_FMT_CT) {
+        ct_process(buf, len);
+        return;
+    }
+    if (buf[0] == ONION_FMT_CREATED) created_process(buf, len);
+    else if (buf[0] == ONION_FMT_SPHINX) sphinx_process(buf, len);
+    else if (buf[0] == ONION_FMT_LAYER || buf[0] == ONION_FMT_CREATE) peel_and_forward(buf, len);
 }
@@ -3,8 +3,64 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <WiFi.h> // For WiFiClient
+#include "node_config.h"
+#include "radio.h"
 
 extern WiFiClient g_phone_client;
 
-bool onion_build(const char **route, size_t route_len, const uint8_t *inner, size_t inner_len, uint8_t *out, size_t *out_len);
-void onion_on_frame(const uint8_t *buf, size_t len);
\ No newline at end of file
+#define ONION_FMT_LAYER      0x01
+#define ONION_FMT_SPHINX     0x02
+#define ONION_NEXT_LEN       32
+#define ONION_LAYER_OVERHEAD (1 + 32 + 24 + 16 + ONION_NEXT_LEN)
+
+// Sphinx: one blinded group element, a fixed ONION_MAX_HOPS-slot routing
+// header and a wide-block payload behind a zero tag checked at the exit.
+#define SPHINX_HOP_LEN       (ONION_NEXT_LEN + 16)
+#define SPHINX_BETA_LEN      (ONION_MAX_HOPS * SPHINX_HOP_LEN)
+#define SPHINX_HEADER_LEN    (1 + 32 + SPHINX_BETA_LEN + 16)
+#define SPHINX_TAG_LEN       32
+#define SPHINX_OVERHEAD      (SPHINX_HEADER_LEN + SPHINX_TAG_LEN)
+
+// Circuits: a CREATE onion (layer format, next followed by the inbound and
+// outbound circuit ids, the hop's circuit key and the mesh_id_hash() of the
+// hop before it) sets up every hop. The exit answers CREATED [fmt][cid 4]
+// [mac 16], passed back hop by hop by outbound id; the mac, keyed with the
+// exit's circuit key, tells the origin the whole circuit is up. Data then
+// travels as cells [fmt][cid 4][ctr 8][mac 16 per hop][payload], and each
+// relay strips one XChaCha20-Poly1305 layer with the counter as nonce.
+#define ONION_FMT_CREATE      0x03
+#define ONION_FMT_CELL        0x04
+#define ONION_FMT_CREATED     0x06
+#define ONION_CREATE_NEXT_LEN (ONION_NEXT_LEN + 8 + 32 + 4)
+#define ONION_CREATED_LEN     (1 + 4 + 16)
+#define ONION_CELL_HDR        (1 + 4 + 8)
+#define ONION_CELL_OVERHEAD(hops) (ONION_CELL_HDR + (hops) * 16)
+#define ONION_CIRC_HEADROOM(hops) ((hops) * (ONION_LAYER_OVERHEAD + 8 + 32 + 4))
+// Large cells on an established circuit go cut-through instead (radio.h):
+// relays forward them fragment by fragment, before the tail has arrived.
+#define ONION_FMT_CT          0x05
+static_assert(ONION_FMT_CT == RADIO_CT_FMT, "cut-through cells are radio cut-through frames");
+
+#if ONION_SPHINX
+#define ONION_HEADROOM(hops) SPHINX_OVERHEAD
+#else
+#define ONION_HEADROOM(hops) ((hops) * ONION_LAYER_OVERHEAD)
+#endif
+
+// First byte of every payload, read and stripped at the destination.
+#define ONION_KIND_MSG     0x00  // opaque phone message, written to the phone
+#define ONION_KIND_STREAM  0x01  // chunk of a large message, see stream.h
+#define ONION_KIND_BUNDLE  0x02  // DTN bundle handed to the next custodian, see dtn.h
+#define ONION_KIND_CUSTODY 0x03  // signed custody ack for a bundle
+#define ONION_KIND_SUMMARY 0x04  // ids of the bundles a neighbor holds, on contact
+
+// The payload sits at inner with at least ONION_HEADROOM(route_len) writable
+// bytes in front of it; returns the start of the onion, or NULL. Builds the
+// Sphinx format when ONION_SPHINX is set; both are accepted on receive.
+uint8_t* onion_build(const char **route, size_t route_len, uint8_t *inner, size_t inner_len, size_t headroom, size_t *out_len);
+void onion_on_frame(uint8_t *buf, size_t len);
+// Same contract as onion_build(), needs ONION_CIRC_HEADROOM(route_len): a
+// cell on the circuit for this exact route once its CREATED is back, else
+// a CREATE that sets one up and carries the payload itself. For the phone
+// task only.
+uint8_t* onion_circuit_build(const char **route, size_t route_len, uint8_t *inner, size_t inner_len, size_t headroom, size_t *out_len);
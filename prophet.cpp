@@ -0,0 +1,87 @@
+#include "prophet.h"
+#include "mesh.h"
+#include "node_config.h"
+#include "esp_timer.h"
+#include <math.h>
+#include <string.h>
+
+typedef struct {
+    uint32_t h;
+    float p;
+    uint64_t met;  // last encounter
+} pred_t;
+static pred_t T[DTN_PROPHET_SIZE];
+static int TN;
+static uint64_t aged_at;
+
+// P *= gamma^k for the k whole aging units since the last call.
+static void age(void) {
+    uint64_t now = esp_timer_get_time(), unit = (uint64_t)DTN_PROPHET_AGE_UNIT_MS * 1000;
+    if (now - aged_at < unit) return;
+    uint64_t k = (now - aged_at) / unit;
+    float g = powf(DTN_PROPHET_GAMMA, (float)k);
+    for (int i = 0; i < TN; i++) T[i].p *= g;
+    aged_at += k * unit;
+}
+
+// With add, a missing entry that would get predictability p is created;
+// once the table is full, only in place of the least likely one and only
+// when p beats it, so weak transitive values never push out stronger ones.
+static pred_t *find(uint32_t h, bool add, float p) {
+    int low = -1;
+    for (int i = 0; i < TN; i++) {
+        if (T[i].h == h) return &T[i];
+        if (low < 0 || T[i].p < T[low].p) low = i;
+    }
+    if (!add || (TN == DTN_PROPHET_SIZE && p <= T[low].p)) return NULL;
+    pred_t *e = TN < DTN_PROPHET_SIZE ? &T[TN++] : &T[low];
+    memset(e, 0, sizeof(*e));
+    e->h = h;
+    return e;
+}
+
+static const char *node_of(const char *id) {
+    const char *dot = strchr(id, '.');
+    return dot ? dot + 1 : id;
+}
+
+void prophet_encounter(const char *node_id) {
+    age();
+    uint64_t now = esp_timer_get_time();
+    pred_t *e = find(mesh_id_hash(node_of(node_id)), true, DTN_PROPHET_P_INIT);
+    if (!e) return;  // every entry likelier than a first encounter
+    if (e->met && now - e->met < (uint64_t)DTN_PROPHET_ENCOUNTER_MS * 1000) return;  // same contact
+    e->p += (1 - e->p) * DTN_PROPHET_P_INIT;
+    e->met = now;
+}
+
+void prophet_transitive(const char *via, const uint32_t *h, const uint8_t *p, int n) {
+    age();
+    uint32_t me = mesh_id_hash(NODE_ID), vh = mesh_id_hash(node_of(via));
+    const pred_t *b = find(vh, false, 0);
+    if (!b) return;
+    float pb = b->p;
+    for (int i = 0; i < n; i++) {
+        if (h[i] == me || h[i] == vh) continue;
+        float v = pb * (p[i] / 255.0f) * DTN_PROPHET_BETA;
+        pred_t *c = find(h[i], v >= DTN_PROPHET_MIN, v);
+        if (c && v > c->p) c->p = v;
+    }
+}
+
+uint8_t prophet_get(const char *node_id) {
+    age();
+    const pred_t *e = find(mesh_id_hash(node_of(node_id)), false, 0);
+    return e ? (uint8_t)(e->p * 255 + 0.5f) : 0;
+}
+
+int prophet_export(uint32_t *h, uint8_t *p, int max) {
+    age();
+    int n = 0;
+    for (int i = 0; i < TN && n < max; i++) {
+        if (T[i].p < DTN_PROPHET_MIN) continue;
+        h[n] = T[i].h;
+        p[n++] = (uint8_t)(T[i].p * 255 + 0.5f);
+    }
+    return n;
+}
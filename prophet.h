@@ -0,0 +1,14 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// PRoPHET delivery predictabilities (RFC 6693): how likely this node is to
+// meet each other node, raised on every encounter, aged over time and passed
+// on transitively through the tables neighbors send on contact. Values are
+// quantized to 0..255 as they go on the air. DTN task only.
+void prophet_encounter(const char *node_id);
+// A neighbor's table: hashes (mesh_id_hash) and predictabilities.
+void prophet_transitive(const char *via, const uint32_t *h, const uint8_t *p, int n);
+uint8_t prophet_get(const char *node_id);
+int prophet_export(uint32_t *h, uint8_t *p, int max);
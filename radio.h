@@ -2,7 +2,27 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include "node_config.h"
 
 void radio_init(void);
+// Sends straight from the caller's buffer, which is only borrowed until the
+// call returns; safe to call from any task.
 bool radio_send(const char *next_hop_id, const uint8_t *buf, size_t len);
-void mesh_on_radio_frame(const uint8_t *buf, size_t len);
+// Called by radio_send() for the trailer it appends after buf: returns its
+// length (0 for control frames), or -1 when next_hop_id has no link key.
+#define RADIO_LINK_TRAILER 24
+int mesh_link_seal(const char *next_hop_id, const uint8_t *buf, size_t len, uint8_t trailer[RADIO_LINK_TRAILER]);
+// Cut-through frames start with RADIO_CT_FMT and a fixed RADIO_CT_HDR-byte
+// header. As soon as the header fragments are in, the radio asks
+// onion_ct_begin(): 1 = forward (header rewritten in place, ct filled in),
+// then every fragment goes on to ct->next as it arrives, its payload bytes
+// passed through onion_ct_apply(); 0 = keep reassembling for local delivery;
+// -1 = drop the frame. Such frames carry no link trailer.
+#define RADIO_CT_FMT 0x05
+#define RADIO_CT_HDR (1 + 4 + 8 + 2 + ONION_MAX_HOPS * 16)
+typedef struct { char next[32]; uint8_t key[32]; uint8_t nonce[8]; } radio_ct_t;
+int onion_ct_begin(uint8_t *hdr, radio_ct_t *ct);
+void onion_ct_apply(const radio_ct_t *ct, uint8_t *data, size_t len, size_t offset);
+// Receives the reassembly buffer itself, trailer included. The handler may modify it in place
+// and pass slices of it to radio_send(); it is recycled once this returns.
+void mesh_on_radio_frame(uint8_t *buf, size_t len);
@@ -10,20 +10,38 @@ RF24 radio(NRF24_CE_PIN, NRF24_CSN_PIN);
 const byte broadcast_address[6] = "BCAST";
 
 #define FRAG_PAYLOAD_SIZE 30
-#define MAX_FRAGMENTS 68
+#define MAX_FRAGMENTS ((ONION_MAX_BYTES + RADIO_LINK_TRAILER + FRAG_PAYLOAD_SIZE - 1) / FRAG_PAYLOAD_SIZE)
 #define REASSEMBLY_TIMEOUT_MS 5000
+#define CT_HDR_FRAGS ((RADIO_CT_HDR + FRAG_PAYLOAD_SIZE - 1) / FRAG_PAYLOAD_SIZE)
+// The radio is half-duplex: a relay forwarding a fragment misses what comes
+// meanwhile. Past the header, cut-through senders leave this gap after each
+// fragment, room for the next relay to forward one and the one after that
+// to pass it on: a fragment takes about 1.5 ms at 250 kbps and relays poll
+// once a tick. test/sim_ct loses nothing from 6 up; one tick spare.
+#define CT_GAP_MS 7
+
+// What happens to a frame once its first CT_HDR_FRAGS fragments are in.
+enum { RX_UNDECIDED, RX_REASSEMBLE, RX_CUT_THROUGH, RX_DROP };
 
 typedef struct {
     uint8_t packet_id;
     uint8_t total_frags;
+    size_t total_len;
     bool received_frags[MAX_FRAGMENTS];
-    uint8_t buffer[ONION_MAX_BYTES];
+    uint8_t buffer[MAX_FRAGMENTS * FRAG_PAYLOAD_SIZE];
     uint64_t last_frag_time;
     bool in_use;
+    uint8_t mode;
+    uint8_t out_id;
+    bool sent_frags[MAX_FRAGMENTS];
+    radio_ct_t ct;
 } reassembly_buffer_t;
 
 static reassembly_buffer_t reassembly_pool[5];
 static uint8_t next_packet_id = 0;
+// One SPI transceiver shared by the rx task and every sender (phone, DTN,
+// HELLO, forwarding); never held across mesh_on_radio_frame().
+static SemaphoreHandle_t radio_lock;
 
 reassembly_buffer_t* get_reassembly_buffer(uint8_t packet_id) {
     uint64_t current_time = esp_timer_get_time();
@@ -47,39 +65,139 @@ reassembly_buffer_t* get_reassembly_buffer(uint8_t packet_id) {
     return NULL;
 }
 
-void rx_task(void *arg) {
+static bool radio_write_frag(uint8_t packet_id, uint8_t frag_info, const uint8_t *data, size_t n) {
     uint8_t frag_buf[32];
-    while (1) {
-        if (radio.available()) {
-            radio.read(&frag_buf, sizeof(frag_buf));
-            uint8_t packet_id = frag_buf[0];
-            uint8_t frag_info = frag_buf[1];
-            bool is_last = (frag_info >> 7) & 0x01;
-            uint8_t frag_num = frag_info & 0x7F;
-
-            reassembly_buffer_t* rb = get_reassembly_buffer(packet_id);
-            if (!rb || rb->received_frags[frag_num]) continue;
-
-            memcpy(rb->buffer + (frag_num * FRAG_PAYLOAD_SIZE), frag_buf + 2, FRAG_PAYLOAD_SIZE);
-            rb->received_frags[frag_num] = true;
-            rb->last_frag_time = esp_timer_get_time();
-            if (is_last) rb->total_frags = frag_num + 1;
-
-            if (rb->total_frags > 0) {
-                bool complete = true;
-                for (int i = 0; i < rb->total_frags; i++) {
-                    if (!rb->received_frags[i]) { complete = false; break; }
-                }
-                if (complete) {
-                    ESP_LOGI(TAG, "Reassembled packet ID %d", packet_id);
-                    // Simplification: Assume last packet is full for total size calculation
-                    size_t total_size = rb->total_frags * FRAG_PAYLOAD_SIZE;
-                    mesh_on_radio_frame(rb->buffer, total_size);
-                    rb->in_use = false;
-                }
+    frag_buf[0] = packet_id;
+    frag_buf[1] = frag_info;
+    memcpy(frag_buf + 2, data, n);
+    return radio.write(&frag_buf, 2 + n);
+}
+
+// Passes on the first fragment of a cut-through frame that is in but not
+// yet sent: one per fragment received fits the upstream sender's gap. Once
+// the whole frame is in, the rest go too, CT_GAP_MS apart for the next
+// relay. Returns true once all have gone.
+static bool ct_forward(reassembly_buffer_t *rb) {
+    bool all_in = rb->total_frags > 0, sent = false;
+    for (int i = 0; all_in && i < rb->total_frags; i++) all_in = rb->received_frags[i];
+    for (int i = 0; i < MAX_FRAGMENTS; i++) {
+        if (!rb->received_frags[i] || rb->sent_frags[i]) continue;
+        if (sent && !all_in) return false;
+        if (sent) vTaskDelay(pdMS_TO_TICKS(CT_GAP_MS));
+        bool last = rb->total_frags && i == rb->total_frags - 1;
+        size_t off = i * FRAG_PAYLOAD_SIZE;
+        size_t n = last ? rb->total_len - off : FRAG_PAYLOAD_SIZE;
+        uint8_t *d = rb->buffer + off;
+        if (off + n > RADIO_CT_HDR) {
+            size_t skip = off < RADIO_CT_HDR ? RADIO_CT_HDR - off : 0;
+            onion_ct_apply(&rb->ct, d + skip, n - skip, off + skip - RADIO_CT_HDR);
+        }
+        xSemaphoreTake(radio_lock, portMAX_DELAY);
+        radio.stopListening();
+        radio.openWritingPipe(broadcast_address);
+        if (!radio_write_frag(rb->out_id, i | (last ? 0x80 : 0), d, n)) {
+            ESP_LOGW(TAG, "Failed to forward fragment %d of packet ID %d", i, rb->packet_id);
+        }
+        radio.startListening();
+        xSemaphoreGive(radio_lock);
+        rb->sent_frags[i] = true;
+        sent = true;
+    }
+    return all_in;
+}
+
+// Logs every new low of this task's unused stack (bytes on ESP-IDF).
+static void stack_watch(void) {
+    static UBaseType_t low = RADIO_RX_STACK;
+    UBaseType_t left = uxTaskGetStackHighWaterMark(NULL);
+    if (left >= low) return;
+    low = left;
+    if (left < STACK_WARN_BYTES) ESP_LOGW(TAG, "radio_rx stack: only %u of %u bytes never used", (unsigned)left, RADIO_RX_STACK);
+    else ESP_LOGI(TAG, "radio_rx stack: %u of %u bytes never used", (unsigned)left, RADIO_RX_STACK);
+}
+
+// One pass of the rx task: takes in at most one fragment. Returns true to
+// poll again at once, after a cut-through fragment.
+static bool rx_poll(void) {
+    uint8_t frag_buf[32];
+    xSemaphoreTake(radio_lock, portMAX_DELAY);
+    uint8_t n = 0;
+    if (radio.available()) {
+        n = radio.getDynamicPayloadSize();
+        if (n < 2 || n > sizeof(frag_buf)) {
+            radio.flush_rx();
+            n = 0;
+        } else {
+            radio.read(&frag_buf, n);
+        }
+    }
+    xSemaphoreGive(radio_lock);
+    if (!n) return false;
+    uint8_t packet_id = frag_buf[0];
+    uint8_t frag_info = frag_buf[1];
+    bool is_last = (frag_info >> 7) & 0x01;
+    uint8_t frag_num = frag_info & 0x7F;
+    if (frag_num >= MAX_FRAGMENTS) return true;
+
+    reassembly_buffer_t* rb = get_reassembly_buffer(packet_id);
+    if (!rb || rb->received_frags[frag_num]) return false;
+
+    memcpy(rb->buffer + (frag_num * FRAG_PAYLOAD_SIZE), frag_buf + 2, n - 2);
+    rb->received_frags[frag_num] = true;
+    rb->last_frag_time = esp_timer_get_time();
+    if (is_last) {
+        rb->total_frags = frag_num + 1;
+        rb->total_len = frag_num * FRAG_PAYLOAD_SIZE + (n - 2);
+    }
+
+    // Cut-through: decide from the header alone, then pass each
+    // fragment on as it comes instead of waiting for the tail.
+    if (rb->mode == RX_UNDECIDED && (rb->total_frags == 0 || rb->total_frags > CT_HDR_FRAGS)) {
+        bool hdr = true;
+        for (int i = 0; i < CT_HDR_FRAGS; i++) hdr = hdr && rb->received_frags[i];
+        if (hdr && rb->buffer[0] != RADIO_CT_FMT) rb->mode = RX_REASSEMBLE;
+        else if (hdr) {
+            int r = onion_ct_begin(rb->buffer, &rb->ct);
+            rb->mode = r > 0 ? RX_CUT_THROUGH : r == 0 ? RX_REASSEMBLE : RX_DROP;
+            if (r > 0) {
+                xSemaphoreTake(radio_lock, portMAX_DELAY);
+                rb->out_id = next_packet_id++;
+                xSemaphoreGive(radio_lock);
+                ESP_LOGI(TAG, "Cut-through packet ID %d -> %d for %s", packet_id, rb->out_id, rb->ct.next);
             }
         }
-        vTaskDelay(pdMS_TO_TICKS(1));
+    }
+    if (rb->mode == RX_CUT_THROUGH) {
+        if (ct_forward(rb)) {
+            memset(&rb->ct, 0, sizeof(rb->ct));
+            rb->in_use = false;
+        }
+        stack_watch();
+        return true;
+    }
+
+    if (rb->total_frags > 0) {
+        bool complete = true;
+        for (int i = 0; i < rb->total_frags; i++) {
+            if (!rb->received_frags[i]) { complete = false; break; }
+        }
+        if (complete) {
+            // Dynamic payloads make the last fragment exactly as long
+            // as its data, so binary frames arrive without padding.
+            if (rb->mode != RX_DROP) {
+                ESP_LOGI(TAG, "Reassembled packet ID %d", packet_id);
+                mesh_on_radio_frame(rb->buffer, rb->total_len);
+                stack_watch();
+            }
+            rb->in_use = false;
+        }
+    }
+    return false;
+}
+
+void rx_task(void *arg) {
+    while (1) {
+        if (!rx_poll()) vTaskDelay(pdMS_TO_TICKS(1));
     }
 }
 
@@ -92,20 +210,30 @@ void radio_init(void) {
     }
     radio.setPALevel(RF24_PA_LOW);
     radio.setDataRate(RF24_250KBPS);
+    radio.enableDynamicPayloads();
+    radio_lock = xSemaphoreCreateMutex();
     radio.openReadingPipe(1, broadcast_address);
     radio.startListening();
-    xTaskCreate(rx_task, "radio_rx", 4096, NULL, 10, NULL);
+    xTaskCreate(rx_task, "radio_rx", RADIO_RX_STACK, NULL, 10, NULL);
     ESP_LOGI(TAG, "nRF24L01 Radio initialized.");
 }
 
 bool radio_send(const char *next_hop_id, const uint8_t *buf, size_t len) {
-    uint8_t total_frags = (len + FRAG_PAYLOAD_SIZE - 1) / FRAG_PAYLOAD_SIZE;
-    if (total_frags > 127) {
+    if (len == 0 || len > ONION_MAX_BYTES) {
         ESP_LOGE(TAG, "Packet too large to fragment.");
         return false;
     }
+    uint8_t trailer[RADIO_LINK_TRAILER];
+    int tlen = mesh_link_seal(next_hop_id, buf, len, trailer);
+    if (tlen < 0) {
+        ESP_LOGE(TAG, "No link key for %s", next_hop_id);
+        return false;
+    }
+    size_t total = len + tlen;
+    uint8_t total_frags = (total + FRAG_PAYLOAD_SIZE - 1) / FRAG_PAYLOAD_SIZE;
+    xSemaphoreTake(radio_lock, portMAX_DELAY);
     uint8_t packet_id = next_packet_id++;
-    
+
     radio.stopListening();
     radio.openWritingPipe(broadcast_address);
 
@@ -116,17 +244,25 @@ bool radio_send(const char *next_hop_id, const uint8_t *buf, size_t len) {
         if (i == total_frags - 1) frag_buf[1] |= 0x80;
 
         size_t offset = i * FRAG_PAYLOAD_SIZE;
-        size_t chunk_size = (len - offset < FRAG_PAYLOAD_SIZE) ? (len - offset) : FRAG_PAYLOAD_SIZE;
-        memcpy(frag_buf + 2, buf + offset, chunk_size);
+        size_t chunk_size = (total - offset < FRAG_PAYLOAD_SIZE) ? (total - offset) : FRAG_PAYLOAD_SIZE;
+        for (size_t j = 0; j < chunk_size; j++) {
+            size_t o = offset + j;
+            frag_buf[2 + j] = o < len ? buf[o] : trailer[o - len];
+        }
         
-        if (!radio.write(&frag_buf, sizeof(frag_buf))) {
+        if (!radio.write(&frag_buf, 2 + chunk_size)) {
             radio.startListening();
+            xSemaphoreGive(radio_lock);
             ESP_LOGE(TAG, "Failed to send fragment %d", i);
             return false;
         }
+        // The first relay holds back until it has the header, then
+        // forwards one fragment per gap.
+        if (buf[0] == RADIO_CT_FMT && i + 1 >= CT_HDR_FRAGS && i + 1 < total_frags) vTaskDelay(pdMS_TO_TICKS(CT_GAP_MS));
     }
     
     radio.startListening();
+    xSemaphoreGive(radio_lock);
     return true;
 }
 
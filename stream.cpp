@@ -0,0 +1,224 @@
+#include "stream.h"
+#include "onion.h"
+#include "mesh.h"
+#include "radio.h"
+#include "crypto_abstraction.h"
+#include "node_config.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include <string.h>
+#include <stdlib.h>
+#include <Arduino.h> // For FreeRTOS functions
+
+static const char *TAG = "stream";
+
+// Record, after the ONION_KIND_STREAM byte:
+//   [sid 4][seq 2][flags 1] ([total 4][nonce 24][key 32] on seq 0) [mac 16][data]
+// sid|seq|flags is the chunk's associated data. The stream key rides inside
+// the onion of chunk 0; the AEAD context ratchets per chunk, so a chunk only
+// opens in its place, and the LAST flag plus the total catch truncation.
+#define STREAM_AD_LEN    7
+#define STREAM_OPEN_LEN  (4 + 24 + 32)
+#define STREAM_FLAG_LAST 0x01
+
+typedef struct {
+    uint16_t seq, len;
+    uint8_t flags;
+    uint8_t mac[16];
+    uint8_t data[STREAM_CHUNK];
+    bool used;
+} stream_slot_t;
+
+// One inbound stream at a time, with a small window for chunks that
+// overtake each other; only the radio rx task touches it.
+static struct {
+    uint32_t sid, total, got;
+    uint16_t next;
+    crypto_aead_ctx ctx;
+    uint64_t last;
+    bool active;
+    stream_slot_t win[STREAM_WINDOW];
+} srx;
+
+static void wr32(uint8_t *p, uint32_t v) { p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v; }
+static uint32_t rd32(const uint8_t *p) { return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3]; }
+
+static bool phone_read(uint8_t *out, size_t n) {
+    uint64_t start = esp_timer_get_time();
+    size_t got = 0;
+    while (got < n) {
+        if (!g_phone_client || !g_phone_client.connected()) return false;
+        int a = g_phone_client.available();
+        if (a > 0) {
+            int r = g_phone_client.read(out + got, n - got);
+            if (r > 0) got += r;
+            start = esp_timer_get_time();
+        } else if (esp_timer_get_time() - start > (uint64_t)STREAM_PHONE_TIMEOUT_MS * 1000) {
+            return false;
+        } else {
+            vTaskDelay(pdMS_TO_TICKS(5));
+        }
+    }
+    return true;
+}
+
+static void phone_discard(size_t n) {
+    uint8_t tmp[64];
+    while (n) {
+        size_t k = n < sizeof(tmp) ? n : sizeof(tmp);
+        if (!phone_read(tmp, k)) return;
+        n -= k;
+    }
+}
+
+bool stream_send(const char *dest, uint32_t total, const uint8_t *head, size_t head_len) {
+    if (head_len > total) head_len = total;
+    const char *route[ONION_MAX_HOPS];
+    size_t rl = 0;
+    if (!mesh_choose_route(dest, route, &rl)) {
+        ESP_LOGW(TAG, "No route to %s, dropping %u-byte stream", dest, (unsigned)total);
+        phone_discard(total - head_len);
+        return false;
+    }
+    size_t room = ONION_MAX_BYTES - ONION_CIRC_HEADROOM(rl) - 1 - STREAM_AD_LEN - STREAM_OPEN_LEN - 16;
+    size_t chunk = room < STREAM_CHUNK ? room : STREAM_CHUNK;
+    if ((total + chunk - 1) / chunk > UINT16_MAX) {  // seq is 16 bits and must not wrap to 0
+        ESP_LOGE(TAG, "%u bytes need more than %u chunks of %u to %s, dropping", (unsigned)total, UINT16_MAX, (unsigned)chunk, dest);
+        phone_discard(total - head_len);
+        for (size_t i = 0; i < rl; i++) free((void*)route[i]);
+        return false;
+    }
+
+    uint8_t key[32], nonce[24];
+    uint32_t sid;
+    random_bytes(key, 32);
+    random_bytes(nonce, 24);
+    random_bytes((uint8_t*)&sid, 4);
+    crypto_aead_ctx ctx;
+    crypto_aead_init_x(&ctx, key, nonce);
+
+    static uint8_t frame[ONION_CIRC_HEADROOM(ONION_MAX_HOPS) + ONION_MAX_BYTES];
+    uint32_t sent = 0;
+    bool ok = true;
+    for (uint16_t seq = 0; ok && (sent < total || seq == 0); seq++) {
+        uint8_t *rec = frame + ONION_CIRC_HEADROOM(ONION_MAX_HOPS);
+        uint8_t *p = rec;
+        *p++ = ONION_KIND_STREAM;
+        uint8_t *ad = p;
+        wr32(p, sid);
+        p[4] = seq >> 8;
+        p[5] = seq;
+        p += STREAM_AD_LEN;
+        if (seq == 0) {
+            wr32(p, total);
+            memcpy(p + 4, nonce, 24);
+            memcpy(p + 28, key, 32);
+            p += STREAM_OPEN_LEN;
+        }
+        uint8_t *mac = p, *data = p + 16;
+        size_t n = total - sent < chunk ? total - sent : chunk;
+        size_t from_head = sent < head_len ? (head_len - sent < n ? head_len - sent : n) : 0;
+        memcpy(data, head + sent, from_head);
+        if (n > from_head && !phone_read(data + from_head, n - from_head)) {
+            ESP_LOGE(TAG, "Phone stopped after %u of %u bytes", (unsigned)sent, (unsigned)total);
+            break;
+        }
+        ad[6] = sent + n == total ? STREAM_FLAG_LAST : 0;
+        crypto_aead_write(&ctx, data, mac, ad, STREAM_AD_LEN, data, n);
+
+        size_t onion_len = 0;
+        uint8_t *onion = onion_circuit_build(route, rl, rec, data + n - rec, rec - frame, &onion_len);
+        ok = onion && radio_send(route[0], onion, onion_len);
+        sent += n;
+    }
+    if (!ok) {
+        ESP_LOGE(TAG, "Stream %08x to %s failed after %u bytes", (unsigned)sid, dest, (unsigned)sent);
+        if (sent < total) phone_discard(total - sent);
+    } else if (sent == total) {
+        ESP_LOGI(TAG, "Stream %08x: %u bytes to %s", (unsigned)sid, (unsigned)total, dest);
+    }
+    crypto_wipe(key, sizeof(key));
+    crypto_wipe(&ctx, sizeof(ctx));
+    for (size_t i = 0; i < rl; i++) free((void*)route[i]);
+    return ok && sent == total;
+}
+
+static void srx_close(void) {
+    crypto_wipe(&srx, sizeof(srx));
+}
+
+// Opens one chunk in order and hands it to the phone; false ends the stream.
+static bool srx_deliver(uint16_t seq, uint8_t flags, const uint8_t mac[16], uint8_t *data, size_t n) {
+    uint8_t ad[STREAM_AD_LEN];
+    wr32(ad, srx.sid);
+    ad[4] = seq >> 8;
+    ad[5] = seq;
+    ad[6] = flags;
+    if (srx.got + n > srx.total || crypto_aead_read(&srx.ctx, data, mac, ad, STREAM_AD_LEN, data, n) != 0) {
+        ESP_LOGW(TAG, "Stream %08x: chunk %u rejected", (unsigned)srx.sid, seq);
+        return false;
+    }
+    if (g_phone_client && g_phone_client.connected()) g_phone_client.write(data, n);
+    srx.got += n;
+    srx.next++;
+    if (flags & STREAM_FLAG_LAST) {
+        if (srx.got == srx.total) ESP_LOGI(TAG, "Stream %08x: %u bytes delivered", (unsigned)srx.sid, (unsigned)srx.total);
+        else ESP_LOGW(TAG, "Stream %08x: ended at %u of %u bytes", (unsigned)srx.sid, (unsigned)srx.got, (unsigned)srx.total);
+        return false;
+    }
+    return true;
+}
+
+void stream_on_chunk(uint8_t *rec, size_t len) {
+    if (len < STREAM_AD_LEN + 16) return;
+    uint64_t now = esp_timer_get_time();
+    uint32_t sid = rd32(rec);
+    uint16_t seq = ((uint16_t)rec[4] << 8) | rec[5];
+    uint8_t flags = rec[6];
+    uint8_t *p = rec + STREAM_AD_LEN;
+    len -= STREAM_AD_LEN;
+    if (srx.active && now - srx.last > (uint64_t)STREAM_RX_TIMEOUT_MS * 1000) {
+        ESP_LOGW(TAG, "Stream %08x timed out at %u bytes", (unsigned)srx.sid, (unsigned)srx.got);
+        srx_close();
+    }
+    if (seq == 0) {
+        if (len < STREAM_OPEN_LEN + 16 || srx.active) return;  // one at a time
+        srx_close();
+        srx.sid = sid;
+        srx.total = rd32(p);
+        crypto_aead_init_x(&srx.ctx, p + 28, p + 4);
+        srx.active = true;
+        p += STREAM_OPEN_LEN;
+        len -= STREAM_OPEN_LEN;
+    } else if (!srx.active || sid != srx.sid) {
+        return;
+    }
+    srx.last = now;
+
+    if (seq != srx.next) {
+        uint16_t ahead = seq - srx.next;
+        if (ahead >= STREAM_WINDOW || len - 16 > STREAM_CHUNK) return;
+        stream_slot_t *s = &srx.win[seq % STREAM_WINDOW];
+        s->seq = seq;
+        s->flags = flags;
+        s->len = len - 16;
+        memcpy(s->mac, p, 16);
+        memcpy(s->data, p + 16, len - 16);
+        s->used = true;
+        return;
+    }
+    // Chunk 0 and in-order chunks open straight from the radio buffer.
+    if (!srx_deliver(seq, flags, p, p + 16, len - 16)) {
+        srx_close();
+        return;
+    }
+    for (;;) {
+        stream_slot_t *s = &srx.win[srx.next % STREAM_WINDOW];
+        if (!s->used || s->seq != srx.next) break;
+        s->used = false;
+        if (!srx_deliver(s->seq, s->flags, s->mac, s->data, s->len)) {
+            srx_close();
+            return;
+        }
+    }
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Messages larger than one onion travel as a stream of chunks, each one an
+// onion on the phone's circuit, sealed with Monocypher's incremental AEAD
+// so the destination verifies them in order with bounded memory.
+//
+// Sends total bytes to dest: head_len of them already read from the phone,
+// the rest read from it as the chunks go out. Phone task only. Chunks
+// carry a 16-bit sequence number, so total is capped at UINT16_MAX chunks
+// (about 52 MB over ONION_MAX_HOPS hops); larger streams are refused and
+// their bytes drained from the phone.
+bool stream_send(const char *dest, uint32_t total, const uint8_t *head, size_t head_len);
+// A stream record delivered to this node (ONION_KIND_STREAM payload).
+void stream_on_chunk(uint8_t *rec, size_t len);
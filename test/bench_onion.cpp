@@ -0,0 +1,222 @@
+// onion_build() and circuit cells against route length: host time per
+// build and heap calls per build, which must be zero. Ephemeral keys are
+// timed both from a full pool (the usual case on the node) and made inline
+// (pool drained). Cells are timed plain and cut-through, which the Makefile
+// turns on at every route length, once the circuit's CREATE has reached the
+// exit and its CREATED has come back. Built twice, for layer onions and with
+// ONION_SPHINX. Every route length is also peeled hop by hop and must reach
+// the exit intact.
+#include "host.h"
+static const char *hop_id = "me";  // the node onion.cpp runs as
+static const uint8_t *hop_priv_cur;
+#define NODE_ID hop_id
+#include "../crypto_abstraction.cpp"
+#define crypto_get_x25519_private() hop_priv_cur
+#include "../onion.cpp"
+#include <chrono>
+#include <string>
+
+#define PAYLOAD    256
+#define CELL_SMALL 200
+#define CELL_LARGE 800   // fits ONION_CIRC_HEADROOM(ONION_MAX_HOPS)
+#define ROUNDS     200
+
+WiFiClient g_phone_client;
+
+// Every heap call made while counting is set.
+static bool counting;
+static unsigned heap_ops;
+extern "C" void *__libc_malloc(size_t);
+extern "C" void *__libc_calloc(size_t, size_t);
+extern "C" void *__libc_realloc(void*, size_t);
+extern "C" void __libc_free(void*);
+extern "C" void *malloc(size_t n) { if (counting) heap_ops++; return __libc_malloc(n); }
+extern "C" void *calloc(size_t n, size_t k) { if (counting) heap_ops++; return __libc_calloc(n, k); }
+extern "C" void *realloc(void *p, size_t n) { if (counting) heap_ops++; return __libc_realloc(p, n); }
+extern "C" void free(void *p) { if (counting && p) heap_ops++; __libc_free(p); }
+
+static uint8_t hop_pub[ONION_MAX_HOPS][32], hop_priv[ONION_MAX_HOPS][32];
+
+bool mesh_get_x25519_pub(const char *id, uint8_t out[32]) {
+    int i = id[1] - '0';
+    if (id[0] != 'h' || i < 0 || i >= ONION_MAX_HOPS) return false;
+    memcpy(out, hop_pub[i], 32);
+    return true;
+}
+uint32_t mesh_id_hash(const char *id) {
+    uint32_t h = 2166136261u;
+    while (*id) { h ^= (uint8_t)*id++; h *= 16777619u; }
+    return h;
+}
+bool mesh_neighbor_by_hash(uint32_t h, char out_id[32]) {
+    static const char *ids[] = { "me", "h0", "h1", "h2", "h3", "h4", "h5", "h6", "h7" };
+    for (const char *id : ids) {
+        if (mesh_id_hash(id) != h) continue;
+        strcpy(out_id, id);
+        return true;
+    }
+    return false;
+}
+bool keydir_get_x25519_pub(const char*, uint8_t*) { return false; }
+void keydir_lookup(const char*) {}
+
+// Where the hop being run sent its frame, and what reached the exit.
+static char sent_to[ONION_NEXT_LEN];
+static std::string sent, delivered;
+bool radio_send(const char *next, const uint8_t *buf, size_t len) {
+    strncpy(sent_to, next, sizeof(sent_to) - 1);
+    sent.assign((const char*)buf, len);
+    return true;
+}
+void stream_on_chunk(uint8_t *buf, size_t len) { delivered.assign((const char*)buf, len); }
+bool dtn_on_bundle(const uint8_t*, size_t, const uint8_t**, size_t*) { return false; }
+void dtn_on_custody(const uint8_t*, size_t) {}
+void dtn_on_summary(const uint8_t*, size_t) {}
+
+static void pool_fill(void) {
+    eph_kp_t kp;
+    while (uxQueueMessagesWaiting(eph_pool) < X25519_POOL_SIZE) {
+        eph_generate(&kp);
+        xQueueSend(eph_pool, &kp, 0);
+    }
+}
+
+static void pool_drain(void) {
+    eph_kp_t kp;
+    while (xQueueReceive(eph_pool, &kp, 0) == pdTRUE) {}
+}
+
+static double now_us(void) {
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint8_t frame[ONION_CIRC_HEADROOM(ONION_MAX_HOPS) + ONION_MAX_BYTES];
+
+// Runs an onion along route, each hop with its own key; true if the
+// exit got the payload.
+static bool peel_route(const char **route, size_t n) {
+    uint8_t *inner = frame + ONION_CIRC_HEADROOM(ONION_MAX_HOPS);
+    inner[0] = ONION_KIND_STREAM;
+    for (int i = 1; i < PAYLOAD; i++) inner[i] = (uint8_t)i;
+    std::string want((const char*)inner + 1, PAYLOAD - 1);
+    size_t len;
+    uint8_t *p = onion_build(route, n, inner, PAYLOAD, inner - frame, &len);
+    if (!p) return false;
+    sent.assign((const char*)p, len);
+    delivered.clear();
+    for (size_t i = 0; i < n; i++) {
+        if (i && strcmp(sent_to, route[i])) return false;
+        std::string buf = sent;
+        sent.clear();
+        hop_id = route[i];
+        hop_priv_cur = hop_priv[route[i][1] - '0'];
+        onion_on_frame((uint8_t*)&buf[0], buf.size());
+    }
+    return sent.empty() && delivered == want;
+}
+
+// Hands what was sent to where it was sent, until nothing more is.
+static void run_air(void) {
+    static char at[ONION_NEXT_LEN];
+    while (!sent.empty()) {
+        std::string buf = sent;
+        sent.clear();
+        strcpy(at, sent_to);
+        hop_id = at;
+        hop_priv_cur = at[0] == 'h' ? hop_priv[at[1] - '0'] : NULL;
+        onion_on_frame((uint8_t*)&buf[0], buf.size());
+    }
+    hop_id = "me";
+}
+
+// Sets up a circuit over route: packets go as CREATE until the exit's
+// CREATED is back, then as cells.
+static bool circuit_open(const char **route, size_t n) {
+    uint8_t *inner = frame + ONION_CIRC_HEADROOM(ONION_MAX_HOPS);
+    size_t len;
+    for (int i = 0; i < 2; i++) {
+        inner[0] = ONION_KIND_STREAM;
+        uint8_t *p = onion_circuit_build(route, n, inner, CELL_SMALL, inner - frame, &len);
+        if (!p || p[0] != ONION_FMT_CREATE) return false;
+        if (i) break;  // a second before CREATED is back is a CREATE too
+        sent.assign((const char*)p, len);
+        strcpy(sent_to, route[0]);
+    }
+    run_air();
+    inner[0] = ONION_KIND_STREAM;
+    uint8_t *p = onion_circuit_build(route, n, inner, CELL_SMALL, inner - frame, &len);
+    return p && p[0] == ONION_FMT_CELL;
+}
+
+typedef uint8_t *(*build_fn)(const char**, size_t, uint8_t*, size_t, size_t, size_t*);
+
+// Mean µs per call over ROUNDS; heap calls are added to *ops.
+static double time_builds(build_fn fn, const char **route, size_t n, size_t bytes, bool warm, size_t *len, unsigned *ops) {
+    double total = 0;
+    for (int r = 0; r < ROUNDS; r++) {
+        if (warm) pool_fill();
+        else pool_drain();
+        uint8_t *inner = frame + ONION_CIRC_HEADROOM(ONION_MAX_HOPS);
+        memset(inner, r, bytes);
+        heap_ops = 0;
+        counting = true;
+        double t = now_us();
+        uint8_t *p = fn(route, n, inner, bytes, inner - frame, len);
+        total += now_us() - t;
+        counting = false;
+        *ops += heap_ops;
+        CHECK(p != NULL);
+    }
+    return total / ROUNDS;
+}
+
+int main() {
+    static const char *names[ONION_MAX_HOPS] = { "h0", "h1", "h2", "h3", "h4", "h5", "h6", "h7" };
+    host_seed(32);
+    crypto_keys_load_or_create();
+    x25519_pool_init();
+    for (int i = 0; i < ONION_MAX_HOPS; i++) {
+        random_bytes(hop_priv[i], 32);
+        crypto_x25519_public_key(hop_pub[i], hop_priv[i]);
+    }
+
+    printf("onion_build, %s format, %d-byte payload, %d builds per row (host time)\n",
+           ONION_SPHINX ? "Sphinx" : "layer", PAYLOAD, ROUNDS);
+    printf("hops  bytes  us/build (pool full)  us/build (pool empty)  heap calls\n");
+    for (size_t n = 1; n <= ONION_MAX_HOPS; n++) {
+        size_t len = 0;
+        unsigned ops = 0;
+        double warm = time_builds(onion_build, names, n, PAYLOAD, true, &len, &ops);
+        double cold = time_builds(onion_build, names, n, PAYLOAD, false, &len, &ops);
+        printf("%4u  %5u  %20.1f  %21.1f  %10u\n", (unsigned)n, (unsigned)len, warm, cold, ops);
+        CHECK(ops == 0);
+        CHECK(peel_route(names, n));
+    }
+
+    printf("\ncircuit cells on an established circuit\n");
+    printf("hops  bytes (%d B)  us/cell  bytes (%d B, cut-through)  us/cell  heap calls\n", CELL_SMALL, CELL_LARGE);
+    for (size_t n = 1; n <= ONION_MAX_HOPS; n++) {
+        const char *route[ONION_MAX_HOPS];
+        for (size_t i = 0; i < n; i++) route[i] = names[ONION_MAX_HOPS - 1 - i];  // a circuit per length
+        size_t len = 0, ct_len = 0;
+        unsigned ops = 0;
+        memset(circ_relay, 0, sizeof(circ_relay));  // one table for every hop here
+        CHECK(circuit_open(route, n));
+        double cell = time_builds(onion_circuit_build, route, n, CELL_SMALL, true, &len, &ops);
+        double ct = time_builds(onion_circuit_build, route, n, CELL_LARGE, true, &ct_len, &ops);
+        printf("%4u  %11u  %7.1f  %24u  %7.1f  %10u\n", (unsigned)n, (unsigned)len, cell, (unsigned)ct_len, ct, ops);
+        CHECK(ops == 0 && len == ONION_CELL_OVERHEAD(n) + CELL_SMALL);
+    }
+
+    // A circuit whose CREATED never comes back is built again, with new ids.
+    const char *lost[] = { "h0", "h1" };
+    uint8_t *inner = frame + ONION_CIRC_HEADROOM(ONION_MAX_HOPS);
+    size_t len;
+    inner[0] = ONION_KIND_STREAM;
+    CHECK(onion_circuit_build(lost, 2, inner, CELL_SMALL, inner - frame, &len) != NULL);
+    uint32_t cid = circ_own_find(lost, 2)->cids[0];
+    host_advance_ms(ONION_CIRC_CREATED_MS);
+    uint8_t *p = onion_circuit_build(lost, 2, inner, CELL_SMALL, inner - frame, &len);
+    CHECK(p && p[0] == ONION_FMT_CREATE && circ_own_find(lost, 2)->cids[0] != cid);
+    return host_result(ONION_SPHINX ? "bench_onion (Sphinx)" : "bench_onion");
+}
@@ -0,0 +1,23 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+
+typedef uint8_t byte;
+struct HostSerial {
+    void begin(unsigned long) {}
+    void println(const char *s) { puts(s); }
+    void print(const char *s) { fputs(s, stdout); }
+    template <typename... A> void printf(const char *fmt, A... a) { ::printf(fmt, a...); }
+};
+extern HostSerial Serial;
+void delay(uint32_t ms);
+uint32_t millis(void);
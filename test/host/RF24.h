@@ -0,0 +1,25 @@
+#pragma once
+#include <stdint.h>
+
+// nRF24L01 driver stand-in. Setup calls do nothing; a simulator defines
+// the data path (listening, the rx FIFO and writes) for the air it models.
+#define RF24_PA_LOW  1
+#define RF24_250KBPS 2
+
+class RF24 {
+public:
+    RF24(int, int) {}
+    bool begin(void) { return true; }
+    void setPALevel(uint8_t) {}
+    void setDataRate(uint8_t) {}
+    void enableDynamicPayloads(void) {}
+    void openReadingPipe(uint8_t, const uint8_t*) {}
+    void openWritingPipe(const uint8_t*) {}
+    void startListening(void);
+    void stopListening(void);
+    bool available(void);
+    uint8_t getDynamicPayloadSize(void);
+    void read(void *buf, uint8_t len);
+    bool write(const void *buf, uint8_t len);
+    void flush_rx(void);
+};
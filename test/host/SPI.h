@@ -0,0 +1,6 @@
+#pragma once
+
+struct HostSPI {
+    void begin(int, int, int, int) {}
+};
+static HostSPI SPI;
@@ -0,0 +1,18 @@
+#pragma once
+// Host stand-in for the Arduino WiFi client the phone link uses: never
+// connected, so writes to the phone go nowhere.
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+class WiFiClient {
+public:
+    operator bool() const { return false; }
+    bool connected() { return false; }
+    int available() { return 0; }
+    int read(uint8_t*, size_t) { return -1; }
+    size_t write(const uint8_t*, size_t n) { return n; }
+    size_t write(const char *s) { return strlen(s); }
+    size_t write(uint8_t) { return 1; }
+    void stop() {}
+};
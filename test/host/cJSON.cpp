@@ -0,0 +1,241 @@
+#include "cJSON.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+static cJSON *item_new(int type) {
+    cJSON *c = (cJSON*)calloc(1, sizeof(cJSON));
+    if (c) c->type = type;
+    return c;
+}
+
+void cJSON_Delete(cJSON *c) {
+    while (c) {
+        cJSON *next = c->next;
+        cJSON_Delete(c->child);
+        free(c->valuestring);
+        free(c->string);
+        free(c);
+        c = next;
+    }
+}
+
+// Parser
+
+static const char *skip(const char *p) {
+    while (*p && (unsigned char)*p <= ' ') p++;
+    return p;
+}
+
+static const char *parse_value(cJSON *c, const char *p);
+
+static const char *parse_string(char **out, const char *p) {
+    if (*p != '"') return NULL;
+    std::string s;
+    for (p++; *p && *p != '"'; p++) {
+        if (*p != '\\') { s += *p; continue; }
+        switch (*++p) {
+            case 'b': s += '\b'; break;
+            case 'f': s += '\f'; break;
+            case 'n': s += '\n'; break;
+            case 'r': s += '\r'; break;
+            case 't': s += '\t'; break;
+            case 'u': {
+                unsigned v;
+                if (sscanf(p + 1, "%4x", &v) != 1) return NULL;
+                p += 4;
+                if (v < 0x80) s += (char)v;
+                else if (v < 0x800) { s += (char)(0xC0 | v >> 6); s += (char)(0x80 | (v & 0x3F)); }
+                else { s += (char)(0xE0 | v >> 12); s += (char)(0x80 | ((v >> 6) & 0x3F)); s += (char)(0x80 | (v & 0x3F)); }
+                break;
+            }
+            case 0: return NULL;
+            default: s += *p;
+        }
+    }
+    if (*p != '"') return NULL;
+    *out = strdup(s.c_str());
+    return p + 1;
+}
+
+static const char *parse_list(cJSON *c, const char *p, char close, bool named) {
+    p = skip(p + 1);
+    if (*p == close) return p + 1;
+    cJSON *last = NULL;
+    while (1) {
+        cJSON *e = item_new(0);
+        if (!e) return NULL;
+        if (last) { last->next = e; e->prev = last; } else c->child = e;
+        last = e;
+        if (named) {
+            p = parse_string(&e->string, skip(p));
+            if (!p) return NULL;
+            p = skip(p);
+            if (*p++ != ':') return NULL;
+        }
+        p = parse_value(e, skip(p));
+        if (!p) return NULL;
+        p = skip(p);
+        if (*p == close) return p + 1;
+        if (*p++ != ',') return NULL;
+    }
+}
+
+static const char *parse_value(cJSON *c, const char *p) {
+    if (!strncmp(p, "null", 4)) { c->type = cJSON_NULL; return p + 4; }
+    if (!strncmp(p, "false", 5)) { c->type = cJSON_False; return p + 5; }
+    if (!strncmp(p, "true", 4)) { c->type = cJSON_True; c->valueint = 1; return p + 4; }
+    if (*p == '"') { c->type = cJSON_String; return parse_string(&c->valuestring, p); }
+    if (*p == '[') { c->type = cJSON_Array; return parse_list(c, p, ']', false); }
+    if (*p == '{') { c->type = cJSON_Object; return parse_list(c, p, '}', true); }
+    char *end;
+    double d = strtod(p, &end);
+    if (end == p) return NULL;
+    c->type = cJSON_Number;
+    c->valuedouble = d;
+    c->valueint = d >= 2147483647.0 ? 2147483647 : (d <= -2147483648.0 ? (int)-2147483647 - 1 : (int)d);
+    return end;
+}
+
+cJSON *cJSON_Parse(const char *text) {
+    if (!text) return NULL;
+    cJSON *c = item_new(0);
+    if (!c) return NULL;
+    const char *end = parse_value(c, skip(text));
+    if (!end) { cJSON_Delete(c); return NULL; }
+    return c;
+}
+
+// Printer
+
+static void print_string(std::string &o, const char *s) {
+    o += '"';
+    for (; *s; s++) {
+        unsigned char ch = *s;
+        if (ch == '"' || ch == '\\') { o += '\\'; o += ch; }
+        else if (ch == '\n') o += "\\n";
+        else if (ch == '\r') o += "\\r";
+        else if (ch == '\t') o += "\\t";
+        else if (ch < 0x20) { char u[8]; snprintf(u, sizeof(u), "\\u%04x", ch); o += u; }
+        else o += ch;
+    }
+    o += '"';
+}
+
+static void print_value(std::string &o, const cJSON *c) {
+    char num[32];
+    switch (c->type & 0xFF) {
+        case cJSON_NULL: o += "null"; break;
+        case cJSON_False: o += "false"; break;
+        case cJSON_True: o += "true"; break;
+        case cJSON_String: print_string(o, c->valuestring ? c->valuestring : ""); break;
+        case cJSON_Number:
+            if (c->valuedouble == (double)(long long)c->valuedouble) snprintf(num, sizeof(num), "%lld", (long long)c->valuedouble);
+            else snprintf(num, sizeof(num), "%.17g", c->valuedouble);
+            o += num;
+            break;
+        case cJSON_Array:
+        case cJSON_Object: {
+            bool obj = (c->type & 0xFF) == cJSON_Object;
+            o += obj ? '{' : '[';
+            for (const cJSON *e = c->child; e; e = e->next) {
+                if (e != c->child) o += ',';
+                if (obj) { print_string(o, e->string ? e->string : ""); o += ':'; }
+                print_value(o, e);
+            }
+            o += obj ? '}' : ']';
+            break;
+        }
+    }
+}
+
+char *cJSON_PrintUnformatted(const cJSON *item) {
+    if (!item) return NULL;
+    std::string o;
+    print_value(o, item);
+    return strdup(o.c_str());
+}
+
+// Construction and access
+
+cJSON *cJSON_CreateObject(void) { return item_new(cJSON_Object); }
+cJSON *cJSON_CreateArray(void) { return item_new(cJSON_Array); }
+
+cJSON *cJSON_CreateString(const char *s) {
+    cJSON *c = item_new(cJSON_String);
+    if (c) c->valuestring = strdup(s ? s : "");
+    return c;
+}
+
+cJSON *cJSON_CreateNumber(double n) {
+    cJSON *c = item_new(cJSON_Number);
+    if (c) { c->valuedouble = n; c->valueint = (int)n; }
+    return c;
+}
+
+void cJSON_AddItemToArray(cJSON *array, cJSON *item) {
+    if (!array || !item) return;
+    if (!array->child) { array->child = item; return; }
+    cJSON *e = array->child;
+    while (e->next) e = e->next;
+    e->next = item;
+    item->prev = e;
+}
+
+void cJSON_AddItemToObject(cJSON *object, const char *name, cJSON *item) {
+    if (!item) return;
+    free(item->string);
+    item->string = strdup(name);
+    cJSON_AddItemToArray(object, item);
+}
+
+void cJSON_ReplaceItemInObject(cJSON *object, const char *name, cJSON *item) {
+    cJSON *old = cJSON_GetObjectItem(object, name);
+    if (!old || !item) { cJSON_Delete(item); return; }
+    free(item->string);
+    item->string = strdup(name);
+    item->prev = old->prev;
+    item->next = old->next;
+    if (old->prev) old->prev->next = item; else object->child = item;
+    if (old->next) old->next->prev = item;
+    old->next = NULL;
+    cJSON_Delete(old);
+}
+
+cJSON *cJSON_AddStringToObject(cJSON *object, const char *name, const char *s) {
+    cJSON *c = cJSON_CreateString(s);
+    cJSON_AddItemToObject(object, name, c);
+    return c;
+}
+
+cJSON *cJSON_AddNumberToObject(cJSON *object, const char *name, double n) {
+    cJSON *c = cJSON_CreateNumber(n);
+    cJSON_AddItemToObject(object, name, c);
+    return c;
+}
+
+cJSON *cJSON_GetObjectItem(const cJSON *object, const char *name) {
+    if (!object) return NULL;
+    for (cJSON *e = object->child; e; e = e->next) {
+        if (e->string && !strcmp(e->string, name)) return e;
+    }
+    return NULL;
+}
+
+int cJSON_GetArraySize(const cJSON *array) {
+    int n = 0;
+    for (const cJSON *e = array ? array->child : NULL; e; e = e->next) n++;
+    return n;
+}
+
+cJSON *cJSON_GetArrayItem(const cJSON *array, int index) {
+    cJSON *e = array ? array->child : NULL;
+    while (e && index-- > 0) e = e->next;
+    return e;
+}
+
+int cJSON_IsString(const cJSON *c) { return c && (c->type & 0xFF) == cJSON_String; }
+int cJSON_IsNumber(const cJSON *c) { return c && (c->type & 0xFF) == cJSON_Number; }
+int cJSON_IsArray(const cJSON *c) { return c && (c->type & 0xFF) == cJSON_Array; }
+int cJSON_IsObject(const cJSON *c) { return c && (c->type & 0xFF) == cJSON_Object; }
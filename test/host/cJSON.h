@@ -0,0 +1,43 @@
+#pragma once
+
+// The subset of cJSON the node uses, for host builds (cJSON.cpp): flat and
+// nested objects and arrays of strings and numbers.
+#define cJSON_Invalid 0
+#define cJSON_False   (1 << 0)
+#define cJSON_True    (1 << 1)
+#define cJSON_NULL    (1 << 2)
+#define cJSON_Number  (1 << 3)
+#define cJSON_String  (1 << 4)
+#define cJSON_Array   (1 << 5)
+#define cJSON_Object  (1 << 6)
+
+typedef struct cJSON {
+    struct cJSON *next, *prev, *child;
+    int type;
+    char *valuestring;
+    int valueint;
+    double valuedouble;
+    char *string;
+} cJSON;
+
+cJSON *cJSON_Parse(const char *text);
+char *cJSON_PrintUnformatted(const cJSON *item);
+void cJSON_Delete(cJSON *item);
+cJSON *cJSON_CreateObject(void);
+cJSON *cJSON_CreateArray(void);
+cJSON *cJSON_CreateString(const char *s);
+cJSON *cJSON_CreateNumber(double n);
+void cJSON_AddItemToArray(cJSON *array, cJSON *item);
+void cJSON_AddItemToObject(cJSON *object, const char *name, cJSON *item);
+void cJSON_ReplaceItemInObject(cJSON *object, const char *name, cJSON *item);
+cJSON *cJSON_AddStringToObject(cJSON *object, const char *name, const char *s);
+cJSON *cJSON_AddNumberToObject(cJSON *object, const char *name, double n);
+cJSON *cJSON_GetObjectItem(const cJSON *object, const char *name);
+int cJSON_GetArraySize(const cJSON *array);
+cJSON *cJSON_GetArrayItem(const cJSON *array, int index);
+int cJSON_IsString(const cJSON *item);
+int cJSON_IsNumber(const cJSON *item);
+int cJSON_IsArray(const cJSON *item);
+int cJSON_IsObject(const cJSON *item);
+
+#define cJSON_ArrayForEach(e, a) for (e = (a) ? (a)->child : NULL; e; e = e->next)
@@ -0,0 +1,7 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#define MALLOC_CAP_INTERNAL (1 << 11)
+
+size_t heap_caps_get_free_size(uint32_t caps);
@@ -0,0 +1,13 @@
+#pragma once
+#include <stdio.h>
+
+// HOST_LOG_LEVEL: 0 silent, 1 errors, 2 warnings, 3 info (default 1 so test
+// output stays readable).
+#ifndef HOST_LOG_LEVEL
+#define HOST_LOG_LEVEL 1
+#endif
+#define HOST_LOG(l, c, tag, fmt, ...) do { if (HOST_LOG_LEVEL >= l) printf(c " (%s) " fmt "\n", tag, ##__VA_ARGS__); } while (0)
+#define ESP_LOGE(tag, fmt, ...) HOST_LOG(1, "E", tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) HOST_LOG(2, "W", tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) HOST_LOG(3, "I", tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...) HOST_LOG(4, "D", tag, fmt, ##__VA_ARGS__)
@@ -0,0 +1,16 @@
+#pragma once
+#include <stdint.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+typedef void *TaskHandle_t;
+typedef void *QueueHandle_t;
+typedef void *SemaphoreHandle_t;
+
+#define pdTRUE  1
+#define pdFALSE 0
+#define pdPASS  1
+#define portMAX_DELAY      0xFFFFFFFFu
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms)  ((TickType_t)(ms))
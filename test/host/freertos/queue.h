@@ -0,0 +1,9 @@
+#pragma once
+#include "freertos/FreeRTOS.h"
+
+// Never blocks: a full send or empty receive fails at once.
+QueueHandle_t xQueueCreate(UBaseType_t len, UBaseType_t item);
+BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t wait);
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t wait);
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q);
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t q);
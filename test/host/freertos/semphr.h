@@ -0,0 +1,6 @@
+#pragma once
+#include "freertos/FreeRTOS.h"
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t m, TickType_t wait);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t m);
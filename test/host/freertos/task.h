@@ -0,0 +1,12 @@
+#pragma once
+#include "freertos/FreeRTOS.h"
+
+typedef void (*TaskFunction_t)(void *);
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack, void *arg, UBaseType_t prio, TaskHandle_t *out);
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack, void *arg, UBaseType_t prio, TaskHandle_t *out, BaseType_t core);
+void vTaskDelay(TickType_t ticks);
+void vTaskDelete(TaskHandle_t t);
+TickType_t xTaskGetTickCount(void);
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t wait);
+BaseType_t xTaskNotifyGive(TaskHandle_t t);
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t t);
@@ -0,0 +1,119 @@
+#include "host.h"
+#include <Arduino.h>
+#include "esp_random.h"
+#include <mutex>
+#include <vector>
+
+HostSerial Serial;
+int64_t host_now_us = 1000000;
+int host_failures = 0;
+static uint64_t rng = 0x9E3779B97F4A7C15ull;
+static std::mutex rng_lock;
+
+int64_t esp_timer_get_time(void) { return __atomic_load_n(&host_now_us, __ATOMIC_RELAXED); }
+uint32_t millis(void) { return (uint32_t)(esp_timer_get_time() / 1000); }
+void delay(uint32_t) {}
+uint32_t esp_get_free_heap_size(void) { return 200000; }
+uint32_t esp_get_minimum_free_heap_size(void) { return 200000; }
+size_t heap_caps_get_free_size(uint32_t) { return 200000; }
+
+void host_seed(uint32_t seed) {
+    std::lock_guard<std::mutex> g(rng_lock);
+    rng = 0x9E3779B97F4A7C15ull ^ seed;
+}
+
+int host_result(const char *name) {
+    int f = __atomic_load_n(&host_failures, __ATOMIC_RELAXED);
+    printf("%s: %s\n", name, f ? "FAILED" : "ok");
+    return f ? 1 : 0;
+}
+
+uint32_t esp_random(void) {
+    std::lock_guard<std::mutex> g(rng_lock);
+    rng ^= rng << 13;  // xorshift64
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return (uint32_t)(rng >> 32);
+}
+
+void esp_fill_random(void *buf, size_t len) {
+    uint8_t *p = (uint8_t*)buf;
+    for (size_t i = 0; i < len; i++) p[i] = (uint8_t)esp_random();
+}
+
+BaseType_t xTaskCreate(TaskFunction_t, const char*, uint32_t, void*, UBaseType_t, TaskHandle_t *out) {
+    static int dummy;
+    if (out) *out = &dummy;
+    return pdPASS;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack, void *arg, UBaseType_t prio, TaskHandle_t *out, BaseType_t) {
+    return xTaskCreate(fn, name, stack, arg, prio, out);
+}
+
+void vTaskDelay(TickType_t) {}
+void vTaskDelete(TaskHandle_t) {}
+TickType_t xTaskGetTickCount(void) { return (TickType_t)(esp_timer_get_time() / 1000); }
+uint32_t ulTaskNotifyTake(BaseType_t, TickType_t) { return 0; }
+BaseType_t xTaskNotifyGive(TaskHandle_t) { return pdPASS; }
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t) { return 0; }
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) { return new std::mutex; }
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t m, TickType_t) {
+    ((std::mutex*)m)->lock();
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t m) {
+    ((std::mutex*)m)->unlock();
+    return pdTRUE;
+}
+
+// Ring of len items allocated at create, like a FreeRTOS queue, so sending
+// and receiving never touch the heap (benchmarks count heap calls).
+typedef struct {
+    std::mutex m;
+    std::vector<uint8_t> buf;
+    size_t len, item, head, n;
+} host_queue_t;
+
+QueueHandle_t xQueueCreate(UBaseType_t len, UBaseType_t item) {
+    host_queue_t *q = new host_queue_t;
+    q->buf.resize((size_t)len * item);
+    q->len = len;
+    q->item = item;
+    q->head = q->n = 0;
+    return q;
+}
+
+BaseType_t xQueueSend(QueueHandle_t h, const void *item, TickType_t) {
+    host_queue_t *q = (host_queue_t*)h;
+    std::lock_guard<std::mutex> g(q->m);
+    if (q->n >= q->len) return pdFALSE;
+    memcpy(&q->buf[(q->head + q->n) % q->len * q->item], item, q->item);
+    q->n++;
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t h, void *item, TickType_t) {
+    host_queue_t *q = (host_queue_t*)h;
+    std::lock_guard<std::mutex> g(q->m);
+    if (q->n == 0) return pdFALSE;
+    memcpy(item, &q->buf[q->head * q->item], q->item);
+    q->head = (q->head + 1) % q->len;
+    q->n--;
+    return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t h) {
+    host_queue_t *q = (host_queue_t*)h;
+    std::lock_guard<std::mutex> g(q->m);
+    return q->n;
+}
+
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t h) {
+    host_queue_t *q = (host_queue_t*)h;
+    std::lock_guard<std::mutex> g(q->m);
+    return q->len - q->n;
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include <stdint.h>
+
+// Host runtime for the tests and simulators under test/. FreeRTOS mutexes
+// and queues are real (std::mutex based) so tests can run module code from
+// several threads, but xTaskCreate() starts nothing: tests call the steps a
+// task would run themselves. Time only moves when a test moves it.
+extern int64_t host_now_us;
+static inline void host_advance_ms(uint32_t ms) { __atomic_add_fetch(&host_now_us, (int64_t)ms * 1000, __ATOMIC_RELAXED); }
+// Deterministic esp_random()/esp_fill_random().
+void host_seed(uint32_t seed);
+
+// Test assertions: report and keep going; main returns host_result().
+#include <stdio.h>
+extern int host_failures;
+#define CHECK(c) do { if (!(c)) { printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #c); __atomic_add_fetch(&host_failures, 1, __ATOMIC_RELAXED); } } while (0)
+int host_result(const char *name);
@@ -0,0 +1,18 @@
+#pragma once
+// Host stand-in for the mbedtls streaming SHA-256 API (host/sha256.cpp).
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    uint32_t h[8];
+    uint64_t total;
+    uint8_t buf[64];
+    size_t n;
+} mbedtls_sha256_context;
+
+void mbedtls_sha256_init(mbedtls_sha256_context *ctx);
+void mbedtls_sha256_free(mbedtls_sha256_context *ctx);
+int mbedtls_sha256_starts(mbedtls_sha256_context *ctx, int is224);  // is224 must be 0
+int mbedtls_sha256_update(mbedtls_sha256_context *ctx, const unsigned char *in, size_t len);
+int mbedtls_sha256_finish(mbedtls_sha256_context *ctx, unsigned char out[32]);
+int mbedtls_sha256(const unsigned char *in, size_t len, unsigned char out[32], int is224);
@@ -0,0 +1,30 @@
+// Stand-ins for the modules mesh.cpp calls into, so it can be tested on its
+// own. All weak: a test or simulator defines the ones it cares about (radio
+// delivery, per-node keys) and keeps the rest. Signatures are not checked.
+#include "radio.h"
+#include "storage.h"
+#include "keydir.h"
+#include "crypto_abstraction.h"
+#include "esp_random.h"
+#include <string.h>
+
+#define WEAK __attribute__((weak))
+
+WEAK bool radio_send(const char*, const uint8_t*, size_t) { return true; }
+WEAK bool storage_get_blob(const char*, void*, size_t*) { return false; }
+WEAK bool storage_set_blob(const char*, const void*, size_t) { return true; }
+WEAK void keydir_on_frame(const uint8_t*, size_t) {}
+WEAK void onion_on_frame(uint8_t*, size_t) {}
+
+static uint8_t zero_key[32];
+WEAK void crypto_keys_load_or_create(void) {}
+WEAK const uint8_t* crypto_get_x25519_public(void) { return zero_key; }
+WEAK const uint8_t* crypto_get_x25519_private(void) { return zero_key; }
+WEAK const uint8_t* crypto_get_ed25519_public(void) { return zero_key; }
+WEAK void crypto_sign(uint8_t signature[64], const uint8_t*, size_t) { memset(signature, 0, 64); }
+WEAK bool crypto_verify(const uint8_t*, const uint8_t*, const uint8_t*, size_t) { return true; }
+WEAK void x25519_pool_init(void) {}
+WEAK void x25519_shared(const uint8_t my_priv[32], const uint8_t peer_pub[32], uint8_t out[32]) {
+    for (int i = 0; i < 32; i++) out[i] = my_priv[i] ^ peer_pub[i];
+}
+WEAK void random_bytes(uint8_t *out, size_t n) { esp_fill_random(out, n); }
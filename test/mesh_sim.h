@@ -0,0 +1,174 @@
+#pragma once
+// Many mesh.cpp nodes in one process. Each node's neighbor table and HELLO
+// cache are swapped in before it handles a frame and saved after, so the
+// real protocol code runs unchanged. A broadcast goes on a FIFO and reaches
+// every node in radio range when processed, so floods spread breadth first;
+// time moves only in sim_round().
+#include "host.h"
+#include "esp_random.h"
+static const char *sim_id = "";
+#define NODE_ID sim_id
+#include "../mesh.cpp"
+#include <math.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+typedef struct {
+    char id[32];
+    double x, y;
+    std::vector<int> adj;          // nodes in radio range
+    nb_table_t nbt;
+    decltype(hello_seen) seen;
+    int seen_idx;
+    uint32_t hello_seq;
+    uint64_t tx, tx_bytes;          // everything it transmitted
+    bool heard;                    // received a frame since sim_clear_heard()
+} sim_node_t;
+
+typedef struct { int from; std::string next, frame; } sim_frame_t;
+
+static std::vector<sim_node_t> sim_nodes;
+static std::deque<sim_frame_t> sim_air;
+static int sim_cur = -1;
+static uint64_t sim_tx;
+
+static void sim_enter(int k) {
+    sim_node_t *n = &sim_nodes[k];
+    sim_cur = k;
+    sim_id = n->id;
+    memcpy(&nb_work, &n->nbt, sizeof(nb_work));
+    memcpy(&NBT[(nb_seq >> 1) & 1], &n->nbt, sizeof(nb_work));
+    memcpy(hello_seen, n->seen, sizeof(hello_seen));
+    hello_seen_idx = n->seen_idx;
+}
+
+static void sim_leave(void) {
+    sim_node_t *n = &sim_nodes[sim_cur];
+    memcpy(&n->nbt, &nb_work, sizeof(nb_work));
+    memcpy(n->seen, hello_seen, sizeof(hello_seen));
+    n->seen_idx = hello_seen_idx;
+    sim_cur = -1;
+}
+
+bool radio_send(const char *next, const uint8_t *buf, size_t len) {
+    sim_node_t *n = &sim_nodes[sim_cur];
+    n->tx++;
+    n->tx_bytes += len;
+    sim_tx++;
+    sim_air.push_back({sim_cur, next, std::string((const char*)buf, len)});
+    return true;
+}
+
+// Delivers queued frames, and whatever they trigger, until the air is quiet.
+// Unicast frames reach only the named node, and only if it is in range.
+static void sim_run(void) {
+    std::vector<uint8_t> buf;
+    while (!sim_air.empty()) {
+        sim_frame_t f = sim_air.front();
+        sim_air.pop_front();
+        bool bcast = f.next == "BCAST";
+        for (int j : sim_nodes[f.from].adj) {
+            if (!bcast && f.next != sim_nodes[j].id) continue;
+            buf.assign(f.frame.begin(), f.frame.end());
+            sim_nodes[j].heard = true;
+            sim_enter(j);
+            mesh_on_radio_frame(buf.data(), buf.size());
+            sim_leave();
+        }
+    }
+}
+
+static void sim_hello(int k) {
+    sim_enter(k);
+    char *f = hello_make(sim_nodes[k].hello_seq++);
+    radio_send("BCAST", (const uint8_t*)f, strlen(f));
+    free(f);
+    sim_leave();
+    sim_run();
+}
+
+// One HELLO interval: every node broadcasts (each flood runs to completion
+// before the next starts), then the clock moves on and tables expire.
+static void sim_round(void) {
+    for (size_t k = 0; k < sim_nodes.size(); k++) sim_hello(k);
+    host_advance_ms(HELLO_INTERVAL_MS);
+    for (size_t k = 0; k < sim_nodes.size(); k++) {
+        sim_enter(k);
+        nb_expire();
+        sim_leave();
+    }
+}
+
+static void sim_clear_heard(void) {
+    for (auto &n : sim_nodes) n.heard = false;
+}
+
+static void sim_reset(void) {
+    static bool init;
+    if (!init) {
+        mesh_init();
+        init = true;
+    }
+    sim_nodes.clear();
+    sim_air.clear();
+    sim_tx = 0;
+    memset(&nb_work, 0, sizeof(nb_work));
+    memset(NBT, 0, sizeof(NBT));
+}
+
+static void sim_add(double x, double y) {
+    sim_nodes.emplace_back();
+    sim_node_t *n = &sim_nodes.back();
+    memset(n->seen, 0, sizeof(n->seen));
+    memset(&n->nbt, 0, sizeof(n->nbt));
+    snprintf(n->id, sizeof(n->id), "n%04u", (unsigned)sim_nodes.size() - 1);
+    n->x = x;
+    n->y = y;
+    n->seen_idx = 0;
+    n->hello_seq = 1;
+    n->tx = n->tx_bytes = 0;
+    n->heard = false;
+}
+
+static void sim_link(double range) {
+    for (auto &a : sim_nodes) {
+        a.adj.clear();
+        for (size_t j = 0; j < sim_nodes.size(); j++) {
+            const sim_node_t &b = sim_nodes[j];
+            if (&a != &b && hypot(a.x - b.x, a.y - b.y) <= range + 1e-9) a.adj.push_back(j);
+        }
+    }
+}
+
+static void sim_grid(int w, int h, double range) {
+    sim_reset();
+    for (int y = 0; y < h; y++) for (int x = 0; x < w; x++) sim_add(x, y);
+    sim_link(range);
+}
+
+static void sim_random(int n, double side, double range) {
+    sim_reset();
+    for (int i = 0; i < n; i++) sim_add(side * (esp_random() / 4294967296.0), side * (esp_random() / 4294967296.0));
+    sim_link(range);
+}
+
+// Radio hops from node k to every node, -1 where unreachable.
+static std::vector<int> sim_hops(int k) {
+    std::vector<int> d(sim_nodes.size(), -1);
+    std::deque<int> q;
+    d[k] = 0;
+    q.push_back(k);
+    while (!q.empty()) {
+        int u = q.front();
+        q.pop_front();
+        for (int v : sim_nodes[u].adj) if (d[v] < 0) { d[v] = d[u] + 1; q.push_back(v); }
+    }
+    return d;
+}
+
+static double sim_avg_degree(void) {
+    double s = 0;
+    for (auto &n : sim_nodes) s += n.adj.size();
+    return sim_nodes.empty() ? 0 : s / sim_nodes.size();
+}
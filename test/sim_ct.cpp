@@ -0,0 +1,250 @@
+// Cut-through against store-and-forward on a chain of nRF24 nodes, through
+// the real radio_nrf24.cpp on every node: time from the first fragment
+// leaving the source to the whole frame at the far end, per route length.
+// Store-and-forward relays reassemble each frame and send it on, as the
+// mesh does for plain onion cells; cut-through relays pass fragments on as
+// onion_ct_begin() tells them to.
+//
+// The air is what makes the difference: radios are half-duplex, so a node
+// hears nothing while it transmits or has its receiver off, a fragment is
+// lost at a node that hears two transmissions at once, and each node only
+// hears its neighbors on the chain. Fragments take their 250 kbps airtime
+// plus TX settling; the rx FIFO holds three; the rx task polls once a tick
+// when idle. No acks or retries: a lost fragment loses the frame.
+// Usage: sim_ct [seed].
+#include "host.h"
+#include "esp_random.h"
+#include <Arduino.h>
+#include <SPI.h>
+#include <RF24.h>
+#include "onion.h"
+#include <algorithm>
+#include <deque>
+#include <queue>
+#include <string>
+#include <tuple>
+#include <vector>
+static void sim_delay(TickType_t ticks);
+#define vTaskDelay sim_delay
+#include "../radio_nrf24.cpp"
+#undef vTaskDelay
+
+#define TURN_US  130  // RX to TX settling
+#define BIT_US   4    // 250 kbps
+#define RX_FIFO  3
+
+// Air time of one fragment: preamble, 5-byte address, packet control field,
+// payload and CRC.
+static int64_t airtime_us(size_t n) { return ((1 + 5 + n + 2) * 8 + 9) * BIT_US; }
+
+typedef struct {
+    int64_t start, end;
+    int from;
+    std::string frag;
+} sim_tx_t;
+
+typedef struct {
+    int64_t clock;  // host_now_us while it runs
+    bool listening;
+    int64_t deaf_since;
+    std::vector<std::pair<int64_t, int64_t>> deaf;  // receiver off
+    std::deque<std::string> fifo;
+    decltype(reassembly_pool) pool;
+    uint8_t next_id;
+} sim_node_t;
+
+static std::vector<sim_node_t> nodes;
+static std::vector<sim_tx_t> txs;
+// Pending events by time: a transmission ending, or a node's rx task waking.
+enum { EV_TX_END, EV_WAKE };
+typedef std::tuple<int64_t, int, int> sim_ev_t;
+static std::priority_queue<sim_ev_t, std::vector<sim_ev_t>, std::greater<sim_ev_t>> events;
+static int cur = -1, dest;
+static std::string sent;
+static int64_t got_at;
+static bool intact;
+
+static void enter(int k) {
+    cur = k;
+    host_now_us = nodes[k].clock;
+    memcpy(reassembly_pool, nodes[k].pool, sizeof(reassembly_pool));
+    next_packet_id = nodes[k].next_id;
+}
+
+static void leave(void) {
+    nodes[cur].clock = host_now_us;
+    memcpy(nodes[cur].pool, reassembly_pool, sizeof(reassembly_pool));
+    nodes[cur].next_id = next_packet_id;
+    cur = -1;
+}
+
+// Wakes on a tick boundary, so up to a tick short, as on the node.
+static void sim_delay(TickType_t ticks) {
+    int64_t tick = portTICK_PERIOD_MS * 1000;
+    if (ticks) host_now_us = (host_now_us / tick + ticks) * tick;
+}
+
+void RF24::startListening(void) {
+    sim_node_t &n = nodes[cur];
+    if (n.listening) return;
+    n.listening = true;
+    n.deaf.push_back({ n.deaf_since, host_now_us + TURN_US });
+}
+
+void RF24::stopListening(void) {
+    sim_node_t &n = nodes[cur];
+    if (!n.listening) return;
+    n.listening = false;
+    n.deaf_since = host_now_us;
+}
+
+bool RF24::available(void) { return !nodes[cur].fifo.empty(); }
+uint8_t RF24::getDynamicPayloadSize(void) { return nodes[cur].fifo.front().size(); }
+void RF24::flush_rx(void) { nodes[cur].fifo.clear(); }
+
+void RF24::read(void *buf, uint8_t len) {
+    memcpy(buf, nodes[cur].fifo.front().data(), len);
+    nodes[cur].fifo.pop_front();
+}
+
+bool RF24::write(const void *buf, uint8_t len) {
+    int64_t start = host_now_us + TURN_US;
+    host_now_us = start + airtime_us(len);
+    txs.push_back({ start, host_now_us, cur, std::string((const char*)buf, len) });
+    events.push(sim_ev_t(host_now_us, EV_TX_END, txs.size() - 1));
+    return true;
+}
+
+// Plain frames carry the link trailer; cut-through ones do not.
+int mesh_link_seal(const char*, const uint8_t *buf, size_t, uint8_t trailer[RADIO_LINK_TRAILER]) {
+    if (buf[0] == RADIO_CT_FMT) return 0;
+    memset(trailer, 0, RADIO_LINK_TRAILER);
+    return RADIO_LINK_TRAILER;
+}
+
+static const char *name(int k) {
+    static char s[ONION_MAX_HOPS + 1][16];
+    snprintf(s[k], sizeof(s[k]), "n%d", k);
+    return s[k];
+}
+
+// Byte 1 of every frame names the node it is for, as the link tag or
+// trailer does on the node; the others drop it. Relays forward toward the
+// far end, which keeps the frame.
+int onion_ct_begin(uint8_t *hdr, radio_ct_t *ct) {
+    if (hdr[1] != cur) return -1;
+    if (cur == dest) return 0;
+    hdr[1] = cur + 1;
+    strcpy(ct->next, name(cur + 1));
+    return 1;
+}
+void onion_ct_apply(const radio_ct_t*, uint8_t*, size_t, size_t) {}
+
+void mesh_on_radio_frame(uint8_t *buf, size_t len) {
+    size_t n = buf[0] == RADIO_CT_FMT ? len : len - RADIO_LINK_TRAILER;
+    if (buf[1] != cur) return;
+    if (cur != dest) {
+        buf[1] = cur + 1;
+        radio_send(name(cur + 1), buf, n);
+        return;
+    }
+    got_at = host_now_us;
+    buf[1] = 1;
+    intact = std::string((const char*)buf, n) == sent;
+}
+
+static bool overlaps(int64_t a0, int64_t a1, int64_t b0, int64_t b1) { return a0 < b1 && b0 < a1; }
+
+// Fragment t reaches the neighbors of its sender that had their receiver on
+// throughout and heard nothing else meanwhile.
+static void tx_end(int t) {
+    const sim_tx_t &e = txs[t];
+    for (int r = e.from - 1; r <= e.from + 1; r += 2) {
+        if (r < 0 || r >= (int)nodes.size()) continue;
+        sim_node_t &n = nodes[r];
+        bool ok = n.listening || n.deaf_since >= e.end;
+        for (auto &d : n.deaf) ok = ok && !overlaps(d.first, d.second, e.start, e.end);
+        for (size_t o = 0; ok && o < txs.size(); o++) {
+            ok = (int)o == t || abs(txs[o].from - r) != 1 || !overlaps(txs[o].start, txs[o].end, e.start, e.end);
+        }
+        if (!ok || n.fifo.size() >= RX_FIFO) continue;
+        n.fifo.push_back(e.frag);
+        int64_t tick = portTICK_PERIOD_MS * 1000, at = std::max(e.end, n.clock);
+        events.push(sim_ev_t((at + tick - 1) / tick * tick, EV_WAKE, r));  // polled on the next tick
+    }
+}
+
+// The rx task of node k, until its FIFO is empty.
+static void wake(int k, int64_t at) {
+    enter(k);
+    host_now_us = std::max(host_now_us, at);
+    while (radio.available()) {
+        if (!rx_poll()) sim_delay(pdMS_TO_TICKS(1));
+    }
+    leave();
+}
+
+// Latency in ms of one frame of len bytes over hops, or -1 if lost.
+static double run(int hops, size_t len, bool ct) {
+    nodes.assign(hops + 1, sim_node_t());
+    for (sim_node_t &n : nodes) {
+        n.clock = 1000000;
+        n.listening = true;
+        n.next_id = esp_random();
+    }
+    txs.clear();
+    dest = hops;
+    sent.resize(len);
+    for (size_t i = 0; i < len; i++) sent[i] = (char)esp_random();
+    sent[0] = ct ? RADIO_CT_FMT : ONION_FMT_CELL;
+    sent[1] = 1;
+    got_at = -1;
+    intact = false;
+    enter(0);
+    int64_t t0 = host_now_us;
+    radio_send(name(1), (const uint8_t*)sent.data(), len);
+    leave();
+    while (!events.empty()) {
+        sim_ev_t ev = events.top();
+        events.pop();
+        if (std::get<1>(ev) == EV_TX_END) tx_end(std::get<2>(ev));
+        else wake(std::get<2>(ev), std::get<0>(ev));
+    }
+    return got_at >= 0 && intact ? (got_at - t0) / 1000.0 : -1;
+}
+
+// Frame bytes of a cut-through cell with payload bytes.
+#define CT_FRAME(payload) (RADIO_CT_HDR + (payload) + 16 * (((payload) + ONION_CT_CHUNK - 1) / ONION_CT_CHUNK))
+
+static void show(double ms) {
+    if (ms < 0) printf("  %6s", "-");
+    else printf("  %6.0f", ms);
+}
+
+int main(int argc, char **argv) {
+    host_seed(argc > 1 ? atoi(argv[1]) : 40);
+    nodes.assign(1, sim_node_t());
+    enter(0);
+    radio_init();
+    leave();
+    static const size_t sizes[] = { 1024, CT_FRAME(ONION_CT_MIN_BYTES), ONION_MAX_BYTES };
+    printf("one frame over a chain of nRF24 nodes, ms from first fragment out to whole frame\n"
+           "in, store-and-forward and cut-through (- if lost); cut-through from %d hops and\n"
+           "%d-byte cells\n", ONION_CT_MIN_HOPS, ONION_CT_MIN_BYTES);
+    printf("hops");
+    for (size_t s : sizes) printf("  %6u B   cut", (unsigned)s);
+    printf("\n");
+    for (int h = 1; h <= ONION_MAX_HOPS; h++) {
+        printf("%4d", h);
+        for (size_t s : sizes) {
+            double sf = run(h, s, false), ct = run(h, s, true);
+            show(sf);
+            show(ct);
+            // Both get through, and cut-through is faster where it is used.
+            CHECK(sf > 0 && ct > 0);
+            if (h >= ONION_CT_MIN_HOPS && s >= CT_FRAME(ONION_CT_MIN_BYTES)) CHECK(ct < sf);
+        }
+        printf("\n");
+    }
+    return host_result("sim_ct");
+}
@@ -0,0 +1,492 @@
+// DTN replication on intermittently connected mobility traces: the same
+// trace and message load run once per mode, through the real dtn.cpp and
+// prophet.cpp on every node, and each run reports delivery ratio, latency
+// and overhead (bundle transmissions beyond the one that delivers, and
+// summary vector and custody ack bytes). Nodes keep bundles in RAM
+// (DTN_MAX_RAM_ITEMS, DTN_RAM_BYTE_BUDGET), as on nodes without the flash
+// store, so replication pays for itself in evictions. Links exist while
+// two nodes are in radio range; custody forwarding only moves a bundle
+// along a path that exists end to end at that moment.
+//
+// Each node's DTN, PRoPHET and payload pool state is swapped in around
+// everything it runs, as mesh_sim.h does for mesh.cpp. The onion layer is
+// left out: onion_build() passes the payload through, so byte counts lack
+// ONION_HEADROOM(1) per frame. Usage: sim_dtn [seed].
+#include "host.h"
+#include "esp_random.h"
+static const char *sim_id = "";
+#define NODE_ID sim_id
+#include "mesh.h"
+#include "onion.h"
+#include "bundle_store.h"
+#include "bundle_pool.h"
+#include "cgr.h"
+#include "crypto_abstraction.h"
+#include <Arduino.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <set>
+#include <tuple>
+#include <string>
+#include <vector>
+#include "../dtn.cpp"
+#include "../prophet.cpp"
+namespace pool {
+#include "../bundle_pool.cpp"
+}
+
+#define STEP_MS   1000
+#define RANGE_M   60.0   // nRF24 at 250 kbps, low power
+#define MSG_BYTES 160
+
+// Every piece of per-node state, saved and restored as raw bytes.
+typedef struct { void *p; size_t n; } sim_var_t;
+#define VAR(v) { (void*)&(v), sizeof(v) }
+static const sim_var_t vars[] = {
+    VAR(Q), VAR(D), VAR(free_head), VAR(QN), VAR(H), VAR(idx), VAR(HN), VAR(bytes_held),
+    VAR(seen), VAR(seen_idx), VAR(stats), VAR(sv_in), VAR(sv_full), VAR(contacts),
+    VAR(sv_sent), VAR(sv_sent_idx), VAR(sv_rounds), VAR(sv_rounds_idx), VAR(T), VAR(TN), VAR(aged_at),
+    VAR(pool::arena), VAR(pool::tag), VAR(pool::head), VAR(pool::stats),
+};
+
+typedef struct {
+    char id[32];
+    std::vector<uint8_t> state;
+    double x, y, tx, ty, speed;  // position, waypoint, m/s
+    int64_t pause_until;         // ms
+    bool mobile;
+    std::vector<int> adj;
+    bool pending;                // has events for its DTN task
+    uint64_t wake;
+} sim_node_t;
+
+typedef struct { int from, to; std::string frame; } sim_frame_t;
+typedef struct { int64_t at_ms; int src, dst; } sim_msg_t;
+
+static std::vector<sim_node_t> nodes;
+static std::deque<sim_frame_t> air;
+static int cur = -1;
+static mesh_event_cb_t dtn_cb;
+static uint64_t tx_bundles, tx_ctl_bytes, resent;
+static std::map<std::pair<int, int>, int> contact_no;            // links come up between the two
+static std::set<std::tuple<int, int, int, uint64_t>> pushed;     // from, to, contact, bundle id
+static std::vector<int64_t> delivered_at;  // per message, -1 until delivered
+static uint32_t rng = 1;
+
+static double frand(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng / 4294967296.0;
+}
+
+static void enter(int k) {
+    const uint8_t *s = nodes[k].state.data();
+    for (const sim_var_t &v : vars) { memcpy(v.p, s, v.n); s += v.n; }
+    cur = k;
+    sim_id = nodes[k].id;
+}
+
+static void leave(void) {
+    uint8_t *s = nodes[cur].state.data();
+    for (const sim_var_t &v : vars) { memcpy(s, v.p, v.n); s += v.n; }
+    cur = -1;
+}
+
+static int node_idx(const char *id) {
+    for (size_t k = 0; k < nodes.size(); k++) if (!strcmp(nodes[k].id, id)) return k;
+    return -1;
+}
+
+// The mesh as dtn.cpp sees it, from the current links.
+uint32_t mesh_id_hash(const char *id) {
+    uint32_t h = 2166136261u;
+    while (*id) { h ^= (uint8_t)*id++; h *= 16777619u; }
+    return h;
+}
+bool mesh_get_address(char*, size_t) { return false; }
+bool mesh_get_ed25519_pub(const char*, uint8_t out[32]) { memset(out, 0, 32); return true; }
+bool mesh_subscribe(mesh_event_cb_t cb, void*) { dtn_cb = cb; return true; }
+
+// Neighbors on a shortest path to dest as the links stand now.
+int mesh_next_hops(const char *dest, char out[][32], int max) {
+    int t = node_idx(dest);
+    if (t < 0 || t == cur) return 0;
+    std::vector<int> d(nodes.size(), -1);
+    std::deque<int> q;
+    d[t] = 0;
+    q.push_back(t);
+    while (!q.empty()) {
+        int u = q.front();
+        q.pop_front();
+        for (int v : nodes[u].adj) if (d[v] < 0) { d[v] = d[u] + 1; q.push_back(v); }
+    }
+    int n = 0;
+    for (int v : nodes[cur].adj) {
+        if (n < max && d[v] >= 0 && d[v] == d[cur] - 1) strcpy(out[n++], nodes[v].id);
+    }
+    return n;
+}
+
+uint8_t *onion_build(const char**, size_t, uint8_t *inner, size_t len, size_t, size_t *out_len) {
+    *out_len = len;
+    return inner;
+}
+
+bool bundle_store_init(bundle_store_found_t) { return false; }
+bool bundle_store_put(uint16_t, const char*, const uint8_t*, size_t) { return false; }
+bool bundle_store_get(uint16_t, uint8_t*, size_t) { return false; }
+void bundle_store_del(uint16_t) {}
+bool bundle_pool_init(size_t bytes) { return pool::bundle_pool_init(bytes); }
+uint8_t *bundle_pool_alloc(size_t len) { return pool::bundle_pool_alloc(len); }
+void bundle_pool_free(uint8_t *p, size_t len) { pool::bundle_pool_free(p, len); }
+void cgr_init(void) {}
+bool cgr_route(const char*, uint32_t, uint8_t*, uint16_t*, uint64_t*) { return false; }
+void cgr_release(uint64_t, uint16_t, uint32_t) {}
+bool cgr_contact(uint8_t, uint16_t, char*, uint64_t*) { return false; }
+
+// Frames go out at once and reach the named node if it is in range.
+bool radio_send(const char *next, const uint8_t *buf, size_t len) {
+    int to = node_idx(next);
+    if (buf[0] == ONION_KIND_BUNDLE) {
+        size_t o = 1 + 1 + buf[1];
+        o += 1 + buf[o];
+        tx_bundles++;
+        if (!pushed.insert(std::make_tuple(cur, to, contact_no[{ cur, to }], rd64(buf + o))).second) resent++;
+    } else {
+        tx_ctl_bytes += len;
+    }
+    if (to >= 0 && std::find(nodes[cur].adj.begin(), nodes[cur].adj.end(), to) != nodes[cur].adj.end()) {
+        air.push_back({cur, to, std::string((const char*)buf, len)});
+    }
+    return true;
+}
+
+static void deliver(const sim_frame_t &f) {
+    std::vector<uint8_t> buf(f.frame.begin(), f.frame.end());
+    enter(f.to);
+    if (buf[0] == ONION_KIND_CUSTODY) dtn_on_custody(buf.data() + 1, buf.size() - 1);
+    else if (buf[0] == ONION_KIND_SUMMARY) dtn_on_summary(buf.data() + 1, buf.size() - 1);
+    else if (buf[0] == ONION_KIND_BUNDLE) {
+        const uint8_t *p;
+        size_t n;
+        if (dtn_on_bundle(buf.data() + 1, buf.size() - 1, &p, &n) && n == 1 + MSG_BYTES && p[0] == ONION_KIND_MSG) {
+            uint32_t m;
+            memcpy(&m, p + 1, 4);
+            if (m < delivered_at.size() && delivered_at[m] < 0) delivered_at[m] = host_now_us / 1000;
+        }
+    }
+    leave();
+    nodes[f.to].pending = true;
+}
+
+// Runs the DTN task of every node with something to do, and what that
+// triggers, until the air is quiet.
+static void run_tasks(void) {
+    static uint8_t frame[ONION_MAX_BYTES];
+    for (int pass = 0; pass < 64; pass++) {
+        bool any = false;
+        for (size_t k = 0; k < nodes.size(); k++) {
+            sim_node_t &n = nodes[k];
+            if (!n.pending && n.wake > (uint64_t)host_now_us) continue;
+            any = true;
+            n.pending = false;
+            enter(k);
+            uint64_t wake = dtn_step(frame);
+            n.wake = QN ? wake : UINT64_MAX;
+            leave();
+            while (!air.empty()) {
+                sim_frame_t f = air.front();
+                air.pop_front();
+                deliver(f);
+            }
+        }
+        if (!any) return;
+    }
+}
+
+static void waypoint(sim_node_t &n, double side) {
+    n.tx = frand() * side;
+    n.ty = frand() * side;
+}
+
+// Random waypoint walkers that pause at each point.
+static void pedestrians(int count, double side, double vmin, double vmax) {
+    for (int i = 0; i < count; i++) {
+        sim_node_t n = {};
+        n.mobile = true;
+        n.x = frand() * side;
+        n.y = frand() * side;
+        waypoint(n, side);
+        n.speed = vmin + frand() * (vmax - vmin);
+        nodes.push_back(n);
+    }
+}
+
+typedef struct { double x, y; } camp_t;
+
+// Static nodes in camps far out of each other's range, and couriers that
+// drive between camps and wait at each a while: the only way across.
+static std::vector<camp_t> camps;
+
+static void walk(int64_t now_ms, double side, int pause_s, bool to_camps) {
+    for (sim_node_t &n : nodes) {
+        if (!n.mobile || now_ms < n.pause_until) continue;
+        double dx = n.tx - n.x, dy = n.ty - n.y, d = hypot(dx, dy), step = n.speed * STEP_MS / 1000.0;
+        if (d > step) {
+            n.x += dx / d * step;
+            n.y += dy / d * step;
+            continue;
+        }
+        n.x = n.tx;
+        n.y = n.ty;
+        n.pause_until = now_ms + (int64_t)(frand() * pause_s * 1000);
+        if (to_camps) {
+            const camp_t &c = camps[(int)(frand() * camps.size())];
+            n.tx = c.x + (frand() - 0.5) * 40;
+            n.ty = c.y + (frand() - 0.5) * 40;
+        } else {
+            waypoint(n, side);
+        }
+    }
+}
+
+typedef struct {
+    const char *name;
+    int nodes, hours, msgs;
+    double side;
+    bool camps;
+} trace_t;
+
+typedef struct {
+    const char *name;
+    dtn_opts_t opts;
+} sim_mode_t;
+
+// Adds the camp nodes and couriers, or the walkers.
+static void place(const trace_t &t) {
+    nodes.clear();
+    camps.clear();
+    if (!t.camps) {
+        pedestrians(t.nodes, t.side, 0.5, 1.5);
+        return;
+    }
+    int ncamps = 4, couriers = 4, per = (t.nodes - couriers) / ncamps;
+    for (int c = 0; c < ncamps; c++) camps.push_back({ (c & 1) * t.side, (c >> 1) * t.side });
+    for (int c = 0; c < ncamps; c++) {
+        for (int i = 0; i < per; i++) {
+            sim_node_t n = {};
+            double a = 2 * M_PI * i / per;
+            n.x = camps[c].x + 25 * cos(a);
+            n.y = camps[c].y + 25 * sin(a);
+            nodes.push_back(n);
+        }
+    }
+    for (int i = 0; i < couriers; i++) {
+        sim_node_t n = {};
+        n.mobile = true;
+        n.x = n.tx = camps[i % ncamps].x;
+        n.y = n.ty = camps[i % ncamps].y;
+        n.speed = 8;
+        nodes.push_back(n);
+    }
+}
+
+// Recomputes the links; each new one is a contact event at both ends.
+// Returns how many came up.
+static int link_up(void) {
+    std::vector<std::vector<int>> adj(nodes.size());
+    for (size_t a = 0; a < nodes.size(); a++) {
+        for (size_t b = a + 1; b < nodes.size(); b++) {
+            if (hypot(nodes[a].x - nodes[b].x, nodes[a].y - nodes[b].y) > RANGE_M) continue;
+            adj[a].push_back(b);
+            adj[b].push_back(a);
+        }
+    }
+    std::vector<std::pair<int, int>> up;
+    for (size_t a = 0; a < nodes.size(); a++) {
+        for (int b : adj[a]) {
+            if (std::find(nodes[a].adj.begin(), nodes[a].adj.end(), b) == nodes[a].adj.end()) up.push_back({ (int)a, b });
+        }
+        nodes[a].adj = adj[a];
+    }
+    for (auto &e : up) {
+        contact_no[e]++;
+        enter(e.first);
+        dtn_cb(MESH_EV_NEIGHBOR_UP, nodes[e.second].id, NULL);
+        leave();
+        nodes[e.first].pending = true;
+    }
+    return up.size() / 2;
+}
+
+static void run(const trace_t &t, const sim_mode_t &m, uint32_t seed) {
+    rng = seed;
+    host_seed(seed);
+    place(t);
+    for (size_t k = 0; k < nodes.size(); k++) {
+        sim_node_t &n = nodes[k];
+        snprintf(n.id, sizeof(n.id), "n%02u", (unsigned)k);
+        size_t bytes = 0;
+        for (const sim_var_t &v : vars) bytes += v.n;
+        n.state.assign(bytes, 0);
+        n.wake = UINT64_MAX;
+        enter(k);
+        for (const sim_var_t &v : vars) memset(v.p, 0, v.n);
+        dtn_init();
+        leave();
+    }
+    // Messages go between nodes that are not in the same camp.
+    int fixed = t.camps ? t.nodes - 4 : t.nodes, per = fixed / 4;
+    std::vector<sim_msg_t> msgs;
+    int64_t span_ms = (int64_t)t.hours * 3600000 * 2 / 3;  // the last third only drains
+    while ((int)msgs.size() < t.msgs) {
+        int a = frand() * fixed, b = frand() * fixed;
+        if (a == b || (t.camps && a / per == b / per)) continue;
+        msgs.push_back({ (int64_t)msgs.size() * span_ms / t.msgs, a, b });
+    }
+    delivered_at.assign(msgs.size(), -1);
+    tx_bundles = tx_ctl_bytes = resent = 0;
+    contact_no.clear();
+    pushed.clear();
+    air.clear();
+
+    host_now_us = 0;
+    size_t next = 0;
+    uint64_t contacts = 0, link_s = 0, connected = 0;
+    for (int64_t now = 0; now < (int64_t)t.hours * 3600000; now += STEP_MS) {
+        host_now_us = now * 1000;
+        walk(now, t.side, t.camps ? 600 : 120, t.camps);
+        contacts += 2 * link_up();
+        for (auto &n : nodes) link_s += n.adj.size();
+        while (next < msgs.size() && msgs[next].at_ms <= now) {
+            const sim_msg_t &g = msgs[next];
+            uint8_t payload[MSG_BYTES];
+            uint32_t k = next;
+            memset(payload, 0, sizeof(payload));
+            memcpy(payload, &k, 4);
+            enter(g.src);
+            char path[DTN_MAX_NEXT_HOPS][32];
+            if (mesh_next_hops(nodes[g.dst].id, path, DTN_MAX_NEXT_HOPS)) connected++;
+            dtn_enqueue(nodes[g.dst].id, payload, sizeof(payload), &m.opts);
+            leave();
+            nodes[g.src].pending = true;
+            next++;
+        }
+        run_tasks();
+    }
+
+    int ok = 0;
+    std::vector<double> lat;
+    for (size_t i = 0; i < msgs.size(); i++) {
+        if (delivered_at[i] < 0) continue;
+        ok++;
+        lat.push_back((delivered_at[i] - msgs[i].at_ms) / 60000.0);
+    }
+    std::sort(lat.begin(), lat.end());
+    uint32_t refused = 0, evicted = 0;
+    for (size_t k = 0; k < nodes.size(); k++) {
+        dtn_stats_t st;
+        enter(k);
+        dtn_stats(&st);
+        free(pool::arena);
+        free(pool::tag);
+        leave();
+        refused += st.refused;
+        evicted += st.evicted;
+    }
+    static const trace_t *shown;
+    if (shown != &t) {
+        shown = &t;
+        double hours = t.hours, n = nodes.size();
+        printf("\n%s: %d nodes, %d h, %d messages of %d bytes\n"
+               "  %.1f contacts per node-hour, %.2f links per node, %.0f%% of messages with a path when sent\n",
+               t.name, (int)n, t.hours, t.msgs, MSG_BYTES, contacts / n / hours,
+               (double)link_s / n / (hours * 3600000 / STEP_MS), 100.0 * connected / msgs.size());
+        printf("  %-10s %9s %13s %10s %8s %10s %8s %7s %6s\n", "mode", "delivered", "latency (min)",
+               "sent/msg", "overhead", "ctl B/msg", "refused", "evicted", "resent");
+    }
+    printf("  %-10s %8.1f%% %6.0f / %4.0f %10.1f %8.1f %10.0f %8u %7u %6u\n", m.name, 100.0 * ok / msgs.size(),
+           lat.empty() ? 0 : lat[lat.size() / 2], lat.empty() ? 0 : lat[lat.size() * 9 / 10],
+           (double)tx_bundles / msgs.size(), ok ? (double)(tx_bundles - ok) / ok : 0,
+           (double)tx_ctl_bytes / msgs.size(), (unsigned)refused, (unsigned)evicted, (unsigned)resent);
+    // No copy goes twice to the same neighbor in one contact, spray spends at
+    // most its budget, and every replicating mode gets most messages through.
+    CHECK(resent == 0);
+    if (m.opts.mode == DTN_MODE_SPRAY) CHECK(tx_bundles <= msgs.size() * m.opts.copies);
+    if (m.opts.mode != DTN_MODE_CUSTODY) CHECK(ok * 2 > (int)msgs.size());
+}
+
+// A node with a full queue and a full delivered list sends its summary
+// vector: the neighbor must see every id, and few ids it does not hold.
+static void vector_coverage(void) {
+    nodes.assign(2, sim_node_t());
+    for (size_t k = 0; k < 2; k++) {
+        snprintf(nodes[k].id, sizeof(nodes[k].id), "n%02u", (unsigned)k);
+        nodes[k].adj = { 1 - (int)k };
+        size_t bytes = 0;
+        for (const sim_var_t &v : vars) bytes += v.n;
+        nodes[k].state.assign(bytes, 0);
+        enter(k);
+        for (const sim_var_t &v : vars) memset(v.p, 0, v.n);
+        dtn_init();
+        leave();
+    }
+    std::vector<uint64_t> held, other;
+    enter(0);
+    for (int i = 0; i < DTN_SEEN_SIZE; i++) seen[i] = ((uint64_t)esp_random() << 32) | esp_random();
+    for (int i = 0; i < DTN_MAX_ITEMS; i++) {
+        Q[i].len = 1;
+        Q[i].id = ((uint64_t)esp_random() << 32) | esp_random();
+        held.push_back(Q[i].id);
+    }
+    QN = DTN_MAX_ITEMS;
+    static uint8_t frame[ONION_MAX_BYTES];
+    contact_t c = { {0}, 0, 1 };
+    strcpy(c.peer, nodes[1].id);
+    sv_send(frame, &c);
+    std::vector<uint64_t> delivered(seen, seen + DTN_SEEN_SIZE);
+    for (int i = 0; i < DTN_MAX_ITEMS; i++) Q[i].len = 0;  // nothing to free in the pool
+    QN = 0;
+    leave();
+    CHECK(air.size() == 1);
+    while (!air.empty()) { deliver(air.front()); air.pop_front(); }
+    enter(1);
+    CHECK(sv_full[0] && !strcmp(sv_in[0].peer, nodes[0].id));
+    int missed = 0, false_pos = 0, trials = 10000;
+    for (uint64_t id : delivered) missed += !sv_delivered(&sv_in[0], id);
+    for (uint64_t id : held) missed += !sv_has(&sv_in[0], id);
+    for (int i = 0; i < trials; i++) false_pos += sv_has(&sv_in[0], ((uint64_t)esp_random() << 32) | esp_random());
+    leave();
+    printf("\nsummary vector of %d held and %d delivered ids: %d missed, %.1f%% false positives\n",
+           DTN_MAX_ITEMS, DTN_SEEN_SIZE, missed, 100.0 * false_pos / trials);
+    CHECK(missed == 0 && false_pos * 100 < trials * 5);
+    nodes.clear();
+}
+
+int main(int argc, char **argv) {
+    uint32_t seed = argc > 1 ? atoi(argv[1]) : 45;
+    static const trace_t traces[] = {
+        { "pedestrians (random waypoint, 1 km square)", 40, 6, 240, 1000, false },
+        { "camps and couriers (4 camps 2 km apart, 4 vehicles)", 36, 12, 240, 2000, true },
+    };
+    static const sim_mode_t modes[] = {
+        { "custody", { DTN_MODE_CUSTODY, 0, DTN_PRIO_NORMAL, 0 } },
+        { "epidemic", { DTN_MODE_EPIDEMIC, 0, DTN_PRIO_NORMAL, 0 } },
+        { "spray L=4", { DTN_MODE_SPRAY, 4, DTN_PRIO_NORMAL, 0 } },
+        { "spray L=8", { DTN_MODE_SPRAY, 8, DTN_PRIO_NORMAL, 0 } },
+        { "spray L=16", { DTN_MODE_SPRAY, 16, DTN_PRIO_NORMAL, 0 } },
+        { "prophet", { DTN_MODE_PROPHET, 0, DTN_PRIO_NORMAL, 0 } },
+    };
+    printf("DTN modes on mobility traces, seed %u (latency: median / 90th percentile; overhead:\n"
+           "bundle transmissions per delivered message, less the delivering one)\n", (unsigned)seed);
+    for (const trace_t &t : traces) {
+        for (const sim_mode_t &m : modes) run(t, m, seed);
+    }
+    vector_coverage();
+    return host_result("sim_dtn");
+}
@@ -0,0 +1,125 @@
+// 1000 nodes in flat and clustered mode on the same random topology: the
+// routing state each node holds, the HELLO traffic it costs, and how many
+// destinations are reached, by an onion route (mesh_choose_route) or hop by
+// hop the way the DTN forwards (mesh_next_hops). Usage: sim_scale [nodes].
+#include "host.h"
+static int sim_clustered;
+#define MESH_CLUSTERED sim_clustered
+#include "mesh_sim.h"
+#include <set>
+
+#define DEGREE   8.0   // mean radio neighbors
+#define PAIRS    2000
+#define MEASURED 2     // last rounds whose traffic is reported
+#define MIN_REACH 90   // % of pairs clustered mode must reach hop by hop
+
+static int node_idx(const char *id) { return atoi(id + 1); }
+
+static bool adjacent(int a, int b) {
+    for (int v : sim_nodes[a].adj) if (v == b) return true;
+    return false;
+}
+
+static void run(const char *name, int rounds) {
+    int n = sim_nodes.size();
+    uint64_t tx0 = 0, bytes0 = 0;
+    for (int r = 0; r < rounds; r++) {
+        if (r == rounds - MEASURED) {
+            for (auto &s : sim_nodes) { tx0 += s.tx; bytes0 += s.tx_bytes; }
+        }
+        sim_round();
+    }
+    uint64_t tx = 0, bytes = 0;
+    for (auto &s : sim_nodes) { tx += s.tx; bytes += s.tx_bytes; }
+
+    double nb = 0, cl = 0;
+    int nb_max = 0, cl_max = 0, full = 0;
+    std::set<uint32_t> heads;
+    for (auto &s : sim_nodes) {
+        if (s.nbt.my_ch) heads.insert(s.nbt.my_ch);
+        nb += s.nbt.n;
+        cl += s.nbt.cl_n;
+        if (s.nbt.n > nb_max) nb_max = s.nbt.n;
+        if (s.nbt.cl_n > cl_max) cl_max = s.nbt.cl_n;
+        if (s.nbt.n == MAX_NB) full++;
+    }
+
+    int pairs = 0, routed = 0, bad = 0, walked = 0, route_max = 0, local = 0, local_routed = 0;
+    double route_hops = 0, shortest = 0, walk_hops = 0;
+    while (pairs < PAIRS) {
+        int a = esp_random() % n, b = esp_random() % n;
+        std::vector<int> d = sim_hops(a);
+        if (a == b || d[b] < 0) continue;
+        pairs++;
+        bool same_cluster = sim_clustered && sim_nodes[a].nbt.my_ch == sim_nodes[b].nbt.my_ch;
+        local += same_cluster;
+        char addr[64];
+        sim_enter(b);
+        mesh_get_address(addr, sizeof(addr));
+        sim_leave();
+
+        const char *route[ONION_MAX_HOPS];
+        size_t len = 0;
+        sim_enter(a);
+        bool ok = mesh_choose_route(addr, route, &len);
+        sim_leave();
+        if (ok) {
+            bool valid = node_idx(route[len - 1]) == b && adjacent(a, node_idx(route[0]));
+            for (size_t k = 0; k + 1 < len; k++) valid &= adjacent(node_idx(route[k]), node_idx(route[k + 1]));
+            for (size_t k = 0; k < len; k++) free((void*)route[k]);
+            if (!valid) bad++;
+            else {
+                routed++;
+                local_routed += same_cluster;
+                route_hops += len;
+                shortest += d[b];
+                if ((int)len > route_max) route_max = len;
+            }
+        }
+
+        int cur = a, steps = 0;
+        while (cur != b && steps < 64) {
+            char hops[DTN_MAX_NEXT_HOPS][32];
+            sim_enter(cur);
+            int k = mesh_next_hops(addr, hops, DTN_MAX_NEXT_HOPS);
+            sim_leave();
+            if (!k || !adjacent(cur, node_idx(hops[0]))) break;
+            cur = node_idx(hops[0]);
+            steps++;
+        }
+        if (cur == b) { walked++; walk_hops += steps; }
+    }
+    CHECK(bad == 0);
+
+    printf("%s: %d nodes, mean degree %.1f, %d HELLO rounds", name, n, sim_avg_degree(), rounds);
+    if (sim_clustered) printf(", %d clusters (MESH_MAX_CLUSTERS %d)", (int)heads.size(), MESH_MAX_CLUSTERS);
+    printf("\n");
+    printf("  state/node: %.1f neighbor entries (max %d, %d nodes full), %.1f cluster routes (max %d)\n",
+           nb / n, nb_max, full, cl / n, cl_max);
+    printf("              %.0f bytes in use, %u bytes allocated (3 tables)\n",
+           (nb * sizeof(nb_t) + cl * sizeof(cl_route_t)) / n, (unsigned)(3 * sizeof(nb_table_t)));
+    printf("  control:    %.1f HELLO frames, %.0f bytes sent per node per interval\n",
+           (double)(tx - tx0) / n / MEASURED, (double)(bytes - bytes0) / n / MEASURED);
+    printf("  reach:      onion route %.1f%% of %d pairs (%.2f hops, up to %d; shortest %.2f)\n",
+           100.0 * routed / pairs, pairs, routed ? route_hops / routed : 0, route_max, routed ? shortest / routed : 0);
+    if (sim_clustered) printf("              (onion routes stay in the cluster: %d of its %d pairs)\n", local_routed, local);
+    printf("              hop by hop  %.1f%% (%.2f hops)\n", 100.0 * walked / pairs, walked ? walk_hops / walked : 0);
+    if (sim_clustered) CHECK(walked * 100 >= pairs * MIN_REACH && local_routed * 100 >= local * MIN_REACH);
+}
+
+int main(int argc, char **argv) {
+    int n = argc > 1 ? atoi(argv[1]) : 1000;
+    double side = sqrt(n * M_PI / DEGREE);  // unit radio range
+    host_seed(29);
+    sim_random(n, side, 1.0);
+    sim_clustered = 0;
+    run("flat", 5);
+
+    host_seed(29);
+    sim_random(n, side, 1.0);
+    sim_clustered = 1;
+    // A cold start elects and drops many heads; routes to those die out as
+    // they reach MESH_CL_MAX_HOPS, so measure once they have.
+    run("clustered", MESH_CL_MAX_HOPS + 8);
+    return host_result("sim_scale");
+}
@@ -0,0 +1,114 @@
+// Buddy pool under random bundle traffic: blocks never overlap, the free
+// lists always account for every byte, bad frees (twice, inside a block,
+// off a unit, wrong size) change nothing, and fragmentation stays bounded:
+// small allocations only fail once most of the arena is in use, and with
+// everything freed the arena is whole blocks again.
+#include "host.h"
+#include "esp_random.h"
+#include "../bundle_pool.cpp"
+#include <vector>
+
+typedef struct { uint8_t *p; size_t len; uint8_t fill; } live_t;
+
+static size_t block_of(size_t len) { return (size_t)BUNDLE_POOL_MIN_BLOCK << order_of(len); }
+
+// Free lists against the stats and the tags: every free block is listed
+// once under its order, and free plus used bytes make up the arena.
+static void check_lists(void) {
+    uint32_t free_bytes = 0;
+    for (int o = 0; o <= TOP; o++) {
+        for (int u = head[o]; u != NIL; u = L(u)->next) {
+            CHECK(tag[u] == (o | TAG_FREE));
+            CHECK((u & ((1 << o) - 1)) == 0);
+            free_bytes += BUNDLE_POOL_MIN_BLOCK << o;
+        }
+    }
+    CHECK(free_bytes + stats.used == stats.capacity);
+}
+
+static size_t bundle_len(void) {
+    // Mostly short messages, some near the onion limit.
+    return esp_random() % 5 ? 40 + esp_random() % 400 : 400 + esp_random() % (BUNDLE_POOL_MAX_BLOCK - 399);
+}
+
+int main() {
+    host_seed(49);
+    CHECK(bundle_pool_init(DTN_RAM_BYTE_BUDGET));
+    bundle_pool_stats_t st;
+
+    // The double free that used to hand out one block twice.
+    uint8_t *a = bundle_pool_alloc(BUNDLE_POOL_MIN_BLOCK), *b = bundle_pool_alloc(BUNDLE_POOL_MIN_BLOCK);
+    CHECK(b == a + BUNDLE_POOL_MIN_BLOCK);
+    bundle_pool_free(a, BUNDLE_POOL_MIN_BLOCK);
+    bundle_pool_free(b, BUNDLE_POOL_MIN_BLOCK);
+    bundle_pool_stats(&st);
+    bundle_pool_free(b, BUNDLE_POOL_MIN_BLOCK);
+    bundle_pool_free(a, BUNDLE_POOL_MIN_BLOCK);
+    bundle_pool_stats_t after;
+    bundle_pool_stats(&after);
+    CHECK(after.frees == st.frees && after.used == 0 && after.largest_free == BUNDLE_POOL_MAX_BLOCK);
+    check_lists();
+
+    // Frees that name no live block of that size.
+    uint8_t *c = bundle_pool_alloc(3 * BUNDLE_POOL_MIN_BLOCK);
+    bundle_pool_stats(&st);
+    bundle_pool_free(c + BUNDLE_POOL_MIN_BLOCK, BUNDLE_POOL_MIN_BLOCK);      // inside it
+    bundle_pool_free(c + 2 * BUNDLE_POOL_MIN_BLOCK, 2 * BUNDLE_POOL_MIN_BLOCK);
+    bundle_pool_free(c + 1, 3 * BUNDLE_POOL_MIN_BLOCK);                       // off a unit
+    bundle_pool_free(c, BUNDLE_POOL_MIN_BLOCK);                               // wrong size
+    bundle_pool_free(c, 0);
+    bundle_pool_free(c - BUNDLE_POOL_MAX_BLOCK, BUNDLE_POOL_MIN_BLOCK);       // outside the arena
+    bundle_pool_stats(&after);
+    CHECK(after.frees == st.frees && after.used == st.used);
+    bundle_pool_free(c, 3 * BUNDLE_POOL_MIN_BLOCK);
+    check_lists();
+
+    std::vector<live_t> live;
+    uint32_t fails = 0, worst_fail_used = stats.capacity;
+    for (int step = 0; step < 200000; step++) {
+        if (live.empty() || esp_random() % 100 < 55) {
+            size_t len = bundle_len();
+            uint8_t *p = bundle_pool_alloc(len);
+            if (!p) {
+                // Fragmentation bounds. Buddies merge whenever both are
+                // free, so a refusal means every aligned region of the block
+                // size holds some allocation, at least one smallest block;
+                // and requests up to a quarter of the largest block are only
+                // refused with most of the arena in use.
+                fails++;
+                if (stats.used < worst_fail_used) worst_fail_used = stats.used;
+                CHECK(stats.used >= stats.capacity / block_of(len) * BUNDLE_POOL_MIN_BLOCK);
+                if (block_of(len) <= BUNDLE_POOL_MAX_BLOCK / 4) CHECK(stats.used * 4 >= stats.capacity * 3);
+            } else {
+                uint8_t fill = esp_random();
+                memset(p, fill, len);
+                live.push_back({ p, len, fill });
+            }
+        } else {
+            size_t k = esp_random() % live.size();
+            live_t e = live[k];
+            bool intact = true;
+            for (size_t i = 0; i < e.len; i++) intact &= e.p[i] == e.fill;
+            CHECK(intact);  // no other block was handed out over it
+            bundle_pool_free(e.p, e.len);
+            live[k] = live.back();
+            live.pop_back();
+        }
+        if (step % 1000 == 0) check_lists();
+    }
+    uint32_t held = 0;
+    for (const live_t &e : live) held += block_of(e.len);
+    CHECK(held == stats.used);
+    CHECK(fails > 0);  // the arena did fill up
+    printf("%u refusals, the emptiest at %u of %u bytes in use\n", (unsigned)fails, (unsigned)worst_fail_used,
+           (unsigned)stats.capacity);
+
+    for (const live_t &e : live) bundle_pool_free(e.p, e.len);
+    bundle_pool_stats(&st);
+    CHECK(st.used == 0 && st.requested == 0 && st.frag_pct == 0 && st.largest_free == BUNDLE_POOL_MAX_BLOCK);
+    int whole = 0;
+    for (int u = head[TOP]; u != NIL; u = L(u)->next) whole++;
+    CHECK(whole == (int)(st.capacity / BUNDLE_POOL_MAX_BLOCK));
+    check_lists();
+    return host_result("test_bundle_pool");
+}
@@ -0,0 +1,187 @@
+// Bundle store on the host's file-backed NOR flash, with power cut at every
+// point of a put and of a GC step: after the "reboot" each bundle is
+// restored exactly once with its data, or (only the one being put) not at
+// all, and the store keeps working.
+#define HOST_LOG_LEVEL 0  // cut writes log every failure
+#include "host.h"
+#include <Arduino.h>
+#include <stdio.h>
+#include <map>
+#include <string>
+
+// Power cut: once budget bytes have been written the rest of that write and
+// every later one are lost, until the next boot.
+static long budget = -1;
+static size_t cut_fwrite(const void *p, size_t sz, size_t n, FILE *f) {
+    if (budget < 0) return fwrite(p, sz, n, f);
+    size_t bytes = sz * n, k = (size_t)budget < bytes ? (size_t)budget : bytes;
+    if (k) fwrite(p, 1, k, f);
+    budget -= k;
+    return k == bytes ? n : 0;
+}
+#define fwrite cut_fwrite
+#include "../bundle_store.cpp"
+#undef fwrite
+
+typedef std::map<uint16_t, std::string> model_t;  // slot -> dest + data
+static model_t found_now;
+
+static std::string payload(uint16_t slot, int gen, size_t len) {
+    std::string s(len, 0);
+    for (size_t i = 0; i < len; i++) s[i] = (char)(slot * 31 + gen * 7 + i);
+    return s;
+}
+
+static void on_found(uint16_t slot, const char *dest, size_t len) {
+    CHECK(!found_now.count(slot));  // exactly once
+    std::string data(len, 0);
+    CHECK(bundle_store_get(slot, (uint8_t*)&data[0], len));
+    found_now[slot] = std::string(dest) + "|" + data;
+}
+
+static void boot(void) {
+    if (part) fclose(part);
+    part = NULL;
+    budget = -1;
+    memset(fill, 0, sizeof(fill));
+    memset(live, 0, sizeof(live));
+    memset(erases, 0, sizeof(erases));
+    found_now.clear();
+    CHECK(bundle_store_init(on_found));
+}
+
+static void wipe(void) {
+    if (part) fclose(part);
+    part = NULL;
+    remove(BUNDLE_STORE_HOST_FILE);
+}
+
+static bool put(model_t &m, uint16_t slot, int gen, size_t len) {
+    char dest[32];
+    snprintf(dest, sizeof(dest), "node-%u", slot % 7);
+    std::string d = payload(slot, gen, len);
+    if (!bundle_store_put(slot, dest, (const uint8_t*)d.data(), len)) return false;
+    m[slot] = std::string(dest) + "|" + d;
+    return true;
+}
+
+static bool gc_once(void) {
+    xSemaphoreTake(store_lock, portMAX_DELAY);
+    bool ok = gc_step();
+    xSemaphoreGive(store_lock);
+    return ok;
+}
+
+// Bytes one call of f writes.
+template <typename F> static long writes_of(F f) {
+    budget = 1L << 30;
+    f();
+    long n = (1L << 30) - budget;
+    budget = -1;
+    return n;
+}
+
+static void restore(void) {
+    wipe();
+    boot();
+    model_t m;
+    for (uint16_t s = 0; s < 40; s++) CHECK(put(m, s * 3, 0, 50 + s * 37 % 900));
+    for (uint16_t s = 0; s < 40; s += 4) {
+        bundle_store_del(s * 3);
+        m.erase(s * 3);
+    }
+    CHECK(put(m, 9, 1, 333));  // replaces slot 9's record
+    boot();
+    CHECK(found_now == m);
+    boot();  // a clean boot changes nothing
+    CHECK(found_now == m);
+}
+
+// Cut a put at every byte: the old bundles survive, the new one is there
+// whole or not at all, and puts after the reboot work and persist.
+static void torn_put(void) {
+    wipe();
+    boot();
+    model_t base;
+    for (uint16_t s = 0; s < 5; s++) CHECK(put(base, s, 0, 200));
+    fclose(part);
+    part = NULL;
+    FILE *src = fopen(BUNDLE_STORE_HOST_FILE, "rb");
+    std::string image(BUNDLE_STORE_HOST_SIZE, 0);
+    CHECK(fread(&image[0], 1, image.size(), src) == image.size());
+    fclose(src);
+    boot();
+    model_t tmp = base;
+    long total = writes_of([&] { put(tmp, 7, 0, 300); });
+    CHECK(total > 300);
+    int whole = 0;
+    for (long cut = 0; cut < total; cut++) {
+        FILE *dst = fopen(BUNDLE_STORE_HOST_FILE, "wb");
+        fwrite(image.data(), 1, image.size(), dst);
+        fclose(dst);
+        boot();
+        model_t m = base;
+        budget = cut;
+        put(m, 7, 0, 300);
+        boot();
+        model_t want = base;
+        if (found_now.count(7)) {
+            want[7] = m.count(7) ? m[7] : tmp[7];
+            whole++;
+        }
+        CHECK(found_now == want);
+        CHECK(put(want, 11, cut, 120));
+        boot();
+        CHECK(found_now == want);
+    }
+    CHECK(whole <= 1);  // only a cut after the VALID flip keeps it
+}
+
+// Fill enough sectors that GC has work, then cut a GC step (copies and the
+// erase) at every byte: every live bundle comes back exactly once.
+static void torn_gc(void) {
+    wipe();
+    boot();
+    model_t base;
+    int gen = 0;
+    for (int round = 0; round < 4; round++) {
+        for (uint16_t s = 0; s < 12; s++) CHECK(put(base, s, gen++, 900));
+    }
+    for (uint16_t s = 0; s < 12; s += 3) {
+        bundle_store_del(s);
+        base.erase(s);
+    }
+    fclose(part);
+    part = NULL;
+    FILE *src = fopen(BUNDLE_STORE_HOST_FILE, "rb");
+    std::string image(BUNDLE_STORE_HOST_SIZE, 0);
+    CHECK(fread(&image[0], 1, image.size(), src) == image.size());
+    fclose(src);
+    boot();
+    CHECK(found_now == base);
+    long total = writes_of([] { gc_once(); });
+    CHECK(total > SEC_SIZE);  // copied something and erased
+    for (long cut = 0; cut <= total; cut += cut < 64 ? 1 : 61) {
+        FILE *dst = fopen(BUNDLE_STORE_HOST_FILE, "wb");
+        fwrite(image.data(), 1, image.size(), dst);
+        fclose(dst);
+        boot();
+        budget = cut;
+        gc_once();
+        boot();
+        CHECK(found_now == base);
+        model_t m = base;
+        for (int i = 0; i < 8; i++) CHECK(gc_once() || used < 2);
+        CHECK(put(m, 5, 99, 500));
+        boot();
+        CHECK(found_now == m);
+    }
+}
+
+int main() {
+    restore();
+    torn_put();
+    torn_gc();
+    wipe();
+    return host_result("test_bundle_store");
+}
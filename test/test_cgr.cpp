@@ -0,0 +1,41 @@
+// Contact plan volume: a route reserves its bytes on every contact, and
+// cgr_release() gives them back, so a plan does not fill up with bundles
+// that are gone. Releases against a replaced plan change nothing.
+#include "host.h"
+#include "../cgr.cpp"
+#include <stdio.h>
+
+static void load(const char *contacts) {
+    char json[512];
+    int n = snprintf(json, sizeof(json), "{\"type\":\"CONTACT_PLAN\",\"now\":1000000,\"contacts\":[%s]}", contacts);
+    CHECK(cgr_load(json, n));
+}
+
+int main() {
+    cgr_init();
+    // 1000 bytes from here to B, then 2000 from B to C.
+    load("[\"" NODE_ID "\",\"B\",1000010,1000020,100],[\"B\",\"C\",1000030,1000040,200]");
+
+    uint8_t c;
+    uint16_t g;
+    uint64_t r1, r2, r3;
+    CHECK(cgr_route("C", 400, &c, &g, &r1));
+    CHECK(c == 0 && r1 == 3);
+    CHECK(cgr_route("B", 400, &c, &g, &r2));
+    CHECK(r2 == 1);
+    CHECK(!cgr_route("C", 400, &c, &g, &r3));  // 200 left to B
+
+    cgr_release(r1, g, 400);
+    CHECK(P[0].left == 600 && P[1].left == 2000);
+    CHECK(cgr_route("C", 400, &c, &g, &r3));
+    cgr_release(r2, g, 400);
+    cgr_release(r3, g, 400);
+    CHECK(P[0].left == 1000 && P[1].left == 2000);
+
+    // A new plan starts with full volume; old routes no longer count.
+    CHECK(cgr_route("B", 1000, &c, &g, &r1));
+    load("[\"" NODE_ID "\",\"B\",1000010,1000020,100]");
+    cgr_release(r1, g, 1000);
+    CHECK(P[0].left == 1000);
+    return host_result("test_cgr");
+}
@@ -0,0 +1,139 @@
+// Key directory records must be certified by the anchor: a self-signed
+// record for someone else's id is dropped and does not keep the real owner's
+// record out, and a node only publishes once it holds a valid certificate.
+#include "host.h"
+static char anchor_hex[65];
+#define KEYDIR_ANCHOR_PUB anchor_hex
+#include "../keydir.cpp"
+#include <map>
+#include <string>
+#include <vector>
+
+typedef struct { uint8_t sk[64], pub[32]; } kp_t;
+
+static void kp_make(kp_t *k, uint8_t seed_byte) {
+    uint8_t seed[32];
+    memset(seed, seed_byte, 32);
+    crypto_eddsa_key_pair(k->sk, k->pub, seed);
+}
+
+static kp_t anchor, self_kp;
+static std::vector<std::string> sent;
+static std::map<std::string, std::string> blobs;
+
+uint32_t mesh_id_hash(const char *id) {
+    uint32_t h = 2166136261u;
+    for (; *id; id++) h = (h ^ (uint8_t)*id) * 16777619u;
+    return h;
+}
+bool mesh_get_ed25519_pub(const char*, uint8_t*) { return false; }
+bool radio_send(const char*, const uint8_t *buf, size_t len) { sent.push_back(std::string((const char*)buf, len)); return true; }
+bool storage_get_blob(const char *key, void *buf, size_t *len) {
+    auto it = blobs.find(key);
+    if (it == blobs.end() || it->second.size() > *len) return false;
+    memcpy(buf, it->second.data(), it->second.size());
+    *len = it->second.size();
+    return true;
+}
+bool storage_set_blob(const char *key, const void *buf, size_t len) { blobs[key] = std::string((const char*)buf, len); return true; }
+const uint8_t* crypto_get_ed25519_public(void) { return self_kp.pub; }
+void crypto_sign(uint8_t sig[64], const uint8_t *msg, size_t len) { crypto_eddsa_sign(sig, self_kp.sk, msg, len); }
+bool crypto_verify(const uint8_t sig[64], const uint8_t pub[32], const uint8_t *msg, size_t len) { return crypto_eddsa_check(sig, pub, msg, len) == 0; }
+
+// A record for id signed by owner, its certificate signed by issuer.
+static kd_rec_t make_rec(const char *id, const kp_t *owner, const kp_t *issuer, uint8_t x, uint32_t seq) {
+    kd_rec_t r;
+    memset(&r, 0, sizeof(r));
+    strcpy(r.id, id);
+    memset(r.x_pub, x, 32);
+    memcpy(r.e_pub, owner->pub, 32);
+    r.seq = seq;
+    uint8_t msg[100];
+    rec_signed_bytes(&r, msg);
+    crypto_eddsa_sign(r.sig, owner->sk, msg, sizeof(msg));
+    cert_bytes(id, owner->pub, msg);
+    crypto_eddsa_sign(r.cert, issuer->sk, msg, 64);
+    return r;
+}
+
+static void deliver(const char *type, const kd_rec_t *r) {
+    static uint32_t q = 100;
+    cJSON *m = cJSON_CreateObject();
+    cJSON_AddStringToObject(m, "type", type);
+    cJSON_AddItemToObject(m, "rec", rec_to_json(r));
+    cJSON_AddNumberToObject(m, "q", q++);
+    cJSON_AddNumberToObject(m, "ttl", 0);
+    cJSON_AddStringToObject(m, "via", "peer");
+    char *txt = cJSON_PrintUnformatted(m);
+    keydir_on_frame((const uint8_t*)txt, strlen(txt));
+    free(txt);
+    cJSON_Delete(m);
+}
+
+static bool x_pub_is(const char *id, uint8_t x) {
+    uint8_t out[32], want[32];
+    memset(want, x, 32);
+    return keydir_get_x25519_pub(id, out) && !memcmp(out, want, 32);
+}
+
+static bool answers_get(const char *id) {
+    static uint32_t q = 1000;
+    char txt[128];
+    snprintf(txt, sizeof(txt), "{\"type\":\"KEY_GET\",\"id\":\"%s\",\"q\":%u,\"ttl\":0,\"via\":\"peer\"}", id, (unsigned)q++);
+    sent.clear();
+    keydir_on_frame((const uint8_t*)txt, strlen(txt));
+    return sent.size() == 1 && sent[0].find("KEY_REC") != std::string::npos;
+}
+
+int main() {
+    kp_t owner, thief;
+    kp_make(&anchor, 1);
+    kp_make(&self_kp, 2);
+    kp_make(&owner, 3);
+    kp_make(&thief, 4);
+    for (int i = 0; i < 32; i++) sprintf(anchor_hex + i * 2, "%02x", anchor.pub[i]);
+    keydir_init();
+    CHECK(kd_anchored && !kd_certified);
+    CHECK(!answers_get(NODE_ID));  // nothing to publish without a certificate
+
+    // Self-certified by the thief, or the owner's certificate on the thief's
+    // key: dropped, and the owner's record still lands afterwards.
+    kd_rec_t self_made = make_rec("owner", &thief, &thief, 0xEE, 9);
+    deliver("KEY_PUT", &self_made);
+    CHECK(!x_pub_is("owner", 0xEE));
+    kd_rec_t good = make_rec("owner", &owner, &anchor, 0x11, 1);
+    kd_rec_t borrowed = good;
+    memcpy(borrowed.e_pub, thief.pub, 32);
+    uint8_t msg[100];
+    rec_signed_bytes(&borrowed, msg);
+    crypto_eddsa_sign(borrowed.sig, thief.sk, msg, sizeof(msg));
+    deliver("KEY_PUT", &borrowed);
+    CHECK(!x_pub_is("owner", 0x11));
+    deliver("KEY_PUT", &good);
+    CHECK(x_pub_is("owner", 0x11));
+
+    // Certified records refresh; a tampered one does not.
+    kd_rec_t newer = make_rec("owner", &owner, &anchor, 0x22, 2);
+    newer.x_pub[0] ^= 1;
+    deliver("KEY_REC", &newer);
+    CHECK(x_pub_is("owner", 0x11));
+    newer = make_rec("owner", &owner, &anchor, 0x22, 2);
+    deliver("KEY_REC", &newer);
+    CHECK(x_pub_is("owner", 0x22));
+
+    // Installing this node's certificate: only the anchor's signature counts.
+    uint8_t cert[64];
+    char json[200], hex[129];
+    cert_bytes(NODE_ID, self_kp.pub, msg);
+    crypto_eddsa_sign(cert, thief.sk, msg, 64);
+    for (int i = 0; i < 64; i++) sprintf(hex + i * 2, "%02x", cert[i]);
+    snprintf(json, sizeof(json), "{\"type\":\"KEY_CERT\",\"c\":\"%s\"}", hex);
+    CHECK(!keydir_load_cert(json, strlen(json)) && !kd_certified);
+    crypto_eddsa_sign(cert, anchor.sk, msg, 64);
+    for (int i = 0; i < 64; i++) sprintf(hex + i * 2, "%02x", cert[i]);
+    snprintf(json, sizeof(json), "{\"type\":\"KEY_CERT\",\"c\":\"%s\"}", hex);
+    CHECK(keydir_load_cert(json, strlen(json)) && kd_certified);
+    CHECK(blobs.count("kd_cert") && blobs["kd_cert"].size() == 64);
+    CHECK(answers_get(NODE_ID));
+    return host_result("test_keydir");
+}
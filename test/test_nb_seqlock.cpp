@@ -0,0 +1,109 @@
+// Neighbor table seqlock under concurrent writers and lock-free readers.
+// Built with -fsanitize=thread (make tsan): any plain access to the
+// published tables racing a publish is reported, and every snapshot a
+// reader keeps must be one some writer actually published.
+#include "host.h"
+#include "../mesh.cpp"
+#include <thread>
+#include <vector>
+
+#define NODES   40   // more than MAX_NB, so the table fills and entries churn
+#define WRITES  2000
+#define READERS 4
+
+static std::atomic<bool> stop(false);
+
+static void node_name(char *out, int i) { snprintf(out, 32, "node-%02d", i); }
+
+// Every key byte of a published entry carries the same version.
+static void upsert(int node, uint8_t v) {
+    char id[32];
+    node_name(id, node);
+    hello_t h;
+    memset(&h, 0, sizeof(h));
+    h.id = id;
+    h.via = id;
+    h.direct = true;
+    memset(h.x_pub, v, 32);
+    memset(h.e_pub, v, 32);
+    h.hops = 0;
+    h.nb2_n = v % (MESH_MAX_NB2 + 1);
+    for (int k = 0; k < h.nb2_n; k++) h.nb2[k] = mesh_id_hash(id) + v + k;
+    h.selects_me = v & 1;
+    nb_upsert(&h);
+}
+
+static void writer(int seed) {
+    for (int i = 0; i < WRITES; i++) {
+        upsert((i * 7 + seed) % NODES, (uint8_t)(i + seed));
+        if (i % 250 == 249) {
+            host_advance_ms(NB_EXPIRE_MS / 4);  // let some entries time out
+            nb_expire();
+        }
+    }
+}
+
+static void check_snapshot(void) {
+    const nb_table_t *t;
+    uint32_t seq;
+    nb_t e[MAX_NB];
+    int n;
+    do {
+        seq = nb_read_begin(&t);
+        n = nb_count(t);
+        for (int i = 0; i < n; i++) nb_get(t, i, &e[i]);
+    } while (nb_read_retry(seq));
+    for (int i = 0; i < n; i++) {
+        bool same = true;
+        for (int k = 0; k < 32; k++) same &= e[i].x_pub[k] == e[i].x_pub[0] && e[i].e_pub[k] == e[i].x_pub[0];
+        CHECK(same);
+        CHECK(e[i].h == mesh_id_hash(e[i].id));
+        CHECK(e[i].nb2_n == e[i].x_pub[0] % (MESH_MAX_NB2 + 1));
+        for (int j = 0; j < i; j++) CHECK(strcmp(e[i].id, e[j].id));
+    }
+}
+
+static void reader(int r) {
+    char id[32], hops[DTN_MAX_NEXT_HOPS][32];
+    uint8_t x[32], ed[32];
+    int i = 0;
+    while (!stop) {
+        check_snapshot();
+        node_name(id, i++ % NODES);
+        if (mesh_get_x25519_pub(id, x)) {
+            bool same = true;
+            for (int k = 0; k < 32; k++) same &= x[k] == x[0];
+            CHECK(same);
+        }
+        mesh_get_ed25519_pub(id, ed);
+        nb_link_key_by_hash(mesh_id_hash(id), x);
+        nb_link_key(id, x);
+        nb_selected_by(id);
+        nb_my_cluster();
+        mesh_next_hops(id, hops, DTN_MAX_NEXT_HOPS);
+        const char *route[ONION_MAX_HOPS];
+        size_t len;
+        if (mesh_choose_route(id, route, &len)) {
+            for (size_t k = 0; k < len; k++) free((void*)route[k]);
+        }
+        if (r == 0) {
+            nb_dirty = true;
+            nb_last_persist = 0;
+            nb_persist();  // hello task only, like on the node
+        }
+    }
+}
+
+int main(void) {
+    mesh_init();
+    std::vector<std::thread> th;
+    for (int r = 0; r < READERS; r++) th.emplace_back(reader, r);
+    std::thread w1(writer, 0), w2(writer, 3);
+    w1.join();
+    w2.join();
+    stop = true;
+    for (auto &t : th) t.join();
+    check_snapshot();
+    CHECK(nb_seq % 2 == 0);
+    return host_result("test_nb_seqlock");
+}
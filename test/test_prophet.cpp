@@ -0,0 +1,65 @@
+// PRoPHET table replacement: once the table is full, a transitive value only
+// takes the least likely entry's slot when it beats it, so a neighbor's long
+// list of weak predictabilities cannot push out the nodes we actually meet.
+#include "host.h"
+#include "../prophet.cpp"
+#include <stdio.h>
+
+uint32_t mesh_id_hash(const char *id) {
+    uint32_t h = 2166136261u;
+    for (; *id; id++) h = (h ^ (uint8_t)*id) * 16777619u;
+    return h;
+}
+
+static void meet(int k) {
+    char id[16];
+    snprintf(id, sizeof(id), "n%d", k);
+    prophet_encounter(id);
+}
+
+static uint8_t get(int k) {
+    char id[16];
+    snprintf(id, sizeof(id), "n%d", k);
+    return prophet_get(id);
+}
+
+int main() {
+    // A full table of direct encounters.
+    for (int k = 0; k < DTN_PROPHET_SIZE; k++) meet(k);
+    CHECK(TN == DTN_PROPHET_SIZE);
+    uint8_t direct = get(0);
+    CHECK(direct > 0);
+
+    // n0 knows many nodes we have never met, all at full predictability:
+    // P(n0) * 1 * beta stays below a direct encounter, so nothing is replaced.
+    uint32_t h[DTN_PROPHET_SIZE];
+    uint8_t p[DTN_PROPHET_SIZE];
+    char id[16];
+    for (int i = 0; i < DTN_PROPHET_SIZE; i++) {
+        snprintf(id, sizeof(id), "far%d", i);
+        h[i] = mesh_id_hash(id);
+        p[i] = 255;
+    }
+    prophet_transitive("n0", h, p, DTN_PROPHET_SIZE);
+    for (int k = 0; k < DTN_PROPHET_SIZE; k++) CHECK(get(k) == direct);
+    CHECK(prophet_get("far0") == 0);
+
+    // Aged down, the direct entries lose to fresh transitive values, and
+    // each replacement takes the weakest slot rather than n0's.
+    host_advance_ms(200 * DTN_PROPHET_AGE_UNIT_MS);
+    meet(0);
+    prophet_transitive("n0", h, p, 4);
+    for (int i = 0; i < 4; i++) {
+        snprintf(id, sizeof(id), "far%d", i);
+        CHECK(prophet_get(id) > get(DTN_PROPHET_SIZE - 1));
+    }
+    CHECK(get(0) > 0);
+
+    // A value worth keeping but no better than the weakest entry (about
+    // 0.013 after aging) still changes nothing.
+    uint32_t weak = mesh_id_hash("weak");
+    uint8_t low = 15;  // 0.76 * 15/255 * beta = 0.011
+    prophet_transitive("n0", &weak, &low, 1);
+    CHECK(prophet_get("weak") == 0);
+    return host_result("test_prophet");
+}